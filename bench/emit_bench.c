@@ -0,0 +1,84 @@
+// Static push/pop counts of the default (non -i) backend over the given
+// files, usually examples/*.c, with locals kept in registers and with
+// every local in the frame (-no-reg-vars). "frame" counts instructions
+// that access memory through rbp. Each file is compiled in a child
+// process; files that do not compile are reported and skipped.
+#define _POSIX_C_SOURCE 200809L
+#include "../src/hoc.h"
+#include <time.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool starts_with(char* p, char* prefix) {
+  return strncmp(p, prefix, strlen(prefix)) == 0;
+}
+
+static void count(char* path, bool var_regs) {
+  // コンパイルエラーのメッセージは数に関係ないので捨てる
+  freopen("/dev/null", "w", stderr);
+
+  asm_set_comments(false);
+  emit_set_var_regs(var_regs);
+  asm_capture();
+  double t = now();
+  use_arena(ARENA_TOKEN);
+  Token* tokens = lex(path);
+  tokens = preprocess(dirname(format("%s", path)), tokens);
+  use_arena(ARENA_AST);
+  Program* prog = parse(tokens);
+  sema(prog);
+  fold(prog);
+  emit_x86(prog);
+  char* text = asm_take();
+  double sec = now() - t;
+
+  size_t insts = 0;
+  size_t pushes = 0;
+  size_t pops = 0;
+  size_t frame = 0;
+  for (char* p = text; *p;) {
+    char* end = strchr(p, '\n');
+    if (*p == '\t' && p[1] != '.') {
+      insts++;
+      if (starts_with(p, "\tpush ")) {
+        pushes++;
+      } else if (starts_with(p, "\tpop ")) {
+        pops++;
+      }
+      for (char* q = p; q < end; q++) {
+        if (starts_with(q, "[rbp")) {
+          frame++;
+          break;
+        }
+      }
+    }
+    p = end + 1;
+  }
+  printf("%-28s %-8s %7zu insts %6zu push %6zu pop %6zu frame %7.3f ms\n",
+         path, var_regs ? "regs" : "frame", insts, pushes, pops, frame,
+         sec * 1e3);
+  exit(0);
+}
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    for (int var_regs = 1; var_regs >= 0; var_regs--) {
+      fflush(stdout);
+      int pid = fork();
+      if (pid == 0) {
+        count(argv[i], var_regs);
+      }
+      int status = 0;
+      waitpid(pid, &status, 0);
+      if (status != 0) {
+        printf("%-28s does not compile\n", argv[i]);
+        break;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,52 @@
+// Lexer throughput on src/*.c concatenated N times (default 100).
+#define _POSIX_C_SOURCE 200809L
+#include "../src/hoc.h"
+#include <glob.h>
+#include <time.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  int repeat = argc > 1 ? atoi(argv[1]) : 100;
+  char* path = "/tmp/hoc_lex_bench.c";
+
+  glob_t g;
+  if (glob("src/*.c", 0, NULL, &g) != 0) {
+    error("run from the repository root\n");
+  }
+
+  FILE* out = fopen(path, "w");
+  for (int r = 0; r < repeat; r++) {
+    for (size_t i = 0; i < g.gl_pathc; i++) {
+      FILE* in = fopen(g.gl_pathv[i], "r");
+      char buf[4096];
+      size_t n;
+      while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, n, out);
+      }
+      fclose(in);
+    }
+  }
+  long bytes = ftell(out);
+  fclose(out);
+  globfree(&g);
+
+  use_arena(ARENA_TOKEN);
+  double t = now();
+  Token* tokens = lex(path);
+  double sec = now() - t;
+
+  size_t count = 0;
+  for (Token* tok = tokens; tok != NULL; tok = tok->next) {
+    count++;
+  }
+
+  printf("lex: %ld bytes, %zu tokens in %.3f ms: %.1f MB/s, %.2f Mtokens/s\n",
+         bytes, count, sec * 1e3, bytes / sec / 1e6, count / sec / 1e6);
+  remove(path);
+  return 0;
+}
@@ -0,0 +1,43 @@
+// Expands an object-like macro whose body is N tokens long (default 1000000)
+// defined on a single #define line.
+#define _POSIX_C_SOURCE 200809L
+#include "../src/hoc.h"
+#include <time.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  long body = argc > 1 ? atol(argv[1]) : 1000000;
+  char* path = "/tmp/hoc_macro_bench.c";
+
+  // 本体は "1 +" の繰り返しで1トークン余る
+  FILE* out = fopen(path, "w");
+  fprintf(out, "#define BIG");
+  for (long i = 0; i < body / 2; i++) {
+    fprintf(out, " 1 +");
+  }
+  fprintf(out, " 1\nint x = BIG;\n");
+  fclose(out);
+
+  use_arena(ARENA_TOKEN);
+  double t = now();
+  Token* tokens = lex(path);
+  double lexed = now();
+  Token* result = preprocess("/tmp", tokens);
+  double sec = now() - lexed;
+
+  size_t count = 0;
+  for (Token* tok = result; tok != NULL; tok = tok->next) {
+    count++;
+  }
+
+  printf("macro: lex %.3f ms, preprocess %zu tokens in %.3f ms: %.2f "
+         "Mtokens/s\n",
+         (lexed - t) * 1e3, count, sec * 1e3, count / sec / 1e6);
+  remove(path);
+  return 0;
+}
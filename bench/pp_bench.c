@@ -0,0 +1,51 @@
+// Preprocessor throughput on a generated translation unit of about N tokens
+// (default 200000) that uses object-like and function-like macros and an
+// #include.
+#define _POSIX_C_SOURCE 200809L
+#include "../src/hoc.h"
+#include <time.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  long target = argc > 1 ? atol(argv[1]) : 200000;
+  char* dir = "/tmp";
+  char* header = "/tmp/hoc_pp_bench.h";
+  char* path = "/tmp/hoc_pp_bench.c";
+
+  FILE* h = fopen(header, "w");
+  fprintf(h, "#define ONE 1\n");
+  fprintf(h, "#define ADD(a, b) ((a) + (b))\n");
+  fprintf(h, "#define TWICE(x) ADD(x, x)\n");
+  fclose(h);
+
+  // 1行あたり展開後で26トークン
+  FILE* out = fopen(path, "w");
+  fprintf(out, "#include \"hoc_pp_bench.h\"\n");
+  for (long i = 0; i * 26 < target; i++) {
+    fprintf(out, "int v%ld = TWICE(ADD(%ld, ONE));\n", i, i);
+  }
+  fclose(out);
+
+  use_arena(ARENA_TOKEN);
+  Token* tokens = lex(path);
+
+  double t = now();
+  Token* result = preprocess(dir, tokens);
+  double sec = now() - t;
+
+  size_t count = 0;
+  for (Token* tok = result; tok != NULL; tok = tok->next) {
+    count++;
+  }
+
+  printf("preprocess: %zu tokens in %.3f ms: %.2f Mtokens/s\n", count,
+         sec * 1e3, count / sec / 1e6);
+  remove(path);
+  remove(header);
+  return 0;
+}
@@ -0,0 +1,108 @@
+// StringBuilder append throughput: the current implementation against
+// the previous one, which grew the buffer by 8 bytes per realloc.
+#define _POSIX_C_SOURCE 200809L
+#include "../src/hoc.h"
+#include <time.h>
+
+static void old_sb_putc(StringBuilder* sb, char c) {
+  while (sb->length >= sb->capacity) {
+    sb->capacity += 8;
+    sb->buf = realloc(sb->buf, sizeof(char) * sb->capacity);
+  }
+  sb->buf[sb->length] = c;
+  sb->length++;
+}
+
+static void old_sb_puts(StringBuilder* sb, char* str) {
+  for (size_t i = 0; i < strlen(str); i++) {
+    old_sb_putc(sb, str[i]);
+  }
+}
+
+static StringBuilder* old_new_sb(void) {
+  StringBuilder* sb = calloc(1, sizeof(StringBuilder));
+  sb->buf = calloc(8, sizeof(char));
+  sb->capacity = 8;
+  return sb;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(char* name, size_t bytes, double sec) {
+  printf("%-24s %10zu bytes %8.3f ms %10.1f MB/s\n", name, bytes, sec * 1e3,
+         bytes / sec / 1e6);
+}
+
+int main(int argc, char** argv) {
+  size_t total = argc > 1 ? strtoul(argv[1], NULL, 10) : 4 * 1024 * 1024;
+  char* word = "mov rax, QWORD PTR [rbp-8]\n";
+  size_t word_len = strlen(word);
+
+  StringBuilder* sb = old_new_sb();
+  double t = now();
+  for (size_t i = 0; i < total; i++) {
+    old_sb_putc(sb, 'a' + i % 26);
+  }
+  report("old sb_putc", sb->length, now() - t);
+  free(sb_run(sb));
+
+  sb = new_sb();
+  t = now();
+  for (size_t i = 0; i < total; i++) {
+    sb_putc(sb, 'a' + i % 26);
+  }
+  report("new sb_putc", sb->length, now() - t);
+  free(sb_run(sb));
+
+  sb = old_new_sb();
+  t = now();
+  while (sb->length < total) {
+    old_sb_puts(sb, word);
+  }
+  report("old sb_puts", sb->length, now() - t);
+  free(sb_run(sb));
+
+  sb = new_sb();
+  t = now();
+  while (sb->length < total) {
+    sb_append(sb, word, word_len);
+  }
+  report("new sb_append", sb->length, now() - t);
+  free(sb_run(sb));
+
+  sb = old_new_sb();
+  t = now();
+  for (int i = 0; sb->length < total; i++) {
+    char* s = format("\tpush %d\n", i);
+    old_sb_puts(sb, s);
+    free(s);
+  }
+  report("old sb_puts(format())", sb->length, now() - t);
+  free(sb_run(sb));
+
+  sb = new_sb();
+  t = now();
+  for (int i = 0; sb->length < total; i++) {
+    sb_printf(sb, "\tpush %d\n", i);
+  }
+  report("new sb_printf", sb->length, now() - t);
+  free(sb_run(sb));
+
+  // reuse one buffer
+  sb = new_sb();
+  t = now();
+  size_t bytes = 0;
+  for (size_t i = 0; bytes < total; i++) {
+    sb_reset(sb);
+    sb_append(sb, word, word_len);
+    bytes += sb->length;
+  }
+  report("new sb_reset+append", bytes, now() - t);
+  free(sb_run(sb));
+
+  return 0;
+}
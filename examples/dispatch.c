@@ -0,0 +1,189 @@
+// switchの分岐の速さを測るベンチマーク。
+// 値が密に並んだ命令のswitchで回るスタックマシンと、値が疎らなswitchで分類する処理を何度も繰り返す
+int printf();
+
+#define OP_HALT 0
+#define OP_PUSH 1
+#define OP_POP 2
+#define OP_DUP 3
+#define OP_SWAP 4
+#define OP_OVER 5
+#define OP_ADD 6
+#define OP_SUB 7
+#define OP_MUL 8
+#define OP_MOD 9
+#define OP_NEG 10
+#define OP_LT 11
+#define OP_EQ 12
+#define OP_NOT 13
+#define OP_AND 14
+#define OP_OR 15
+#define OP_XOR 16
+#define OP_INC 17
+#define OP_DEC 18
+#define OP_LOAD0 19
+#define OP_LOAD1 20
+#define OP_LOAD2 21
+#define OP_LOAD3 22
+#define OP_STORE0 23
+#define OP_STORE1 24
+#define OP_STORE2 25
+#define OP_STORE3 26
+#define OP_JMP 27
+#define OP_JZ 28
+#define OP_JNZ 29
+#define OP_ADD1 30
+#define OP_ADD2 31
+#define OP_ADD3 32
+#define OP_ADD4 33
+#define OP_ADD5 34
+#define OP_ADD6 35
+#define OP_ADD7 36
+#define OP_ADD8 37
+#define OP_MUL2 38
+#define OP_MUL3 39
+#define OP_MUL5 40
+#define OP_MUL7 41
+#define OP_CLASSIFY 42
+#define OP_NOP 43
+
+int code[128];
+int stack[64];
+int vars[4];
+
+// 疎らな値のswitch。二分探索になる
+int classify(int n) {
+  switch (n) {
+  case -1000: return 1;
+  case 0: return 2;
+  case 1: return 3;
+  case 7: return 4;
+  case 42: return 5;
+  case 100: return 6;
+  case 255: return 7;
+  case 256: return 8;
+  case 1000: return 9;
+  case 4096: return 10;
+  case 10000: return 11;
+  case 65535: return 12;
+  case 100000: return 13;
+  case 1000000: return 14;
+  default: return 0;
+  }
+}
+
+// 値が密に並んだswitch。ジャンプテーブルになる
+int run(int* code) {
+  int pc = 0;
+  int sp = 0;
+  int a = 0;
+  int op = 0;
+  for (;;) {
+    op = code[pc];
+    pc++;
+    switch (op) {
+    case OP_HALT: return stack[sp - 1];
+    case OP_PUSH: stack[sp] = code[pc]; sp++; pc++; break;
+    case OP_POP: sp--; break;
+    case OP_DUP: stack[sp] = stack[sp - 1]; sp++; break;
+    case OP_SWAP: a = stack[sp - 1]; stack[sp - 1] = stack[sp - 2]; stack[sp - 2] = a; break;
+    case OP_OVER: stack[sp] = stack[sp - 2]; sp++; break;
+    case OP_ADD: sp--; stack[sp - 1] = stack[sp - 1] + stack[sp]; break;
+    case OP_SUB: sp--; stack[sp - 1] = stack[sp - 1] - stack[sp]; break;
+    case OP_MUL: sp--; stack[sp - 1] = stack[sp - 1] * stack[sp]; break;
+    case OP_MOD: sp--; stack[sp - 1] = stack[sp - 1] % stack[sp]; break;
+    case OP_NEG: stack[sp - 1] = -stack[sp - 1]; break;
+    case OP_LT: sp--; stack[sp - 1] = stack[sp - 1] < stack[sp]; break;
+    case OP_EQ: sp--; stack[sp - 1] = stack[sp - 1] == stack[sp]; break;
+    case OP_NOT: stack[sp - 1] = !stack[sp - 1]; break;
+    case OP_AND: sp--; stack[sp - 1] = stack[sp - 1] & stack[sp]; break;
+    case OP_OR: sp--; stack[sp - 1] = stack[sp - 1] | stack[sp]; break;
+    case OP_XOR: sp--; stack[sp - 1] = stack[sp - 1] ^ stack[sp]; break;
+    case OP_INC: stack[sp - 1]++; break;
+    case OP_DEC: stack[sp - 1]--; break;
+    case OP_LOAD0: stack[sp] = vars[0]; sp++; break;
+    case OP_LOAD1: stack[sp] = vars[1]; sp++; break;
+    case OP_LOAD2: stack[sp] = vars[2]; sp++; break;
+    case OP_LOAD3: stack[sp] = vars[3]; sp++; break;
+    case OP_STORE0: sp--; vars[0] = stack[sp]; break;
+    case OP_STORE1: sp--; vars[1] = stack[sp]; break;
+    case OP_STORE2: sp--; vars[2] = stack[sp]; break;
+    case OP_STORE3: sp--; vars[3] = stack[sp]; break;
+    case OP_JMP: pc = code[pc]; break;
+    case OP_JZ:
+      sp--;
+      if (stack[sp] == 0) {
+        pc = code[pc];
+      } else {
+        pc++;
+      }
+      break;
+    case OP_JNZ:
+      sp--;
+      if (stack[sp] != 0) {
+        pc = code[pc];
+      } else {
+        pc++;
+      }
+      break;
+    case OP_ADD1: stack[sp - 1] += 1; break;
+    case OP_ADD2: stack[sp - 1] += 2; break;
+    case OP_ADD3: stack[sp - 1] += 3; break;
+    case OP_ADD4: stack[sp - 1] += 4; break;
+    case OP_ADD5: stack[sp - 1] += 5; break;
+    case OP_ADD6: stack[sp - 1] += 6; break;
+    case OP_ADD7: stack[sp - 1] += 7; break;
+    case OP_ADD8: stack[sp - 1] += 8; break;
+    case OP_MUL2: stack[sp - 1] *= 2; break;
+    case OP_MUL3: stack[sp - 1] *= 3; break;
+    case OP_MUL5: stack[sp - 1] *= 5; break;
+    case OP_MUL7: stack[sp - 1] *= 7; break;
+    case OP_CLASSIFY: stack[sp - 1] = classify(stack[sp - 1]); break;
+    case OP_NOP: break;
+    default:
+      printf("unknown opcode %d at %d\n", op, pc - 1);
+      return -1;
+    }
+  }
+}
+
+int n_code;
+
+void put(int x) {
+  code[n_code] = x;
+  n_code++;
+}
+
+// i = n; sum = 0;
+// while (i != 0) { sum = (sum + classify(i % 1024 * 97 % 1100) * 3 + i % 5 * 7 + 8) % 1000003; i--; }
+// return sum;
+void assemble(int n) {
+  n_code = 0;
+  put(OP_PUSH); put(n); put(OP_STORE0);
+  put(OP_PUSH); put(0); put(OP_STORE1);
+
+  int loop = n_code;
+  put(OP_LOAD0); put(OP_JZ);
+  int exit_pos = n_code;
+  put(0);
+
+  put(OP_LOAD1);
+  put(OP_LOAD0); put(OP_PUSH); put(1024); put(OP_MOD);
+  put(OP_PUSH); put(97); put(OP_MUL); put(OP_PUSH); put(1100); put(OP_MOD);
+  put(OP_CLASSIFY); put(OP_MUL3); put(OP_ADD);
+  put(OP_LOAD0); put(OP_PUSH); put(5); put(OP_MOD); put(OP_MUL7); put(OP_ADD);
+  put(OP_ADD8); put(OP_NOP);
+  put(OP_PUSH); put(1000003); put(OP_MOD);
+  put(OP_STORE1);
+  put(OP_LOAD0); put(OP_DEC); put(OP_STORE0);
+  put(OP_JMP); put(loop);
+
+  code[exit_pos] = n_code;
+  put(OP_LOAD1); put(OP_HALT);
+}
+
+int main() {
+  assemble(3000000);
+  printf("%d\n", run(code));
+  return 0;
+}
@@ -0,0 +1,249 @@
+#include "hoc.h"
+
+// アセンブリの出力
+//
+// 出力は大きなバッファに溜め、いっぱいになるかasm_flushのときに1回のwriteで書き出す。
+// 書式は%s, %d, %u, %lu, %zuだけを自前で展開し、stdioを通さない。
+
+#define ASM_BUFSIZE 1048576
+
+static char* buf;
+static size_t len;
+static int out_fd = 1;
+static bool comments = true;
+static char* object_path; // -cのときの出力先
+static StringBuilder* object_text; // -cと-runのときはアセンブリをファイルに書かずにここに溜める
+
+void asm_flush(void) {
+  if (object_text) {
+    sb_append(object_text, buf, len);
+    len = 0;
+    return;
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    long n = write(out_fd, buf + done, len - done);
+    if (n < 0) {
+      error("cannot write assembly\n");
+    }
+    done += n;
+  }
+  len = 0;
+}
+
+// 以降の出力をpathに書く
+void asm_open(char* path) {
+  asm_flush();
+  int fd = creat(path, 420); // 0644
+  if (fd < 0) {
+    error("cannot open file: %s\n", path);
+  }
+  out_fd = fd;
+}
+
+// 以降の出力をメモリに溜める。asm_takeで取り出す
+void asm_capture(void) {
+  asm_flush();
+  object_path = NULL;
+  object_text = new_sb();
+}
+
+char* asm_take(void) {
+  asm_flush();
+  sb_putc(object_text, '\0');
+  char* text = object_text->buf;
+  object_text = NULL;
+  return text;
+}
+
+// 以降の出力を溜めておき、asm_closeのときに機械語に直してpathにオブジェクトファイルを書く
+void asm_open_object(char* path) {
+  asm_capture();
+  object_path = path;
+}
+
+void asm_close(void) {
+  asm_flush();
+  if (object_text) {
+    if (object_path) {
+      write_object(object_path, asm_take());
+    }
+    return;
+  }
+  if (out_fd != 1) {
+    close(out_fd);
+    out_fd = 1;
+  }
+}
+
+// falseにすると# start/endなどのコメントを出力しない
+void asm_set_comments(bool enabled) {
+  comments = enabled;
+}
+
+bool asm_comments(void) {
+  return comments;
+}
+
+static void reserve(size_t size) {
+  if (buf == NULL) {
+    buf = malloc(ASM_BUFSIZE);
+  }
+  if (len + size > ASM_BUFSIZE) {
+    asm_flush();
+  }
+}
+
+void asm_putc(char c) {
+  reserve(1);
+  buf[len] = c;
+  len++;
+}
+
+void asm_write(char* s, size_t n) {
+  if (n > ASM_BUFSIZE) {
+    asm_flush();
+    if (object_text) {
+      sb_append(object_text, s, n);
+      return;
+    }
+    long written = 0;
+    while (written < n) {
+      long w = write(out_fd, s + written, n - written);
+      if (w < 0) {
+        error("cannot write assembly\n");
+      }
+      written += w;
+    }
+    return;
+  }
+  reserve(n);
+  memcpy(buf + len, s, n);
+  len += n;
+}
+
+void asm_puts(char* s) {
+  asm_write(s, strlen(s));
+}
+
+// "label:\n"
+void asm_label(char* label) {
+  asm_puts(label);
+  asm_putc(':');
+  asm_putc('\n');
+}
+
+void asm_ulong(size_t v) {
+  char digits[24];
+  int i = 24;
+  for (;;) {
+    i--;
+    digits[i] = '0' + v % 10;
+    v = v / 10;
+    if (v == 0) {
+      break;
+    }
+  }
+  asm_write(digits + i, 24 - i);
+}
+
+void asm_long(long v) {
+  if (v < 0) {
+    asm_putc('-');
+    asm_ulong(-v);
+  } else {
+    asm_ulong(v);
+  }
+}
+
+// hocはintをlongに符号拡張しないので、負のintはasm_longに渡さずここで書く
+void asm_int(int v) {
+  if (v < 0) {
+    asm_putc('-');
+    long u = -(v + 1); // -vは-2147483648のとき桁あふれする
+    asm_ulong(u + 1);
+  } else {
+    asm_ulong(v);
+  }
+}
+
+#ifdef __hoc__
+void asm_vprintf(char* fmt, struct __va_list_elem* ap) {
+#endif
+#ifndef __hoc__
+void asm_vprintf(char* fmt, va_list ap) {
+#endif
+  char* start = fmt;
+  for (char* p = fmt; *p != '\0'; p++) {
+    if (*p == '%') {
+      asm_write(start, p - start);
+      p++;
+      if (*p == 's') {
+        asm_puts(va_arg(ap, char*));
+      } else if (*p == 'd' || *p == 'u') {
+        asm_int(va_arg(ap, int));
+      } else if ((*p == 'l' || *p == 'z') && p[1] == 'u') {
+        p++;
+        asm_ulong(va_arg(ap, size_t));
+      } else if (*p == '%') {
+        asm_putc('%');
+      } else {
+        error("asm_printf: unsupported format: %s\n", fmt);
+      }
+      start = p + 1;
+    }
+  }
+  asm_puts(start);
+}
+
+void asm_printf(char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  asm_vprintf(fmt, ap);
+  va_end(ap);
+}
+
+// jobs個の子プロセスをforkする。子では0からjobs-1の番号を返し、出力はそれぞれの一時ファイルに向く。
+// 親ではすべての子の終了を待ち、その出力を番号順に書き出して-1を返す
+int fork_workers(int jobs) {
+  asm_flush(); // バッファに残った出力が子に複製されないように
+  fflush(stdout);
+  FILE** outs = calloc(jobs, sizeof(FILE*));
+
+  for (int w = 0; w < jobs; w++) {
+    outs[w] = tmpfile();
+    if (outs[w] == NULL) {
+      error("cannot create temporary file\n");
+    }
+    int pid = fork();
+    if (pid < 0) {
+      error("fork failed\n");
+    }
+    if (pid == 0) {
+      object_text = NULL; // 子の出力は親がまとめてアセンブルする
+      out_fd = fileno(outs[w]);
+      return w;
+    }
+  }
+
+  bool failed = false;
+  for (int w = 0; w < jobs; w++) {
+    int status = 0;
+    wait(&status);
+    if (status != 0) {
+      failed = true;
+    }
+  }
+  if (failed) {
+    exit(1);
+  }
+
+  for (int w = 0; w < jobs; w++) {
+    int fd = fileno(outs[w]);
+    lseek(fd, 0, SEEK_SET);
+    asm_puts(read_fd(fd));
+    fclose(outs[w]);
+  }
+  return -1;
+}
@@ -0,0 +1,236 @@
+#include "hoc.h"
+
+// IRの制御フローグラフ。
+// ブロックは最後の命令(IJMP、IBR、ISWITCH、IRET)で後続ブロックを直接指す。
+// 後続・先行ブロック、逆後順、支配木、ループの深さを求めて、最適化のパスから共有する
+
+Block* new_block(char* name) {
+  Block* block = arena_alloc(ARENA_IR, sizeof(Block));
+  block->name = name;
+  block->instrs = new_vec();
+  block->succs = new_vec();
+  block->preds = new_vec();
+  block->dom_children = new_vec();
+  block->frontier = new_vec();
+  block->rpo = -1;
+  return block;
+}
+
+// 関数の最後にブロックを足す。番号はfunc->blocksでの位置にする
+void append_block(IFunc* func, Block* block) {
+  block->id = func->blocks->length;
+  vec_push(func->blocks, block);
+}
+
+bool is_terminator(IR* inst) {
+  return inst->op == IJMP || inst->op == IBR || inst->op == ISWITCH || inst->op == IRET;
+}
+
+IR* terminator(Block* block) {
+  if (block->instrs->length == 0) {
+    return NULL;
+  }
+  IR* last = block->instrs->ptr[block->instrs->length - 1];
+  if (is_terminator(last)) {
+    return last;
+  }
+  return NULL;
+}
+
+// break;やreturn;の後ろにある命令には到達しないので消す。
+// IALLOCはフレームの大きさの計算に使うので、最初の終端命令の前に移して残す
+static void remove_dead_instrs(Block* block) {
+  Vector* v = new_vec();
+  IR* last = NULL;
+
+  for (size_t i = 0; i < block->instrs->length; i++) {
+    IR* inst = block->instrs->ptr[i];
+    if (!last && is_terminator(inst)) {
+      last = inst;
+    } else if (!last || inst->op == IALLOC) {
+      vec_push(v, inst);
+    }
+  }
+  assert(last);
+  vec_push(v, last);
+
+  block->instrs = v;
+}
+
+static void add_edge(Block* from, Block* to) {
+  vec_push(from->succs, to);
+  vec_push(to->preds, from);
+}
+
+// ジャンプテーブルには同じブロックが何度も出てくるので、辺は1本だけにする
+static void add_unique_edge(Block* from, Block* to) {
+  for (size_t i = 0; i < from->succs->length; i++) {
+    if (from->succs->ptr[i] == to) {
+      return;
+    }
+  }
+  add_edge(from, to);
+}
+
+// 訪れたブロックはrpoを0にしておき、後順でpostに積む
+static void visit(Block* block, Vector* post) {
+  block->rpo = 0;
+  for (size_t i = 0; i < block->succs->length; i++) {
+    Block* succ = block->succs->ptr[i];
+    if (succ->rpo < 0) {
+      visit(succ, post);
+    }
+  }
+  vec_push(post, block);
+}
+
+// 後続・先行ブロックと逆後順を求め直す。ブロックを足したり分岐先を変えたりしたら呼ぶ
+void build_cfg(IFunc* func) {
+  for (size_t i = 0; i < func->blocks->length; i++) {
+    Block* block = func->blocks->ptr[i];
+    block->id = i;
+    block->succs = new_vec();
+    block->preds = new_vec();
+    block->rpo = -1;
+    remove_dead_instrs(block);
+  }
+
+  for (size_t i = 0; i < func->blocks->length; i++) {
+    Block* block = func->blocks->ptr[i];
+    IR* last = terminator(block);
+    if (last->op == IJMP) {
+      add_edge(block, last->jump_to);
+    } else if (last->op == IBR) {
+      add_edge(block, last->then);
+      add_edge(block, last->els);
+    } else if (last->op == ISWITCH) {
+      for (size_t j = 0; j < last->table->length; j++) {
+        add_unique_edge(block, last->table->ptr[j]);
+      }
+      add_unique_edge(block, last->els);
+    }
+  }
+
+  Vector* post = new_vec();
+  visit(func->blocks->ptr[0], post);
+  func->rpo = new_vec();
+  for (size_t i = post->length; i > 0; i--) {
+    Block* block = post->ptr[i - 1];
+    block->rpo = func->rpo->length;
+    vec_push(func->rpo, block);
+  }
+}
+
+static Block* intersect(Block* a, Block* b) {
+  while (a != b) {
+    while (a->rpo > b->rpo) {
+      a = a->idom;
+    }
+    while (b->rpo > a->rpo) {
+      b = b->idom;
+    }
+  }
+  return a;
+}
+
+// Cooper, Harvey, Kennedyの反復法で支配木を求め、支配辺境を計算する。
+// 到達しないブロックのidomはNULLのまま
+void compute_dominators(IFunc* func) {
+  for (size_t i = 0; i < func->blocks->length; i++) {
+    Block* block = func->blocks->ptr[i];
+    block->idom = NULL;
+    block->dom_children = new_vec();
+    block->frontier = new_vec();
+  }
+  Block* entry = func->rpo->ptr[0];
+  entry->idom = entry;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < func->rpo->length; i++) {
+      Block* block = func->rpo->ptr[i];
+      Block* new_idom = NULL;
+      for (size_t j = 0; j < block->preds->length; j++) {
+        Block* pred = block->preds->ptr[j];
+        if (pred->idom && !new_idom) {
+          new_idom = pred;
+        } else if (pred->idom) {
+          new_idom = intersect(pred, new_idom);
+        }
+      }
+      if (block->idom != new_idom) {
+        block->idom = new_idom;
+        changed = true;
+      }
+    }
+  }
+
+  for (size_t i = 1; i < func->rpo->length; i++) {
+    Block* block = func->rpo->ptr[i];
+    vec_push(block->idom->dom_children, block);
+  }
+
+  for (size_t i = 0; i < func->rpo->length; i++) {
+    Block* block = func->rpo->ptr[i];
+    if (block->preds->length >= 2) {
+      for (size_t j = 0; j < block->preds->length; j++) {
+        Block* runner = block->preds->ptr[j];
+        while (runner->idom && runner != block->idom) {
+          Vector* df = runner->frontier;
+          if (df->length == 0 || df->ptr[df->length - 1] != block) {
+            vec_push(df, block);
+          }
+          runner = runner->idom;
+        }
+      }
+    }
+  }
+}
+
+bool dominates(Block* a, Block* b) {
+  while (b != a && b->idom && b->idom != b) {
+    b = b->idom;
+  }
+  return a == b;
+}
+
+// 後退辺(先頭が元を支配する辺)ごとに自然ループを求め、含まれるブロックのloop_depthを増やす。
+// compute_dominatorsの後に呼ぶ
+void compute_loops(IFunc* func) {
+  int* in_loop = arena_alloc(ARENA_IR, sizeof(int) * func->blocks->length); // ループの先頭の番号+1
+
+  for (size_t i = 0; i < func->blocks->length; i++) {
+    Block* block = func->blocks->ptr[i];
+    block->loop_depth = 0;
+  }
+
+  for (size_t i = 0; i < func->rpo->length; i++) {
+    Block* header = func->rpo->ptr[i];
+    Vector* work = new_vec();
+    for (size_t j = 0; j < header->preds->length; j++) {
+      Block* pred = header->preds->ptr[j];
+      if (pred->idom && dominates(header, pred) && in_loop[pred->id] != header->id + 1) {
+        in_loop[pred->id] = header->id + 1;
+        vec_push(work, pred);
+      }
+    }
+    if (work->length > 0 && in_loop[header->id] != header->id + 1) {
+      in_loop[header->id] = header->id + 1;
+      header->loop_depth++;
+    }
+
+    // 先頭までさかのぼって本体を集める
+    while (work->length > 0) {
+      Block* block = vec_pop(work);
+      block->loop_depth++;
+      for (size_t j = 0; j < block->preds->length; j++) {
+        Block* pred = block->preds->ptr[j];
+        if (pred->idom && in_loop[pred->id] != header->id + 1) {
+          in_loop[pred->id] = header->id + 1;
+          vec_push(work, pred);
+        }
+      }
+    }
+  }
+}
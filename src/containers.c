@@ -1,8 +1,117 @@
 #include "hoc.h"
 
+/* arena */
+
+#define ARENA_CHUNK_SIZE 65536
+
+typedef struct ArenaChunk {
+  struct ArenaChunk* next;
+  char* buf;
+  size_t capacity;
+  size_t used;
+} ArenaChunk;
+
+typedef struct Arena {
+  ArenaChunk* chunks;
+  size_t allocated; // 要求されたバイト数の累計
+  size_t reserved; // mallocしたバイト数の累計
+  size_t live; // 現在確保しているバイト数
+  size_t peak;
+  int num_chunks;
+  bool released;
+} Arena;
+
+static Arena* arenas[NUM_ARENAS];
+static char* arena_names[NUM_ARENAS] = { "token", "ast", "ir", "include" };
+static int current_arena = ARENA_AST;
+
+static Arena* get_arena(int kind) {
+  if (arenas[kind] == NULL) {
+    arenas[kind] = calloc(1, sizeof(Arena));
+  }
+  return arenas[kind];
+}
+
+static ArenaChunk* new_chunk(Arena* arena, size_t size) {
+  ArenaChunk* chunk = calloc(1, sizeof(ArenaChunk));
+  chunk->buf = calloc(size, sizeof(char));
+  chunk->capacity = size;
+  chunk->used = 0;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->reserved += size;
+  arena->live += size;
+  if (arena->peak < arena->live) {
+    arena->peak = arena->live;
+  }
+  arena->num_chunks++;
+  return chunk;
+}
+
+// 0で初期化された領域を返す
+void* arena_alloc(int kind, size_t size) {
+  Arena* arena = get_arena(kind);
+  size = roundup(size, 8);
+
+  ArenaChunk* chunk = arena->chunks;
+  if (chunk == NULL || chunk->capacity - chunk->used < size) {
+    if (size > ARENA_CHUNK_SIZE / 4) {
+      // 大きな領域は専用のチャンクにして、今のチャンクの残りを無駄にしない
+      chunk = new_chunk(arena, size);
+      if (chunk->next) {
+        arena->chunks = chunk->next;
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+      }
+    } else {
+      chunk = new_chunk(arena, ARENA_CHUNK_SIZE);
+    }
+  }
+
+  void* ptr = chunk->buf + chunk->used;
+  chunk->used += size;
+  arena->allocated += size;
+  return ptr;
+}
+
+// アリーナのメモリをまとめて解放する。以降のarena_allocは新しいチャンクから確保する
+void arena_release(int kind) {
+  Arena* arena = get_arena(kind);
+  ArenaChunk* chunk = arena->chunks;
+  while (chunk) {
+    ArenaChunk* next = chunk->next;
+    free(chunk->buf);
+    free(chunk);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+  arena->live = 0;
+  arena->released = true;
+}
+
+// new_vecが使うアリーナを切り替える。フェーズの開始時に呼ぶ
+void use_arena(int kind) {
+  current_arena = kind;
+}
+
+void dump_arena_stats(void) {
+  for (int i = 0; i < NUM_ARENAS; i++) {
+    Arena* arena = get_arena(i);
+    eprintf("arena %-7s: %zu bytes allocated, %zu bytes in %d chunks, peak %zu bytes",
+            arena_names[i], arena->allocated, arena->reserved, arena->num_chunks, arena->peak);
+    if (arena->released) {
+      eprintf(" (released)");
+    }
+    eprintf("\n");
+  }
+}
+
+/* vector */
+
 Vector* new_vec() {
-  Vector* v = calloc(1, sizeof(Vector));
-  v->ptr = calloc(16, sizeof(void*));
+  Vector* v = arena_alloc(current_arena, sizeof(Vector));
+  v->arena = current_arena;
+  v->ptr = arena_alloc(v->arena, sizeof(void*) * 16);
   v->capacity = 16;
   v->length = 0;
   return v;
@@ -10,8 +119,10 @@ Vector* new_vec() {
 
 void vec_push(Vector* v, void* elem) {
   if (v->capacity == v->length) {
+    void** ptr = arena_alloc(v->arena, sizeof(void*) * v->capacity * 2);
+    memcpy(ptr, v->ptr, sizeof(void*) * v->capacity);
+    v->ptr = ptr;
     v->capacity *= 2;
-    v->ptr = realloc(v->ptr, sizeof(void*) * v->capacity);
   }
   v->ptr[v->length++] = elem;
 }
@@ -24,3 +135,103 @@ void* vec_pop(Vector* v) {
 void* vec_last(Vector* v) {
   return v->ptr[v->length - 1];
 }
+
+/* map */
+
+// キーはintern済みの文字列なので、ポインタの値でハッシュして比較する
+static size_t hash_ptr(char* key, size_t capacity) {
+  return ((long)key / 8) & (capacity - 1);
+}
+
+Map* new_map(void) {
+  Map* map = calloc(1, sizeof(Map));
+  map->keys = calloc(16, sizeof(char*));
+  map->vals = calloc(16, sizeof(void*));
+  map->capacity = 16;
+  map->length = 0;
+  return map;
+}
+
+static void map_rehash(Map* map) {
+  char** keys = map->keys;
+  void** vals = map->vals;
+  size_t capacity = map->capacity;
+
+  map->capacity = capacity * 2;
+  map->keys = calloc(map->capacity, sizeof(char*));
+  map->vals = calloc(map->capacity, sizeof(void*));
+  map->length = 0;
+
+  for (size_t i = 0; i < capacity; i++) {
+    if (keys[i]) {
+      map_put(map, keys[i], vals[i]);
+    }
+  }
+  free(keys);
+  free(vals);
+}
+
+void* map_get(Map* map, char* key) {
+  size_t i = hash_ptr(key, map->capacity);
+  while (map->keys[i]) {
+    if (map->keys[i] == key) {
+      return map->vals[i];
+    }
+    i = (i + 1) & (map->capacity - 1);
+  }
+  return NULL;
+}
+
+void map_put(Map* map, char* key, void* val) {
+  if (map->length * 2 >= map->capacity) {
+    map_rehash(map);
+  }
+
+  size_t i = hash_ptr(key, map->capacity);
+  while (map->keys[i]) {
+    if (map->keys[i] == key) {
+      map->vals[i] = val;
+      return;
+    }
+    i = (i + 1) & (map->capacity - 1);
+  }
+  map->keys[i] = key;
+  map->vals[i] = val;
+  map->length++;
+}
+
+// キーを取り除く。線形探索の列が途切れないよう、後ろに続くエントリを空いた位置に詰める
+void map_delete(Map* map, char* key) {
+  size_t mask = map->capacity - 1;
+  size_t i = hash_ptr(key, map->capacity);
+  while (map->keys[i] != key) {
+    if (!map->keys[i]) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  map->length--;
+
+  size_t j = i;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (!map->keys[j]) {
+      break;
+    }
+    // jのエントリは、本来の位置homeから見てiがjより手前にあるときだけiに移せる
+    size_t home = hash_ptr(map->keys[j], map->capacity);
+    bool movable = false;
+    if (i < j) {
+      movable = home <= i || j < home;
+    } else {
+      movable = home <= i && j < home;
+    }
+    if (movable) {
+      map->keys[i] = map->keys[j];
+      map->vals[i] = map->vals[j];
+      i = j;
+    }
+  }
+  map->keys[i] = NULL;
+  map->vals[i] = NULL;
+}
@@ -1,93 +1,96 @@
 #include "hoc.h"
 
-typedef struct MacroEnv {
-  struct MacroEnv* next;
-  char* name;
-  Token* tokens;
-  Vector* params;
-} MacroEnv;
+typedef struct IncludeFile {
+  char* path;    // realpathで正規化したパス(intern済み)
+  Token* tokens; // 字句解析の結果。展開時には複製して使う
+  char* guard;   // インクルードガードのマクロ名。なければNULL
+  bool once;     // #pragma once
+} IncludeFile;
 
 static Token* input;
 static Token* output;
-static MacroEnv* gbl_env;
+static Token** output_tail; // 出力の末尾のnext。appendを定数時間にする
+static Map* gbl_env; // Map(char*, MacroEnv*)
+static Map* preloaded_env; // プリコンパイル済みヘッダから読んだマクロ
+static char* preloaded_header; // プリコンパイル済みのヘッダのパス(realpath, intern済み)
 static char* src_dir;
+static int output_arena = ARENA_AST;
+
+// インクルードファイルのキャッシュ。字句解析の結果を同じ翻訳単位の二度目以降の#includeで使い回す。
+// -jでは翻訳単位ごとに子プロセスで前処理するので、翻訳単位をまたいでは共有されない
+static Map* include_cache; // Map(char*, IncludeFile*)
+static Map* included;      // Map(char*, IncludeFile*) この翻訳単位で読んだもの
+static int include_lexed;
+static int include_hits;
+static int include_skipped;
 
 static void traverse(void);
 
-static Token* copy_token(Token* src) {
-  Token* new = calloc(1, sizeof(Token));
+static Token* copy_token(Token* src, int arena) {
+  Token* new = arena_alloc(arena, sizeof(Token));
   memcpy(new, src, sizeof(Token));
   new->next = NULL;
   return new;
 }
 
-static Token* copy_tokens(Token* src) {
+// srcを複製し、末尾をrestにつなげる。複製先は一度にまとめて確保する
+static Token* copy_tokens(Token* src, Token* rest) {
   if (src == NULL) {
-    return NULL;
-  } else {
-    Token* new = copy_token(src);
-    new->next = copy_tokens(src->next);
-    return new;
+    return rest;
+  }
+
+  size_t count = 0;
+  for (Token* t = src; t != NULL; t = t->next) {
+    count++;
   }
+
+  Token* buf = arena_alloc(ARENA_TOKEN, sizeof(Token) * count);
+  Token* new = buf;
+  for (Token* t = src; t != NULL; t = t->next) {
+    memcpy(new, t, sizeof(Token));
+    new->next = new + 1;
+    new++;
+  }
+  (new - 1)->next = rest;
+  return buf;
 }
 
-static void add_objlike(char* name, Token* tokens, MacroEnv** prev) {
-  MacroEnv* new = calloc(1, sizeof(MacroEnv));
+static void add_objlike(char* name, Token* tokens, Map* env) {
+  MacroEnv* new = arena_alloc(ARENA_TOKEN, sizeof(MacroEnv));
   new->name = name;
   new->tokens = tokens;
-  new->next = *prev;
-  *prev = new;
+  map_put(env, name, new);
 }
 
-static void add_funclike(char* name, Token* tokens, Vector* params, MacroEnv** prev) {
-  MacroEnv* new = calloc(1, sizeof(MacroEnv));
+static void add_funclike(char* name, Token* tokens, Vector* params, Map* env) {
+  MacroEnv* new = arena_alloc(ARENA_TOKEN, sizeof(MacroEnv));
   new->name = name;
   new->tokens = tokens;
   new->params = params;
-  new->next = *prev;
-  *prev = new;
+  map_put(env, name, new);
 }
 
 static bool is_macro(Token* token) {
-  if (token->tag == TIDENT) {
-    for (MacroEnv* env = gbl_env; env != NULL; env = env->next) {
-      if (streq(token->ident, env->name)) {
-        return true;
-      }
-    }
-  }
-  return false;
+  return token->tag == TIDENT && map_get(gbl_env, token->ident) != NULL;
 }
 
-static Token* get_macro_tokens(char* name) {
-  for (MacroEnv* env = gbl_env; env != NULL; env = env->next) {
-    if (streq(name, env->name)) {
-      return copy_tokens(env->tokens);
-    }
+static Token* get_macro_tokens(char* name, Token* rest) {
+  MacroEnv* macro = map_get(gbl_env, name);
+  if (macro) {
+    return copy_tokens(macro->tokens, rest);
   }
-  return false;
+  return rest;
 }
 
-static MacroEnv* get_local_env(char* name, Vector* args) {
-  Vector* params = NULL;
-  for (MacroEnv* env = gbl_env; env != NULL; env = env->next) {
-    if (streq(name, env->name)) {
-      params = env->params;
-    }
-  }
-
-  if (params == NULL) {
+static Map* get_local_env(char* name, Vector* args) {
+  MacroEnv* macro = map_get(gbl_env, name);
+  if (macro == NULL || macro->params == NULL) {
     error("undefined macro %s\n", name);
   }
 
-  MacroEnv* lcl_env = NULL;
-  MacroEnv** p = &lcl_env;
-  for (int i = 0; i < params->length; i++) {
-    MacroEnv* new = calloc(1, sizeof(MacroEnv));
-    new->name = params->ptr[i];
-    new->tokens = args->ptr[i];
-    new->next = *p;
-    *p = new;
+  Map* lcl_env = new_map();
+  for (int i = 0; i < macro->params->length; i++) {
+    add_objlike(macro->params->ptr[i], args->ptr[i], lcl_env);
   }
 
   return lcl_env;
@@ -114,22 +117,20 @@ static Token* expect(char* expected, enum TokenTag tag) {
   }
 }
 
-static void append(Token** dst, Token* src) {
-  Token** p;
-  for (p = dst; *p != NULL; p = &(*p)->next) {
-  }
-  *p = src;
+static void emit_token(Token* token) {
+  *output_tail = token;
+  output_tail = &token->next;
 }
 
 static Token* read_until_bol(void) {
-  if (input->bol) {
-    return NULL;
-  } else {
-    Token* new = copy_token(input);
+  Token* head = NULL;
+  Token** tail = &head;
+  while (input && !input->bol) {
+    *tail = copy_token(input, ARENA_TOKEN);
+    tail = &(*tail)->next;
     consume();
-    new->next = read_until_bol();
-    return new;
   }
+  return head;
 }
 
 static Vector* read_funclike_params(void) {
@@ -150,11 +151,11 @@ static Vector* read_funclike_params(void) {
 static void read_funclike_define(char* name) {
   Vector* params = read_funclike_params();
   Token* tokens = read_until_bol();
-  add_funclike(name, tokens, params, &gbl_env);
+  add_funclike(name, tokens, params, gbl_env);
 }
 
 static void read_objlike_define(char* name) {
-  add_objlike(name, read_until_bol(), &gbl_env);
+  add_objlike(name, read_until_bol(), gbl_env);
 }
 
 static void read_define(char* name) {
@@ -168,8 +169,10 @@ static void read_define(char* name) {
 
 static Token* read_one_arg(void) {
   Token* arg = NULL;
+  Token** tail = &arg;
   while (!eq_reserved(input, ")") && !eq_reserved(input, ",")) {
-    append(&arg, copy_token(input));
+    *tail = copy_token(input, ARENA_TOKEN);
+    tail = &(*tail)->next;
     consume();
   }
   return arg;
@@ -192,36 +195,38 @@ static Vector* read_funclike_args(void) {
 
 static void apply_funclike(char* name) {
   Vector* args = read_funclike_args();
-  MacroEnv* lcl_env = get_local_env(name, args);
-  Token* func_tokens = get_macro_tokens(name);
+  Map* lcl_env = get_local_env(name, args);
+  Token* func_tokens = get_macro_tokens(name, NULL);
 
-  MacroEnv* env_backup = gbl_env;
+  Map* env_backup = gbl_env;
   Token* input_backup = input;
   Token* output_backup = output;
+  Token** output_tail_backup = output_tail;
+
+  int arena_backup = output_arena;
 
   gbl_env = lcl_env;
   input = func_tokens;
   output = NULL;
+  output_tail = &output;
+  output_arena = ARENA_TOKEN; // 展開結果は入力に戻して読み直すので作業用
 
   while (input) {
     traverse();
   }
 
-  Token* expanded = output;
+  // 展開結果の後ろに残りの入力をつなげて読み直す
+  *output_tail = input_backup;
+  input = output;
 
   gbl_env = env_backup;
-  input = input_backup;
   output = output_backup;
-
-  append(&expanded, input);
-  input = expanded;
+  output_tail = output_tail_backup;
+  output_arena = arena_backup;
 }
 
 static void apply_objlike(char* name) {
-  Token* ts = get_macro_tokens(name);
-
-  append(&ts, input);
-  input = ts;
+  input = get_macro_tokens(name, input);
 }
 
 static void apply(char* name) {
@@ -233,55 +238,180 @@ static void apply(char* name) {
   }
 }
 
+static bool is_directive(Token* token, char* name) {
+  return token->tag == TDIRECTIVE && streq(token->ident, name);
+}
+
 static char* include_path(char* path) {
   return format("%s/%s", src_dir, path);
 }
 
+// #ifndef X / #define X / ... / #endif の形で全体が囲まれていればXを返す
+static char* find_include_guard(Token* tokens) {
+  Token* t = tokens;
+  if (!(t && is_directive(t, "ifndef") && t->next && t->next->tag == TIDENT)) {
+    return NULL;
+  }
+  char* name = t->next->ident;
+
+  t = t->next->next;
+  if (!(t && is_directive(t, "define") && t->next && t->next->ident == name)) {
+    return NULL;
+  }
+
+  // 最初の#ifndefに対応する#endifがファイルの最後のトークンであること
+  int depth = 0;
+  for (t = tokens; t != NULL; t = t->next) {
+    if (is_directive(t, "ifdef") || is_directive(t, "ifndef")) {
+      depth++;
+    } else if (is_directive(t, "endif")) {
+      depth--;
+      if (depth == 0 && t->next != NULL) {
+        return NULL;
+      }
+    }
+  }
+  return name;
+}
+
+static bool has_pragma_once(Token* tokens) {
+  for (Token* t = tokens; t != NULL; t = t->next) {
+    if (is_directive(t, "pragma") && t->next && !t->next->bol && t->next->tag == TIDENT &&
+        streq(t->next->ident, "once")) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// realpathで正規化してinternしたパスを返す
+char* canonical_path(char* path) {
+  char* real = realpath(path, NULL);
+  if (real == NULL) {
+    error("cannot open file: %s\n", path);
+  }
+  char* key = intern(real);
+  free(real);
+  return key;
+}
+
+static IncludeFile* lookup_include(char* key) {
+  IncludeFile* file = map_get(include_cache, key);
+  if (file) {
+    include_hits++;
+    return file;
+  }
+
+  file = calloc(1, sizeof(IncludeFile));
+  file->path = key;
+  file->tokens = lex_into(key, ARENA_INCLUDE);
+  file->guard = find_include_guard(file->tokens);
+  file->once = has_pragma_once(file->tokens);
+  map_put(include_cache, key, file);
+  include_lexed++;
+  return file;
+}
+
+static void include(char* path) {
+  char* key = canonical_path(path);
+  if (key == preloaded_header) {
+    include_skipped++;
+    return;
+  }
+
+  IncludeFile* file = lookup_include(key);
+
+  // ガードされたファイルは二度目以降、字句解析も展開もせずに読み飛ばす
+  if (file->guard && map_get(gbl_env, file->guard)) {
+    include_skipped++;
+    return;
+  }
+  if (file->once && map_get(included, file->path)) {
+    include_skipped++;
+    return;
+  }
+
+  map_put(included, file->path, file);
+  input = copy_tokens(file->tokens, input);
+}
+
+void dump_include_stats(void) {
+  eprintf("include: %d files lexed, %d cache hits, %d skipped by guard, #pragma once or precompiled header\n",
+          include_lexed, include_hits, include_skipped);
+}
+
 static void skip_to_endif(void) {
-  while (input && !(input->tag == TDIRECTIVE && streq(input->ident, "endif"))) {
+  while (input && !is_directive(input, "endif")) {
     consume();
   }
   consume();
 }
 
 static void traverse(void) {
-  if (input->tag == TDIRECTIVE && streq(input->ident, "define")) {
+  if (is_directive(input, "define")) {
     consume();
     read_define(expect("macro name", TIDENT)->ident);
-    traverse();
-  } else if (input->tag == TDIRECTIVE && streq(input->ident, "include")) {
-    Token* included = lex(include_path(input->str));
-    append(&included, input->next);
-    input = included;
-  } else if (input->tag == TDIRECTIVE && streq(input->ident, "ifdef")) {
+  } else if (is_directive(input, "include")) {
+    char* path = include_path(input->str);
+    consume();
+    include(path);
+  } else if (is_directive(input, "pragma")) {
+    // #pragma onceはインクルード時に処理済み。その他のpragmaは無視する
+    consume();
+    while (input && !input->bol) {
+      consume();
+    }
+  } else if (is_directive(input, "ifdef")) {
     consume();
     Token* tag = expect("macro name", TIDENT);
     if (!is_macro(tag)) {
       skip_to_endif();
     }
-  } else if (input->tag == TDIRECTIVE && streq(input->ident, "ifndef")) {
+  } else if (is_directive(input, "ifndef")) {
     consume();
     Token* tag = expect("macro name", TIDENT);
     if (is_macro(tag)) {
       skip_to_endif();
     }
-  } else if (input->tag == TDIRECTIVE && streq(input->ident, "endif")) {
+  } else if (is_directive(input, "endif")) {
     consume();
   } else if (is_macro(input)) {
     // TODO: 関数マクロの仮引数名と実引数が同じだと無限ループする
     char* name = expect("macro name", TIDENT)->ident;
     apply(name);
   } else {
-    Token* new = copy_token(input);
-    append(&output, new);
+    // 出力したトークンはNodeから診断用に参照されるので、ASTのアリーナに置く
+    emit_token(copy_token(input, output_arena));
     consume();
   }
 }
 
+// マクロ表とそれを定義したヘッダを登録する。以降のpreprocessはこのマクロ表から始め、
+// headerの#includeは読み飛ばす
+void preload_macros(Map* macros, char* header) {
+  preloaded_env = macros;
+  preloaded_header = header;
+}
+
+// 直前のpreprocessが終わった時点のマクロ表
+Map* macro_table(void) {
+  return gbl_env;
+}
+
 Token* preprocess(char* dir, Token* tokens) {
-  gbl_env = calloc(1, sizeof(MacroEnv));
-  gbl_env->name = "__hoc__";
+  if (preloaded_env) {
+    gbl_env = preloaded_env;
+  } else {
+    gbl_env = new_map();
+  }
+  included = new_map();
+  if (include_cache == NULL) {
+    include_cache = new_map();
+  }
+  add_objlike(intern("__hoc__"), NULL, gbl_env);
   input = tokens;
+  output = NULL;
+  output_tail = &output;
   src_dir = dir;
 
   while (input) {
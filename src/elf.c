@@ -0,0 +1,1172 @@
+#include "hoc.h"
+
+// ELF64の再配置可能オブジェクトの出力
+//
+// emit.cが出力したIntel記法のアセンブリを1行ずつ機械語に直し、.text, .data, .bss, .rodataと
+// シンボル表、再配置情報を持つオブジェクトファイルを書く。
+// -runではオブジェクトファイルを書かずに、このプロセスのメモリに置いてそのまま実行する。
+// 受け付けるのはhocのコード生成器が出力する命令と書式だけなので、汎用のアセンブラの代わりにはならない。
+// hocでもコンパイルできるように、オペコードは16進数ではなく10進数で書く。
+
+enum SectionId {
+  SEC_UNDEF,
+  SEC_TEXT,
+  SEC_DATA,
+  SEC_BSS,
+  SEC_RODATA,
+};
+
+#define NUM_SECTIONS 5
+
+// セクションヘッダの番号。SEC_*のあとに.rela.text, .rela.data, .rela.rodataが続く
+#define SHN_SYMTAB 8
+#define SHN_STRTAB 9
+#define SHN_SHSTRTAB 10
+#define NUM_SHDRS 12
+
+#define R_X86_64_64 1
+#define R_X86_64_PC32 2
+#define R_X86_64_PLT32 4
+#define R_X86_64_32 10
+
+typedef struct Symbol {
+  char* name;
+  int section; // 未定義ならSEC_UNDEF
+  size_t offset;
+  bool is_global;
+  int index; // .symtabでの番号
+} Symbol;
+
+// 命令やデータの中で、シンボルのアドレスを埋める場所
+typedef struct Fixup {
+  int section;
+  size_t offset;
+  Symbol* sym;
+  int type; // R_X86_64_*
+  int addend;
+} Fixup;
+
+typedef struct Section {
+  StringBuilder* data;
+  size_t size;     // .bssはdataを使わず大きさだけ数える
+  Vector* relocs;  // Vector(Fixup*) オブジェクトファイルに残す再配置
+  Symbol* sym;     // セクションシンボル
+} Section;
+
+enum OperandKind {
+  OP_REG,
+  OP_MEM,
+  OP_IMM,
+  OP_SYM,
+};
+
+typedef struct Operand {
+  int kind;
+  int reg;  // レジスタの番号。OP_MEMではベースレジスタ
+  int size; // レジスタの大きさ。OP_MEMではBYTE PTRなどで指定した大きさで、なければ0
+  long imm; // OP_IMMの値。OP_MEMでは変位
+  Symbol* sym;
+} Operand;
+
+typedef struct Register {
+  int num;
+  int size; // 1, 4, 8。xmmレジスタは16
+} Register;
+
+static char* reg64[16] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" };
+static char* reg32[16] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" };
+static char* reg8[16] = { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
+static char* regxmm[8] = { "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7" };
+
+static Map* registers; // Map(char*, Register*)
+static Section* sections[NUM_SECTIONS];
+static int cur; // 出力中のセクション
+static Map* symbols; // Map(char*, Symbol*)
+static Vector* symbol_list; // 現れた順のSymbol*
+static Vector* fixups;
+static char* line; // エラーメッセージ用
+static int line_no;
+
+static void asm_error(char* msg) {
+  error("assembler: line %d: %s: %s\n", line_no, msg, line);
+}
+
+static void add_registers(char** names, int count, int size) {
+  for (int i = 0; i < count; i++) {
+    Register* r = calloc(1, sizeof(Register));
+    r->num = i;
+    r->size = size;
+    map_put(registers, intern(names[i]), r);
+  }
+}
+
+static void init(void) {
+  if (registers == NULL) {
+    registers = new_map();
+    add_registers(reg64, 16, 8);
+    add_registers(reg32, 16, 4);
+    add_registers(reg8, 16, 1);
+    add_registers(regxmm, 8, 16);
+  }
+
+  for (int i = 1; i < NUM_SECTIONS; i++) {
+    Section* sec = calloc(1, sizeof(Section));
+    sec->data = new_sb();
+    sec->relocs = new_vec();
+    sec->sym = calloc(1, sizeof(Symbol));
+    sec->sym->section = i;
+    sec->sym->index = i;
+    sections[i] = sec;
+  }
+  cur = SEC_TEXT;
+  symbols = new_map();
+  symbol_list = new_vec();
+  fixups = new_vec();
+}
+
+static Symbol* symbol(char* name, size_t len) {
+  char* key = intern_len(name, len);
+  Symbol* sym = map_get(symbols, key);
+  if (sym == NULL) {
+    sym = calloc(1, sizeof(Symbol));
+    sym->name = key;
+    map_put(symbols, key, sym);
+    vec_push(symbol_list, sym);
+  }
+  return sym;
+}
+
+/* 機械語の出力 */
+
+static size_t here(void) {
+  if (cur == SEC_BSS) {
+    return sections[cur]->size;
+  }
+  return sections[cur]->data->length;
+}
+
+static void out8(int v) {
+  if (cur == SEC_BSS) {
+    asm_error("data in .bss");
+  }
+  sb_putc(sections[cur]->data, v);
+}
+
+static void out32(long v) {
+  int x = v;
+  sb_append(sections[cur]->data, (char*)&x, 4);
+}
+
+static void out64(long v) {
+  sb_append(sections[cur]->data, (char*)&v, 8);
+}
+
+// 今の位置にsymのアドレスをsize バイトで埋めるように記録し、ひとまず0を書く
+static void out_fixup(Symbol* sym, int type, int addend, int size) {
+  Fixup* f = calloc(1, sizeof(Fixup));
+  f->section = cur;
+  f->offset = here();
+  f->sym = sym;
+  f->type = type;
+  f->addend = addend;
+  vec_push(fixups, f);
+  if (size == 8) {
+    out64(0);
+  } else {
+    out32(0);
+  }
+}
+
+static bool is_int8(long v) {
+  return -128 <= v && v <= 127;
+}
+
+static bool is_int32(long v) {
+  long max = 2147483647;
+  return -max - 1 <= v && v <= max;
+}
+
+// spl, bpl, sil, dilはREXプレフィックスがないとah, ch, dh, bhになる
+static bool needs_rex8(Operand* op) {
+  return op->kind == OP_REG && op->size == 1 && op->reg >= 4 && op->reg < 8;
+}
+
+// REXプレフィックス。必要なときだけ出力する
+static void rex(bool w, int reg, Operand* rm, bool force) {
+  int r = 64; // 0x40
+  if (w) {
+    r += 8;
+  }
+  if (reg >= 8) {
+    r += 4;
+  }
+  if ((rm->kind == OP_REG || rm->kind == OP_MEM) && rm->reg >= 8) {
+    r += 1;
+  }
+  if (r != 64 || force) {
+    out8(r);
+  }
+}
+
+static void modrm(int reg, Operand* rm) {
+  reg = reg % 8;
+  if (rm->kind == OP_REG) {
+    out8(192 + reg * 8 + rm->reg % 8); // mod=11
+    return;
+  }
+  if (rm->kind == OP_SYM) {
+    // RIP相対。直後に即値が続く命令では使わない
+    out8(reg * 8 + 5);
+    out_fixup(rm->sym, R_X86_64_PC32, -4, 4);
+    return;
+  }
+  if (rm->kind != OP_MEM) {
+    asm_error("invalid operand");
+  }
+
+  int base = rm->reg % 8;
+  int mod = 2; // disp32
+  if (rm->imm == 0 && base != 5) {
+    mod = 0; // rbpとr13は変位なしで書けない
+  } else if (is_int8(rm->imm)) {
+    mod = 1; // disp8
+  }
+  out8(mod * 64 + reg * 8 + base);
+  if (base == 4) {
+    out8(36); // SIB 0x24: rspとr12はSIBが必要
+  }
+  if (mod == 1) {
+    out8(rm->imm);
+  } else if (mod == 2) {
+    out32(rm->imm);
+  }
+}
+
+// opcode r/m, reg の形の命令。3840(0x0f00)以上のオペコードは0x0fで始まる2バイトのもの
+static void inst_rm(bool w, bool force_rex, int opcode, int reg, Operand* rm) {
+  rex(w, reg, rm, force_rex);
+  if (opcode >= 3840) {
+    out8(15);
+    opcode = opcode - 3840;
+  }
+  out8(opcode);
+  modrm(reg, rm);
+}
+
+/* 命令 */
+
+static void expect_ops(int nops, int expected) {
+  if (nops != expected) {
+    asm_error("wrong number of operands");
+  }
+}
+
+static void jump(int opcode, Operand* op, int type) {
+  if (op->kind != OP_SYM) {
+    asm_error("jump target must be a label");
+  }
+  if (opcode >= 3840) {
+    out8(15);
+    opcode = opcode - 3840;
+  }
+  out8(opcode);
+  out_fixup(op->sym, type, -4, 4);
+}
+
+static void inst_mov(Operand* dst, Operand* src) {
+  if (src->kind == OP_REG) {
+    if (src->size == 1) {
+      inst_rm(false, needs_rex8(src) || needs_rex8(dst), 136, src->reg, dst); // 0x88
+    } else {
+      inst_rm(src->size == 8, false, 137, src->reg, dst); // 0x89
+    }
+    return;
+  }
+
+  if (dst->kind == OP_REG && (src->kind == OP_MEM || src->kind == OP_SYM)) {
+    if (dst->size == 1) {
+      inst_rm(false, needs_rex8(dst), 138, dst->reg, src); // 0x8a
+    } else {
+      inst_rm(dst->size == 8, false, 139, dst->reg, src); // 0x8b
+    }
+    return;
+  }
+
+  if (src->kind != OP_IMM) {
+    asm_error("invalid mov");
+  }
+
+  if (dst->kind == OP_REG && dst->size == 8 && !is_int32(src->imm)) {
+    rex(true, 0, dst, false);
+    out8(184 + dst->reg % 8); // 0xb8+r imm64
+    out64(src->imm);
+    return;
+  }
+  if (dst->kind == OP_REG && dst->size == 4) {
+    rex(false, 0, dst, false);
+    out8(184 + dst->reg % 8); // 0xb8+r imm32
+    out32(src->imm);
+    return;
+  }
+
+  int size = dst->size;
+  if (size == 1) {
+    inst_rm(false, needs_rex8(dst), 198, 0, dst); // 0xc6 /0
+    out8(src->imm);
+  } else if (size == 4 || size == 8) {
+    inst_rm(size == 8, false, 199, 0, dst); // 0xc7 /0 符号拡張したimm32
+    out32(src->imm);
+  } else {
+    asm_error("operand size is unknown");
+  }
+}
+
+// add, or, and, sub, xor, cmp。extはModRMのregに入れる番号で、r/m, regの形のオペコードはext*8+1
+static void inst_alu(int ext, Operand* dst, Operand* src) {
+  if (src->kind == OP_REG) {
+    if (src->size == 1) {
+      inst_rm(false, needs_rex8(src) || needs_rex8(dst), ext * 8, src->reg, dst);
+    } else {
+      inst_rm(src->size == 8, false, ext * 8 + 1, src->reg, dst);
+    }
+    return;
+  }
+
+  if (src->kind != OP_IMM) {
+    asm_error("invalid operand");
+  }
+  if (dst->size == 1) {
+    inst_rm(false, needs_rex8(dst), 128, ext, dst); // 0x80 /ext ib
+    out8(src->imm);
+  } else if (is_int8(src->imm)) {
+    inst_rm(dst->size == 8, false, 131, ext, dst); // 0x83 /ext ib
+    out8(src->imm);
+  } else {
+    inst_rm(dst->size == 8, false, 129, ext, dst); // 0x81 /ext id
+    out32(src->imm);
+  }
+}
+
+// imul, div, notのような0xf7 /ext r/mの命令
+static void inst_unary(int ext, Operand* op) {
+  if (op->kind != OP_REG) {
+    asm_error("invalid operand");
+  }
+  inst_rm(op->size == 8, false, 247, ext, op);
+}
+
+static void inst_setcc(int opcode, Operand* op) {
+  if (op->kind != OP_REG || op->size != 1) {
+    asm_error("setcc needs a byte register");
+  }
+  inst_rm(false, needs_rex8(op), opcode, 0, op);
+}
+
+// 0x0fb6 movzx, 0x0fbe movsx。バイトからの拡張だけ
+static void inst_extend(int opcode, Operand* dst, Operand* src) {
+  if (dst->kind != OP_REG || src->kind == OP_IMM || (src->kind == OP_REG && src->size != 1)) {
+    asm_error("invalid operand");
+  }
+  inst_rm(dst->size == 8, needs_rex8(src), opcode, dst->reg, src);
+}
+
+static void instruction(char* name, Operand* ops, int nops) {
+  Operand* a = &ops[0];
+  Operand* b = &ops[1];
+
+  if (streq(name, "push")) {
+    expect_ops(nops, 1);
+    if (a->kind == OP_REG) {
+      rex(false, 0, a, false);
+      out8(80 + a->reg % 8); // 0x50+r
+    } else if (a->kind == OP_IMM && is_int8(a->imm)) {
+      out8(106); // 0x6a
+      out8(a->imm);
+    } else if (a->kind == OP_IMM) {
+      out8(104); // 0x68
+      out32(a->imm);
+    } else {
+      asm_error("invalid operand");
+    }
+  } else if (streq(name, "pop")) {
+    expect_ops(nops, 1);
+    if (a->kind != OP_REG) {
+      asm_error("invalid operand");
+    }
+    rex(false, 0, a, false);
+    out8(88 + a->reg % 8); // 0x58+r
+  } else if (streq(name, "mov")) {
+    expect_ops(nops, 2);
+    inst_mov(a, b);
+  } else if (streq(name, "lea")) {
+    expect_ops(nops, 2);
+    inst_rm(true, false, 141, a->reg, b); // 0x8d
+  } else if (streq(name, "add")) {
+    expect_ops(nops, 2);
+    inst_alu(0, a, b);
+  } else if (streq(name, "or")) {
+    expect_ops(nops, 2);
+    inst_alu(1, a, b);
+  } else if (streq(name, "and")) {
+    expect_ops(nops, 2);
+    inst_alu(4, a, b);
+  } else if (streq(name, "sub")) {
+    expect_ops(nops, 2);
+    inst_alu(5, a, b);
+  } else if (streq(name, "xor")) {
+    expect_ops(nops, 2);
+    inst_alu(6, a, b);
+  } else if (streq(name, "cmp")) {
+    expect_ops(nops, 2);
+    inst_alu(7, a, b);
+  } else if (streq(name, "call")) {
+    expect_ops(nops, 1);
+    jump(232, a, R_X86_64_PLT32); // 0xe8
+  } else if (streq(name, "jmp")) {
+    expect_ops(nops, 1);
+    if (a->kind == OP_REG) {
+      inst_rm(false, false, 255, 4, a); // 0xff /4 ジャンプテーブルからの間接ジャンプ
+    } else {
+      jump(233, a, R_X86_64_PC32); // 0xe9
+    }
+  } else if (streq(name, "je")) {
+    expect_ops(nops, 1);
+    jump(3972, a, R_X86_64_PC32); // 0x0f84
+  } else if (streq(name, "jne")) {
+    expect_ops(nops, 1);
+    jump(3973, a, R_X86_64_PC32); // 0x0f85
+  } else if (streq(name, "ja")) {
+    expect_ops(nops, 1);
+    jump(3975, a, R_X86_64_PC32); // 0x0f87
+  } else if (streq(name, "jl")) {
+    expect_ops(nops, 1);
+    jump(3980, a, R_X86_64_PC32); // 0x0f8c
+  } else if (streq(name, "jge")) {
+    expect_ops(nops, 1);
+    jump(3981, a, R_X86_64_PC32); // 0x0f8d
+  } else if (streq(name, "jle")) {
+    expect_ops(nops, 1);
+    jump(3982, a, R_X86_64_PC32); // 0x0f8e
+  } else if (streq(name, "jg")) {
+    expect_ops(nops, 1);
+    jump(3983, a, R_X86_64_PC32); // 0x0f8f
+  } else if (streq(name, "sete")) {
+    expect_ops(nops, 1);
+    inst_setcc(3988, a); // 0x0f94
+  } else if (streq(name, "setne")) {
+    expect_ops(nops, 1);
+    inst_setcc(3989, a); // 0x0f95
+  } else if (streq(name, "setl")) {
+    expect_ops(nops, 1);
+    inst_setcc(3996, a); // 0x0f9c
+  } else if (streq(name, "setge")) {
+    expect_ops(nops, 1);
+    inst_setcc(3997, a); // 0x0f9d
+  } else if (streq(name, "setle")) {
+    expect_ops(nops, 1);
+    inst_setcc(3998, a); // 0x0f9e
+  } else if (streq(name, "setg")) {
+    expect_ops(nops, 1);
+    inst_setcc(3999, a); // 0x0f9f
+  } else if (streq(name, "movzx")) {
+    expect_ops(nops, 2);
+    inst_extend(4022, a, b); // 0x0fb6
+  } else if (streq(name, "movsx")) {
+    expect_ops(nops, 2);
+    inst_extend(4030, a, b); // 0x0fbe
+  } else if (streq(name, "shl")) {
+    expect_ops(nops, 2);
+    if (a->kind != OP_REG || b->kind != OP_IMM) {
+      asm_error("invalid operand");
+    }
+    inst_rm(a->size == 8, false, 193, 4, a); // 0xc1 /4 ib
+    out8(b->imm);
+  } else if (streq(name, "imul") && nops == 2) {
+    if (a->kind != OP_REG || b->kind != OP_REG) {
+      asm_error("invalid operand");
+    }
+    inst_rm(a->size == 8, false, 4015, a->reg, b); // 0x0faf imul reg, r/m
+  } else if (streq(name, "imul")) {
+    expect_ops(nops, 1);
+    inst_unary(5, a);
+  } else if (streq(name, "div")) {
+    expect_ops(nops, 1);
+    inst_unary(6, a);
+  } else if (streq(name, "not")) {
+    expect_ops(nops, 1);
+    inst_unary(2, a);
+  } else if (streq(name, "movaps")) {
+    expect_ops(nops, 2);
+    if (b->kind != OP_REG || b->size != 16) {
+      asm_error("invalid operand");
+    }
+    inst_rm(false, false, 3881, b->reg, a); // 0x0f29
+  } else if (streq(name, "leave")) {
+    expect_ops(nops, 0);
+    out8(201); // 0xc9
+  } else if (streq(name, "ret")) {
+    expect_ops(nops, 0);
+    out8(195); // 0xc3
+  } else {
+    asm_error("unknown instruction");
+  }
+}
+
+/* 字句解析 */
+
+static bool is_ident_char(char c) {
+  return isalnum(c) || c == '_' || c == '.';
+}
+
+static char* skip_spaces(char* p) {
+  for (; *p == ' ' || *p == '\t'; p++) {
+  }
+  return p;
+}
+
+static char* ident_end(char* p) {
+  for (; is_ident_char(*p); p++) {
+  }
+  return p;
+}
+
+static bool starts_with(char* p, char* prefix) {
+  return strncmp(p, prefix, strlen(prefix)) == 0;
+}
+
+static long number(char** rest) {
+  char* p = *rest;
+  bool neg = false;
+  if (*p == '-') {
+    neg = true;
+    p = skip_spaces(p + 1);
+  }
+  if (!isdigit(*p)) {
+    asm_error("number expected");
+  }
+  long v = 0;
+  for (; isdigit(*p); p++) {
+    v = v * 10 + *p - '0';
+  }
+  *rest = p;
+  if (neg) {
+    return -v;
+  }
+  return v;
+}
+
+static Register* find_register(char* p, size_t len) {
+  return map_get(registers, intern_len(p, len));
+}
+
+// [reg], [reg + n], [reg - n]
+static char* mem_operand(char* p, Operand* op) {
+  p = skip_spaces(p + 1);
+  char* end = ident_end(p);
+  Register* r = find_register(p, end - p);
+  if (r == NULL || r->size != 8) {
+    asm_error("base register expected");
+  }
+  op->kind = OP_MEM;
+  op->reg = r->num;
+
+  p = skip_spaces(end);
+  if (*p == '+') {
+    p = skip_spaces(p + 1);
+    op->imm += number(&p);
+  } else if (*p == '-') {
+    op->imm += number(&p);
+  }
+  p = skip_spaces(p);
+  if (*p != ']') {
+    asm_error("']' expected");
+  }
+  return p + 1;
+}
+
+static char* operand(char* p, Operand* op) {
+  op->kind = OP_IMM;
+  op->reg = 0;
+  op->size = 0;
+  op->imm = 0;
+  op->sym = NULL;
+
+  p = skip_spaces(p);
+  if (starts_with(p, "BYTE PTR ")) {
+    op->size = 1;
+    p = skip_spaces(p + 9);
+  } else if (starts_with(p, "DWORD PTR ")) {
+    op->size = 4;
+    p = skip_spaces(p + 10);
+  } else if (starts_with(p, "QWORD PTR ")) {
+    op->size = 8;
+    p = skip_spaces(p + 10);
+  }
+
+  if (*p == '[') {
+    return mem_operand(p, op);
+  }
+
+  if (isdigit(*p) || *p == '-') {
+    op->imm = number(&p);
+    if (*p == '[') {
+      // -8[rbp]
+      return mem_operand(p, op);
+    }
+    return p;
+  }
+
+  char* end = ident_end(p);
+  if (end == p) {
+    asm_error("operand expected");
+  }
+  Register* r = find_register(p, end - p);
+  if (r) {
+    op->kind = OP_REG;
+    op->reg = r->num;
+    op->size = r->size;
+  } else {
+    op->kind = OP_SYM;
+    op->sym = symbol(p, end - p);
+  }
+  return end;
+}
+
+// .byte, .int, .quadの値。数か、シンボルに定数を足したもの
+static void data_value(char* p, int size) {
+  p = skip_spaces(p);
+  if (isdigit(*p) || *p == '-') {
+    long v = number(&p);
+    if (size == 1) {
+      out8(v);
+    } else if (size == 4) {
+      out32(v);
+    } else {
+      out64(v);
+    }
+    return;
+  }
+
+  char* end = ident_end(p);
+  if (end == p || size == 1) {
+    asm_error("invalid data");
+  }
+  // sym+16やsym-8のように、シンボルのアドレスに定数を足したもの
+  int addend = 0;
+  char* q = skip_spaces(end);
+  if (*q == '+') {
+    q = skip_spaces(q + 1);
+    addend = number(&q);
+  } else if (*q == '-') {
+    addend = number(&q);
+  }
+  if (size == 4) {
+    out_fixup(symbol(p, end - p), R_X86_64_32, addend, 4);
+  } else {
+    out_fixup(symbol(p, end - p), R_X86_64_64, addend, 8);
+  }
+}
+
+static void directive(char* name, char* p) {
+  if (streq(name, ".text")) {
+    cur = SEC_TEXT;
+  } else if (streq(name, ".data")) {
+    cur = SEC_DATA;
+  } else if (streq(name, ".bss")) {
+    cur = SEC_BSS;
+  } else if (streq(name, ".section")) {
+    if (!starts_with(skip_spaces(p), ".rodata")) {
+      asm_error("unknown section");
+    }
+    cur = SEC_RODATA;
+  } else if (streq(name, ".global")) {
+    p = skip_spaces(p);
+    symbol(p, ident_end(p) - p)->is_global = true;
+  } else if (streq(name, ".byte")) {
+    data_value(p, 1);
+  } else if (streq(name, ".int")) {
+    data_value(p, 4);
+  } else if (streq(name, ".quad")) {
+    data_value(p, 8);
+  } else if (streq(name, ".zero")) {
+    p = skip_spaces(p);
+    long n = number(&p);
+    if (cur == SEC_BSS) {
+      sections[cur]->size += n;
+    } else {
+      for (long i = 0; i < n; i++) {
+        out8(0);
+      }
+    }
+  } else if (streq(name, ".align")) {
+    // 位置をnの倍数まで0で埋める
+    p = skip_spaces(p);
+    long n = number(&p);
+    size_t pad = roundup(here(), n) - here();
+    if (cur == SEC_BSS) {
+      sections[cur]->size += pad;
+    } else {
+      for (size_t i = 0; i < pad; i++) {
+        out8(0);
+      }
+    }
+  } else if (!streq(name, ".intel_syntax")) {
+    asm_error("unknown directive");
+  }
+}
+
+static void assemble_line(char* p, Operand* ops) {
+  p = skip_spaces(p);
+  if (*p == '\0' || *p == '#') {
+    return;
+  }
+
+  char* end = ident_end(p);
+  if (end == p) {
+    asm_error("syntax error");
+  }
+
+  if (*end == ':') {
+    Symbol* sym = symbol(p, end - p);
+    if (sym->section != SEC_UNDEF) {
+      asm_error("symbol is already defined");
+    }
+    sym->section = cur;
+    sym->offset = here();
+    return;
+  }
+
+  char* name = intern_len(p, end - p);
+  if (*name == '.') {
+    directive(name, end);
+    return;
+  }
+
+  int nops = 0;
+  p = skip_spaces(end);
+  if (*p != '\0') {
+    for (;;) {
+      if (nops == 2) {
+        asm_error("too many operands");
+      }
+      p = skip_spaces(operand(p, &ops[nops]));
+      nops++;
+      if (*p != ',') {
+        break;
+      }
+      p++;
+    }
+    if (*p != '\0' && *p != '#') {
+      asm_error("unexpected characters");
+    }
+  }
+  instruction(name, ops, nops);
+}
+
+/* 再配置 */
+
+static void resolve_fixups(void) {
+  for (size_t i = 0; i < fixups->length; i++) {
+    Fixup* f = fixups->ptr[i];
+    Symbol* sym = f->sym;
+    bool pcrel = f->type == R_X86_64_PC32 || f->type == R_X86_64_PLT32;
+
+    if (pcrel && sym->section == f->section) {
+      // 同じセクションの中の相対アドレスはここで決まる
+      int rel = sym->offset + f->addend - f->offset;
+      memcpy(sections[f->section]->data->buf + f->offset, &rel, 4);
+    } else if (sym->section != SEC_UNDEF && !sym->is_global) {
+      // ローカルなシンボルはセクションシンボルからの距離で表す
+      f->addend += sym->offset;
+      f->sym = sections[sym->section]->sym;
+      vec_push(sections[f->section]->relocs, f);
+    } else {
+      if (sym->name[0] == '.') {
+        error("assembler: undefined label: %s\n", sym->name);
+      }
+      sym->is_global = true;
+      vec_push(sections[f->section]->relocs, f);
+    }
+  }
+}
+
+/* ELFファイル */
+
+static void put(StringBuilder* sb, long v, int size) {
+  sb_append(sb, (char*)&v, size);
+}
+
+// hocはintをlongに符号拡張しないので、負になりうるintは上位32bitを別に書く
+static void put_int64(StringBuilder* sb, int v) {
+  put(sb, v, 4);
+  if (v < 0) {
+    put(sb, -1, 4);
+  } else {
+    put(sb, 0, 4);
+  }
+}
+
+static void align(StringBuilder* sb, int n) {
+  for (; sb->length % n != 0;) {
+    sb_putc(sb, '\0');
+  }
+}
+
+static int add_string(StringBuilder* strtab, char* s) {
+  int offset = strtab->length;
+  sb_append(strtab, s, strlen(s) + 1);
+  return offset;
+}
+
+static void put_symbol(StringBuilder* symtab, int name, bool global, int type, int section, size_t value) {
+  int bind = 0;
+  if (global) {
+    bind = 1;
+  }
+  put(symtab, name, 4);
+  put(symtab, bind * 16 + type, 1);
+  put(symtab, 0, 1);
+  put(symtab, section, 2);
+  put(symtab, value, 8);
+  put(symtab, 0, 8);
+}
+
+// 番号を振ってシンボル表を作る。ローカルなシンボルを先に置き、最初のグローバルなシンボルの番号を返す
+static int build_symtab(StringBuilder* symtab, StringBuilder* strtab) {
+  put_symbol(symtab, 0, false, 0, 0, 0);
+  for (int i = 1; i < NUM_SECTIONS; i++) {
+    put_symbol(symtab, 0, false, 3, i, 0); // STT_SECTION
+  }
+  int index = NUM_SECTIONS;
+
+  // .Lで始まるラベルはGNU asと同じくシンボル表に入れない
+  for (size_t i = 0; i < symbol_list->length; i++) {
+    Symbol* sym = symbol_list->ptr[i];
+    if (!sym->is_global && sym->section != SEC_UNDEF && sym->name[0] != '.') {
+      sym->index = index;
+      index++;
+      put_symbol(symtab, add_string(strtab, sym->name), false, 0, sym->section, sym->offset);
+    }
+  }
+
+  int first_global = index;
+  for (size_t i = 0; i < symbol_list->length; i++) {
+    Symbol* sym = symbol_list->ptr[i];
+    if (sym->is_global) {
+      int type = 0;
+      if (sym->section == SEC_TEXT) {
+        type = 2; // STT_FUNC
+      } else if (sym->section != SEC_UNDEF) {
+        type = 1; // STT_OBJECT
+      }
+      sym->index = index;
+      index++;
+      put_symbol(symtab, add_string(strtab, sym->name), true, type, sym->section, sym->offset);
+    }
+  }
+  return first_global;
+}
+
+static StringBuilder* build_rela(Vector* relocs) {
+  StringBuilder* sb = new_sb();
+  for (size_t i = 0; i < relocs->length; i++) {
+    Fixup* f = relocs->ptr[i];
+    put(sb, f->offset, 8);
+    put(sb, f->type, 4); // r_infoの下位32bitが種類、上位32bitがシンボルの番号
+    put(sb, f->sym->index, 4);
+    put_int64(sb, f->addend);
+  }
+  return sb;
+}
+
+typedef struct SectionHeader {
+  int name;
+  int type;  // SHT_PROGBITS 1, SHT_SYMTAB 2, SHT_STRTAB 3, SHT_RELA 4, SHT_NOBITS 8
+  int flags; // SHF_WRITE 1, SHF_ALLOC 2, SHF_EXECINSTR 4, SHF_INFO_LINK 64
+  size_t offset;
+  size_t size;
+  int link;
+  int info;
+  int alignment;
+  int entsize;
+} SectionHeader;
+
+static StringBuilder* out;
+static StringBuilder* shstrtab;
+static Vector* shdrs; // Vector(SectionHeader*) 番号順
+
+// contentsをoutに書き、shの位置と大きさにする
+static void set_contents(SectionHeader* sh, StringBuilder* contents) {
+  align(out, 8);
+  sh->offset = out->length;
+  sh->size = contents->length;
+  sb_append(out, contents->buf, contents->length);
+}
+
+static SectionHeader* add_section(char* name, int type, int flags, int alignment, StringBuilder* contents) {
+  SectionHeader* sh = calloc(1, sizeof(SectionHeader));
+  sh->name = add_string(shstrtab, name);
+  sh->type = type;
+  sh->flags = flags;
+  sh->alignment = alignment;
+  if (contents) {
+    set_contents(sh, contents);
+  }
+  vec_push(shdrs, sh);
+  return sh;
+}
+
+static void add_rela(char* name, int section) {
+  SectionHeader* sh = add_section(name, 4, 64, 8, build_rela(sections[section]->relocs));
+  sh->link = SHN_SYMTAB;
+  sh->info = section;
+  sh->entsize = 24;
+}
+
+static void put_shdr(SectionHeader* sh) {
+  put(out, sh->name, 4);
+  put(out, sh->type, 4);
+  put(out, sh->flags, 8);
+  put(out, 0, 8); // sh_addr
+  put(out, sh->offset, 8);
+  put(out, sh->size, 8);
+  put(out, sh->link, 4);
+  put(out, sh->info, 4);
+  put(out, sh->alignment, 8);
+  put(out, sh->entsize, 8);
+}
+
+static void write_elf(char* path) {
+  out = new_sb();
+  sb_putc(out, 127);
+  sb_append(out, "ELF", 3);
+  put(out, 2, 1); // ELFCLASS64
+  put(out, 1, 1); // ELFDATA2LSB
+  put(out, 1, 1); // EV_CURRENT
+  put(out, 0, 1); // ELFOSABI_NONE
+  put(out, 0, 8);
+  put(out, 1, 2); // ET_REL
+  put(out, 62, 2); // EM_X86_64
+  put(out, 1, 4);
+  put(out, 0, 8); // e_entry
+  put(out, 0, 8); // e_phoff
+  size_t shoff_pos = out->length;
+  put(out, 0, 8); // e_shoff。最後に埋める
+  put(out, 0, 4); // e_flags
+  put(out, 64, 2); // e_ehsize
+  put(out, 0, 2); // e_phentsize
+  put(out, 0, 2); // e_phnum
+  put(out, 64, 2); // e_shentsize
+  put(out, NUM_SHDRS, 2);
+  put(out, SHN_SHSTRTAB, 2);
+
+  StringBuilder* symtab = new_sb();
+  StringBuilder* strtab = new_sb();
+  sb_putc(strtab, '\0');
+  int first_global = build_symtab(symtab, strtab);
+
+  shstrtab = new_sb();
+  sb_putc(shstrtab, '\0');
+  shdrs = new_vec();
+  vec_push(shdrs, calloc(1, sizeof(SectionHeader)));
+  add_section(".text", 1, 6, 16, sections[SEC_TEXT]->data);
+  add_section(".data", 1, 3, 8, sections[SEC_DATA]->data);
+  SectionHeader* bss = add_section(".bss", 8, 3, 8, NULL);
+  bss->size = sections[SEC_BSS]->size;
+  add_section(".rodata", 1, 2, 8, sections[SEC_RODATA]->data);
+  add_rela(".rela.text", SEC_TEXT);
+  add_rela(".rela.data", SEC_DATA);
+  add_rela(".rela.rodata", SEC_RODATA);
+  SectionHeader* sh = add_section(".symtab", 2, 0, 8, symtab);
+  sh->link = SHN_STRTAB;
+  sh->info = first_global;
+  sh->entsize = 24;
+  add_section(".strtab", 3, 0, 1, strtab);
+  SectionHeader* names = add_section(".shstrtab", 3, 0, 1, NULL);
+  add_section(".note.GNU-stack", 1, 0, 1, NULL); // スタックを実行可能にしない
+  set_contents(names, shstrtab);
+
+  align(out, 8);
+  size_t shoff = out->length;
+  memcpy(out->buf + shoff_pos, &shoff, 8);
+  for (size_t i = 0; i < shdrs->length; i++) {
+    put_shdr(shdrs->ptr[i]);
+  }
+
+  FILE* fp = fopen(path, "w");
+  if (fp == NULL) {
+    error("cannot open file: %s\n", path);
+  }
+  fwrite(out->buf, 1, out->length, fp);
+  fclose(fp);
+}
+
+// emit.cが出力したアセンブリtextを機械語に直す。textは書き換える
+static void assemble(char* text) {
+  init();
+  Operand* ops = calloc(2, sizeof(Operand));
+
+  line_no = 0;
+  char* p = text;
+  for (; *p != '\0';) {
+    line = p;
+    line_no++;
+    char* end = strchr(p, '\n');
+    if (end) {
+      *end = '\0';
+      p = end + 1;
+    } else {
+      p = p + strlen(p);
+    }
+    assemble_line(line, ops);
+  }
+
+  resolve_fixups();
+}
+
+// pathにオブジェクトファイルを書く
+void write_object(char* path, char* text) {
+  assemble(text);
+  write_elf(path);
+}
+
+/* 実行 */
+
+// 外部の関数はjmp [rip+0]と飛び先のアドレスからなるスタブを経由して呼ぶ
+#define STUB_SIZE 16
+#define PAGE_SIZE 4096
+
+#ifndef __hoc__
+static void* extern_address(char* name) {
+  return dlsym(RTLD_DEFAULT, name);
+}
+
+static int call_main(char* main_addr, int argc, char** argv) {
+  int (*main_func)(int, char**) = (int (*)(int, char**))main_addr;
+  return main_func(argc, argv);
+}
+#endif
+
+#ifdef __hoc__
+// hocは関数ポインタを呼べず、hocでコンパイルしたhocは静的リンクなのでdlsymも使えない
+static void* extern_address(char* name) {
+  error("-run is not supported by hoc compiled with hoc: %s\n", name);
+  return NULL;
+}
+
+static int call_main(char* main_addr, int argc, char** argv) {
+  error("-run is not supported by hoc compiled with hoc\n");
+  return 1;
+}
+#endif
+
+static char* section_addr[NUM_SECTIONS];
+static char* stubs;
+static char** got; // 外部のシンボルのアドレス。leaで参照している外部の変数はここから読む
+
+static char* symbol_address(Symbol* sym, int type, char* place) {
+  if (sym->section != SEC_UNDEF) {
+    return section_addr[sym->section] + sym->offset;
+  }
+  if (type == R_X86_64_PLT32) {
+    return stubs + sym->index * STUB_SIZE;
+  }
+  if (type == R_X86_64_PC32) {
+    // lea rax, [rip+sym] (48 8d 05) を mov rax, [rip+got] (48 8b 05) に書き換える
+    char* opcode = place - 2;
+    if ((*opcode & 255) != 141) {
+      error("-run: cannot reference external symbol: %s\n", sym->name);
+    }
+    *opcode = 139;
+    return (char*)&got[sym->index];
+  }
+  return got[sym->index];
+}
+
+static void relocate(Fixup* f) {
+  char* place = section_addr[f->section] + f->offset;
+  char* target = symbol_address(f->sym, f->type, place) + f->addend;
+  if (f->type == R_X86_64_64) {
+    memcpy(place, &target, 8);
+    return;
+  }
+
+  long v = (long)target;
+  if (f->type != R_X86_64_32) {
+    v = v - (long)place;
+  }
+  if (!is_int32(v)) {
+    error("-run: relocation out of range: %s\n", f->sym->name);
+  }
+  int x = v;
+  memcpy(place, &x, 4);
+}
+
+// textを機械語に直してこのプロセスのメモリに置き、mainを呼んでその戻り値を返す
+int run_object(char* text, int argc, char** argv) {
+  assemble(text);
+
+  // 外部のシンボルに番号を振る
+  int num_externs = 0;
+  for (size_t i = 0; i < symbol_list->length; i++) {
+    Symbol* sym = symbol_list->ptr[i];
+    if (sym->section == SEC_UNDEF) {
+      sym->index = num_externs;
+      num_externs++;
+    }
+  }
+
+  // 実行可能なページに.textとスタブを、その後ろの書き込み可能なページに.rodata, .data, .bss, GOTを置く
+  size_t text_size = roundup(sections[SEC_TEXT]->data->length + num_externs * STUB_SIZE, PAGE_SIZE);
+  size_t rodata_size = roundup(sections[SEC_RODATA]->data->length, 8);
+  size_t data_size = roundup(sections[SEC_DATA]->data->length, 8);
+  size_t bss_size = roundup(sections[SEC_BSS]->size, 8);
+  size_t total = text_size + rodata_size + data_size + bss_size + num_externs * 8;
+
+  char* mem = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ((long)mem < 0) {
+    error("-run: mmap failed\n");
+  }
+  section_addr[SEC_TEXT] = mem;
+  section_addr[SEC_RODATA] = mem + text_size;
+  section_addr[SEC_DATA] = section_addr[SEC_RODATA] + rodata_size;
+  section_addr[SEC_BSS] = section_addr[SEC_DATA] + data_size;
+  stubs = mem + sections[SEC_TEXT]->data->length;
+  got = (char**)(section_addr[SEC_BSS] + bss_size);
+
+  memcpy(section_addr[SEC_TEXT], sections[SEC_TEXT]->data->buf, sections[SEC_TEXT]->data->length);
+  memcpy(section_addr[SEC_RODATA], sections[SEC_RODATA]->data->buf, sections[SEC_RODATA]->data->length);
+  memcpy(section_addr[SEC_DATA], sections[SEC_DATA]->data->buf, sections[SEC_DATA]->data->length);
+
+  for (size_t i = 0; i < symbol_list->length; i++) {
+    Symbol* sym = symbol_list->ptr[i];
+    if (sym->section == SEC_UNDEF) {
+      char* addr = extern_address(sym->name);
+      if (addr == NULL) {
+        error("-run: undefined symbol: %s\n", sym->name);
+      }
+      got[sym->index] = addr;
+      char* stub = stubs + sym->index * STUB_SIZE;
+      stub[0] = 255; // ff 25 00000000: jmp [rip+0]
+      stub[1] = 37; // mmapしたページは0で埋まっている
+      memcpy(stub + 6, &addr, 8);
+    }
+  }
+
+  for (int i = 1; i < NUM_SECTIONS; i++) {
+    Vector* relocs = sections[i]->relocs;
+    for (size_t j = 0; j < relocs->length; j++) {
+      relocate(relocs->ptr[j]);
+    }
+  }
+
+  if (mprotect(mem, text_size, PROT_READ | PROT_EXEC) != 0) {
+    error("-run: mprotect failed\n");
+  }
+
+  Symbol* main_sym = map_get(symbols, intern("main"));
+  if (main_sym == NULL || main_sym->section != SEC_TEXT) {
+    error("-run: main is not defined\n");
+  }
+  return call_main(section_addr[SEC_TEXT] + main_sym->offset, argc, argv);
+}
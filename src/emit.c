@@ -1,14 +1,39 @@
 #include "hoc.h"
 
+// 式の値は評価スタックに積む。深さdの値はレジスタ(Reg)d % NUM_STACK_REGSに置き、
+// レジスタが一巡したら同じレジスタを使う下の値を機械のスタックに退避して、上の値を捨てるときに戻す。
+// 値の置き場所は深さだけで決まるので、分岐の合流点で食い違わない
+#define NUM_STACK_REGS 9
+
 static char* reg64[9] = { "rax", "rdi", "rsi", "rdx", "rcx", "r8", "r9", "r10", "r11" };
 static char* reg32[9] = { "eax", "edi", "esi", "edx", "ecx", "r8d", "r9d", "r10d", "r11d" };
 static char* reg8[9] = { "al", "dil", "sil", "dl", "cl", "r8b", "r9b", "r10b", "r11b" };
 static Reg argregs[6] = {DI, SI, DX, CX, R8, R9};
+// ラベルは関数ごとの名前空間に置く。関数を並列に生成しても逐次の場合と同じ出力になる
+static char* func_name;
 static int label_id;
 static char* func_end_label;
 static char* break_label;
 static int numgp;
-#define REGAREA_SIZE 176
+static int depth; // 評価スタックに積んだ値の数
+
+// アドレスを取られないスカラーのローカル変数は、関数全体を通して呼び出し先保存レジスタに置く
+#define NUM_VAR_REGS 5
+static char* var_reg64[5] = { "rbx", "r12", "r13", "r14", "r15" };
+static char* var_reg32[5] = { "ebx", "r12d", "r13d", "r14d", "r15d" };
+static char* var_reg8[5] = { "bl", "r12b", "r13b", "r14b", "r15b" };
+static bool use_var_regs = true;
+
+typedef struct LocalUse {
+  Node* var;
+  int weight; // 現れる回数をループの深さで重み付けしたもの
+  bool addr_taken;
+  bool in_reg;
+} LocalUse;
+
+static Vector* local_uses; // Vector<LocalUse*>
+static Node* reg_vars[5]; // i番目のレジスタに置いた変数
+static int num_reg_vars;
 
 static char* reg(Reg r, size_t s) {
   if (s == 1) {
@@ -21,7 +46,7 @@ static char* reg(Reg r, size_t s) {
 }
 
 static char* new_label(char* name) {
-  return format(".L%s%u", name, label_id++);
+  return format(".L%s.%s%u", func_name, name, label_id++);
 }
 
 #ifndef __hoc__
@@ -31,9 +56,10 @@ __attribute__((format(printf, 1, 2))) static void emit(char *fmt, ...);
 static void emit(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  printf("\t");
-  vprintf(fmt, ap);
-  printf("\n");
+  asm_putc('\t');
+  asm_vprintf(fmt, ap);
+  va_end(ap);
+  asm_putc('\n');
 }
 
 #ifndef __hoc__
@@ -41,28 +67,85 @@ __attribute__((format(printf, 1, 2))) static void comment(char *fmt, ...);
 #endif
 
 static void comment(char *fmt, ...) {
+  if (!asm_comments()) {
+    return;
+  }
   va_list ap;
   va_start(ap, fmt);
-  printf("# ");
-  vprintf(fmt, ap);
-  printf("\n");
+  asm_puts("# ");
+  asm_vprintf(fmt, ap);
+  va_end(ap);
+  asm_putc('\n');
 }
 
 static void push(Reg src) {
-  printf("\tpush %s\n", reg64[src]);
+  asm_puts("\tpush ");
+  asm_puts(reg64[src]);
+  asm_putc('\n');
 }
 
-static void pushi(int src) {
-  printf("\tpush %d\n", src);
+static void pop(Reg dst) {
+  asm_puts("\tpop ");
+  asm_puts(reg64[dst]);
+  asm_putc('\n');
 }
 
-static void pop(Reg dst) {
-  printf("\tpop %s\n", reg64[dst]);
+static void mov(Reg dst, Reg src) {
+  if (dst != src) {
+    emit("mov %s, %s", reg64[dst], reg64[src]);
+  }
 }
 
-static void pop_unused_value(Node* node) {
-  if (node->tag != NDEFVAR && node->type != NULL && node->type->ty != TY_VOID) {
-    pop(AX);
+/* 評価スタック */
+
+static Reg reg_at(int d) {
+  return d % NUM_STACK_REGS;
+}
+
+// 上からn番目(0始まり)の値のレジスタ
+static Reg top(int n) {
+  return reg_at(depth - 1 - n);
+}
+
+// 値の場所を1つ積み、そのレジスタを返す
+static Reg push_value(void) {
+  if (depth >= NUM_STACK_REGS) {
+    push(reg_at(depth));
+  }
+  depth++;
+  return top(0);
+}
+
+// 一番上の値を捨てる。退避していた値があればレジスタに戻す
+static void pop_value(void) {
+  depth--;
+  if (depth >= NUM_STACK_REGS) {
+    pop(reg_at(depth));
+  }
+}
+
+// 上からn個を除いた値のどれかがレジスタrに入っているか
+static bool reg_in_use(Reg r, int n) {
+  int lo = depth - NUM_STACK_REGS;
+  if (lo < 0) {
+    lo = 0;
+  }
+  for (int d = lo; d < depth - n; d++) {
+    if (reg_at(d) == r) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void emit_node(Node* node);
+
+// 文として評価する。宣言の初期化やforの式のように文の位置に置かれた式の値は捨てる
+static void emit_stmt(Node* node) {
+  int d = depth;
+  emit_node(node);
+  while (depth > d) {
+    pop_value();
   }
 }
 
@@ -80,44 +163,178 @@ static void revert_rsp(void) {
   comment("end revert rsp");
 }
 
-static void load(Reg dst, size_t size) {
+// base+offsetの番地からsizeバイト読む
+static void load(Reg dst, char* base, int offset, size_t size) {
+  if (size == 1 && offset == 0) {
+    // 8bitの値は自動では拡張されないので、32bitレジスタに符号拡張して読む
+    emit("movsx %s, BYTE PTR [%s]", reg(dst, 4), base);
+  } else if (size == 1) {
+    emit("movsx %s, BYTE PTR %d[%s]", reg(dst, 4), offset, base);
+  } else if (offset == 0) {
+    emit("mov %s, [%s]", reg(dst, size), base);
+  } else {
+    emit("mov %s, %d[%s]", reg(dst, size), offset, base);
+  }
+}
+
+static void store(char* base, int offset, Reg src, size_t size) {
+  if (offset == 0) {
+    emit("mov [%s], %s", base, reg(src, size));
+  } else {
+    emit("mov %d[%s], %s", offset, base, reg(src, size));
+  }
+}
+
+static int var_offset(Node* var) {
+  return 0 - (int)var->offset;
+}
+
+/* レジスタに置くローカル変数 */
+
+static char* var_reg(int i, size_t size) {
   if (size == 1) {
-    // 8bitの値は自動では0拡張されないので、movzxを使う
-    // 32bit整数との演算を行うので32bitレジスタにロードする
-    emit("movsx %s, BYTE PTR [rax]", reg(dst, 4));
+    return var_reg8[i];
+  } else if (size == 4) {
+    return var_reg32[i];
   } else {
-   emit("mov %s, [rax]", reg(dst, size));
+    return var_reg64[i];
   }
 }
 
-static void store(Reg src, size_t size) {
-  emit("mov [rax], %s", reg(src, size));
+// varを置いたレジスタの番号。フレームにあれば-1
+static int find_reg_var(Node* var) {
+  for (int i = 0; i < num_reg_vars; i++) {
+    if (reg_vars[i]->offset == var->offset) {
+      return i;
+    }
+  }
+  return -1;
 }
 
-static void emit_node(Node* node);
+static LocalUse* local_use(Node* var) {
+  for (size_t i = 0; i < local_uses->length; i++) {
+    LocalUse* use = local_uses->ptr[i];
+    if (use->var->offset == var->offset) {
+      return use;
+    }
+  }
+  LocalUse* use = arena_alloc(ARENA_AST, sizeof(LocalUse));
+  use->var = var;
+  vec_push(local_uses, use);
+  return use;
+}
+
+static void count_uses(Node* node, int loop_depth);
+
+static void count_uses_vec(Vector* v, int loop_depth) {
+  if (!v) {
+    return;
+  }
+  for (size_t i = 0; i < v->length; i++) {
+    count_uses(v->ptr[i], loop_depth);
+  }
+}
+
+// ローカル変数が現れるたびに8のループの深さ乗を足し、&で使われる変数に印をつける
+static void count_uses(Node* node, int loop_depth) {
+  if (!node) {
+    return;
+  }
+  if (node->tag == NVAR) {
+    int weight = 1;
+    for (int i = 0; i < loop_depth && i < 6; i++) {
+      weight = weight * 8;
+    }
+    LocalUse* use = local_use(node);
+    use->weight = use->weight + weight;
+    return;
+  }
+  if (node->tag == NADDR && node->expr->tag == NVAR) {
+    local_use(node->expr)->addr_taken = true;
+  }
+
+  int inner = loop_depth;
+  if (node->tag == NWHILE || node->tag == NFOR) {
+    inner = loop_depth + 1;
+  }
+  count_uses(node->lhs, loop_depth);
+  count_uses(node->rhs, loop_depth);
+  count_uses(node->expr, loop_depth);
+  count_uses(node->init, loop_depth);
+  count_uses(node->cond, inner);
+  count_uses(node->step, inner);
+  count_uses(node->body, inner);
+  count_uses(node->then, loop_depth);
+  count_uses(node->els, loop_depth);
+  count_uses_vec(node->stmts, loop_depth);
+  count_uses_vec(node->args, loop_depth);
+}
 
-static void emit_var(Node* var) {
-  comment("start lval NVAR %s", var->name);
-  emit("lea rax, -%zu[rbp]", var->offset);
-  push(AX);
-  comment("end lval NVAR %s", var->name);
+static bool is_scalar(Type* type) {
+  return type->array_size == 0 && type->ty != TY_STRUCT && type->ty != TY_VOID;
+}
+
+// 重みの大きい順にNUM_VAR_REGS個までレジスタに置く。
+// 退避と復元の2回のメモリアクセスより得をしない、ほとんど使わない変数はフレームに残す
+static void assign_var_regs(Function* func) {
+  num_reg_vars = 0;
+  if (!use_var_regs) {
+    return;
+  }
+
+  local_uses = new_vec();
+  for (size_t i = 0; i < func->params->length; i++) {
+    LocalUse* use = local_use(func->params->ptr[i]);
+    use->weight = use->weight + 1;
+  }
+  count_uses(func->body, 0);
+
+  while (num_reg_vars < NUM_VAR_REGS) {
+    LocalUse* best = NULL;
+    for (size_t i = 0; i < local_uses->length; i++) {
+      LocalUse* use = local_uses->ptr[i];
+      if (!use->in_reg && !use->addr_taken && is_scalar(use->var->type) && use->weight > 2 &&
+          (!best || use->weight > best->weight)) {
+        best = use;
+      }
+    }
+    if (!best) {
+      break;
+    }
+    best->in_reg = true;
+    reg_vars[num_reg_vars] = best->var;
+    num_reg_vars++;
+  }
+}
+
+// 退避したレジスタを置くフレームの位置。ローカル変数のすぐ下にpushする
+static int saved_reg_offset(Function* func, int i) {
+  int offset = func->local_size + (i + 1) * 8;
+  if (func->has_va_arg) {
+    offset = offset + REGAREA_SIZE;
+  }
+  return 0 - offset;
 }
 
 static void emit_lval(Node* node) {
   if (node->tag == NVAR) {
-    emit_var(node);
+    if (find_reg_var(node) >= 0) {
+      bad_token(node->token, "emit error: address of a register variable");
+    }
+    comment("start lval NVAR %s", node->name);
+    emit("lea %s, %d[rbp]", reg64[push_value()], var_offset(node));
+    comment("end lval NVAR %s", node->name);
   } else if (node->tag == NGVAR) {
     comment("start lval NGVAR");
-    emit("lea rax, %s", node->name);
-    push(AX);
+    emit("lea %s, %s", reg64[push_value()], node->name);
     comment("end lval NGVAR");
   } else if (node->tag == NMEMBER) {
     comment("start lval NMEMBER");
     emit_lval(node->expr);
     size_t offset = field_offset(type_of(node->expr)->fields, node->name);
-    pop(AX);
-    emit("lea rax, %zu[rax]", offset);
-    push(AX);
+    if (offset != 0) {
+      emit("lea %s, %zu[%s]", reg64[top(0)], offset, reg64[top(0)]);
+    }
     comment("end lval NMEMBER");
   } else if (node->tag == NDEREF){
     comment("start lval NDEREF");
@@ -129,27 +346,303 @@ static void emit_lval(Node* node) {
 }
 
 static void emit_assign(Node* lhs, Node* rhs) {
+  size_t size = size_of(type_of(lhs));
+  if (lhs->tag == NVAR) {
+    // ローカル変数にはアドレスを計算せずにレジスタかフレームへ直接書く
+    emit_node(rhs);
+    int r = find_reg_var(lhs);
+    if (r >= 0) {
+      emit("mov %s, %s", var_reg(r, size), reg(top(0), size));
+    } else {
+      store("rbp", var_offset(lhs), top(0), size);
+    }
+    return;
+  }
+
+  int offset = 0;
   comment("  start lval");
-  emit_lval(lhs);
+  if (lhs->tag == NMEMBER) {
+    emit_lval(lhs->expr);
+    offset = field_offset(type_of(lhs->expr)->fields, lhs->name);
+  } else {
+    emit_lval(lhs);
+  }
   comment("  end lval");
   emit_node(rhs);
-  pop(DI);
-  pop(AX);
-  store(DI, size_of(type_of(lhs)));
-  push(DI);
+  store(reg64[top(1)], offset, top(0), size);
+  mov(top(1), top(0));
+  pop_value();
 }
 
 static void emit_builtin_va_start(Node* node) {
-  align_rsp();
   emit_node(node);
-  pop(AX); // address of va_list
-  push(CX); // save register
-  emit("mov DWORD PTR [rax], %d", numgp * 8);
-  emit("mov DWORD PTR [rax + 4], 48");
-  emit("lea rcx, [rbp - %d]", REGAREA_SIZE);
-  emit("mov [rax + 16], rcx");
-  pop(CX); // load register
+  char* addr = reg64[top(0)]; // address of va_list
+  Reg tmp = push_value();
+  emit("mov DWORD PTR [%s], %d", addr, numgp * 8);
+  emit("mov DWORD PTR [%s + 4], 48", addr);
+  emit("lea %s, [rbp - %d]", reg64[tmp], REGAREA_SIZE);
+  emit("mov [%s + 16], %s", addr, reg64[tmp]);
+  pop_value();
+  // 呼び出しと同じく値を1つ残す。中身は使われない
+}
+
+// 引数は深さ1から積み、i番目の値がそのままargregs[i]に入るようにする。
+// 呼び出しで壊れるレジスタに残っている値は前後で退避する
+static void emit_call(Node* node) {
+  int base = depth;
+  int lo = base - NUM_STACK_REGS;
+  if (lo < 0) {
+    lo = 0;
+  }
+  for (int d = lo; d < base; d++) {
+    push(reg_at(d));
+  }
+
+  depth = 1;
+  for (size_t i = 0; i < node->args->length; i++) {
+    emit_node(node->args->ptr[i]);
+  }
+  depth = base;
+
+  // スタックをがりがりいじりながらコード生成してるので、
+  // rspのアライメントをうまいこと扱う必要がある。
+  align_rsp();
+
+  push(R10);
+  push(R11);
+  emit("mov %s, %d", reg64[AX], 0);
+
+  emit("call %s", node->name);
+  pop(R11);
+  pop(R10);
+
   revert_rsp();
+
+  // 戻り値の場所が使うレジスタの元の値(深さbase-9)は、退避したまま機械のスタックに残す
+  mov(reg_at(base), AX);
+  for (int d = base - 1; d > base - NUM_STACK_REGS && d >= 0; d--) {
+    pop(reg_at(d));
+  }
+  depth++;
+}
+
+// 上の2つの値にopを施し、結果を下の値の場所に残す
+static void emit_binop(char* op, Node* node, size_t size) {
+  emit_node(node->lhs);
+  if (node->rhs->tag == NINT && size != 1) {
+    emit("%s %s, %d", op, reg(top(0), size), node->rhs->integer);
+    return;
+  }
+  emit_node(node->rhs);
+  emit("%s %s, %s", op, reg(top(1), size), reg(top(0), size));
+  pop_value();
+}
+
+// 割り算はrdx:raxを使うので、そこにある値をよけてから行う
+static void emit_div(Node* node, bool mod) {
+  emit_node(node->lhs);
+  emit_node(node->rhs);
+  size_t size = size_of(type_of(node->lhs));
+  if (size == 1) {
+    size = 4;
+  }
+  Reg lhs = top(1);
+  Reg rhs = top(0);
+
+  bool save_ax = lhs != AX && reg_in_use(AX, 2);
+  bool save_dx = lhs != DX && reg_in_use(DX, 2);
+  if (save_ax) {
+    push(AX);
+  }
+  if (save_dx) {
+    push(DX);
+  }
+
+  // 割る数がraxかrdxにあれば、ほかのレジスタに移す
+  Reg divisor = rhs;
+  bool save_divisor = false;
+  if (rhs == AX || rhs == DX) {
+    divisor = CX;
+    if (lhs == CX) {
+      divisor = SI;
+    }
+    save_divisor = reg_in_use(divisor, 2);
+    if (save_divisor) {
+      push(divisor);
+    }
+    mov(divisor, rhs);
+  }
+
+  mov(AX, lhs);
+  emit("mov %s, %d", reg64[DX], 0);
+  emit("div %s", reg(divisor, size));
+  if (mod) {
+    mov(lhs, DX);
+  } else {
+    mov(lhs, AX);
+  }
+
+  if (save_divisor) {
+    pop(divisor);
+  }
+  if (save_dx) {
+    pop(DX);
+  }
+  if (save_ax) {
+    pop(AX);
+  }
+  pop_value();
+}
+
+static bool is_comparison(Node* node) {
+  return node->tag == NLT || node->tag == NLE || node->tag == NGT ||
+    node->tag == NGE || node->tag == NEQ || node->tag == NNE;
+}
+
+// 比較が成り立つときに飛ぶjccの条件。negateなら成り立たないときに飛ぶ
+static char* jump_cond(enum NodeTag tag, bool negate) {
+  if (negate) {
+    if (tag == NLT) {
+      tag = NGE;
+    } else if (tag == NLE) {
+      tag = NGT;
+    } else if (tag == NGT) {
+      tag = NLE;
+    } else if (tag == NGE) {
+      tag = NLT;
+    } else if (tag == NEQ) {
+      tag = NNE;
+    } else {
+      tag = NEQ;
+    }
+  }
+
+  switch (tag) {
+  case NLT: return "l";
+  case NLE: return "le";
+  case NGT: return "g";
+  case NGE: return "ge";
+  case NEQ: return "e";
+  default: return "ne";
+  }
+}
+
+// 比較の両辺を評価してcmpし、両辺とも捨てる。popはフラグを変えない
+static void emit_compare(Node* node) {
+  size_t size = size_of(type_of(node->lhs));
+  emit_node(node->lhs);
+  if (node->rhs->tag == NINT && size != 1) {
+    emit("cmp %s, %d", reg(top(0), size), node->rhs->integer);
+  } else {
+    emit_node(node->rhs);
+    emit("cmp %s, %s", reg(top(1), size), reg(top(0), size));
+    pop_value();
+  }
+  pop_value();
+}
+
+// condの真偽がjump_ifと同じならlabelへ飛び、そうでなければ次の命令に落ちる。
+// 比較や論理演算の結果を0/1の値にせず、cmpとjccだけで分岐する
+static void emit_cond_jump(Node* cond, bool jump_if, char* label) {
+  if (is_comparison(cond)) {
+    emit_compare(cond);
+    emit("j%s %s", jump_cond(cond->tag, !jump_if), label);
+  } else if (cond->tag == NLOGNOT) {
+    emit_cond_jump(cond->expr, !jump_if, label);
+  } else if (cond->tag == NLOGAND && !jump_if) {
+    emit_cond_jump(cond->lhs, false, label);
+    emit_cond_jump(cond->rhs, false, label);
+  } else if (cond->tag == NLOGAND) {
+    char* skip = new_label("skip");
+    emit_cond_jump(cond->lhs, false, skip);
+    emit_cond_jump(cond->rhs, true, label);
+    asm_label(skip);
+  } else if (cond->tag == NLOGOR && jump_if) {
+    emit_cond_jump(cond->lhs, true, label);
+    emit_cond_jump(cond->rhs, true, label);
+  } else if (cond->tag == NLOGOR) {
+    char* skip = new_label("skip");
+    emit_cond_jump(cond->lhs, true, skip);
+    emit_cond_jump(cond->rhs, false, label);
+    asm_label(skip);
+  } else {
+    emit_node(cond);
+    emit("cmp %s, 0", reg(top(0), size_of(type_of(cond))));
+    pop_value();
+    if (jump_if) {
+      emit("jne %s", label);
+    } else {
+      emit("je %s", label);
+    }
+  }
+}
+
+// 比較の結果を0か1の値にする
+static void emit_set(Node* node) {
+  emit_compare(node);
+  Reg r = push_value();
+  emit("set%s %s", jump_cond(node->tag, false), reg8[r]);
+  emit("movzx %s, %s", reg64[r], reg8[r]);
+}
+
+// 並べたcasesのlo番目からhi番目の手前までの中から、raxの値に一致するcaseへ飛ぶ。
+// どれにも一致しなければdefault_labelへ。sizeは4か8で、1バイトの値は符号拡張しておく
+static void emit_switch(size_t size, Vector* cases, size_t lo, size_t hi, char* default_label) {
+  enum SwitchLowering how = switch_lowering(cases, lo, hi);
+
+  if (how == SW_TABLE) {
+    // 番号はrdiに作り、符号なしで比べて範囲外を除く
+    Node* first = cases->ptr[lo];
+    Node* last = cases->ptr[hi - 1];
+    int span = last->integer - first->integer;
+    char* table = new_label("table");
+    emit("mov %s, %s", reg(DI, size), reg(AX, size));
+    if (first->integer != 0) {
+      emit("sub %s, %d", reg(DI, size), first->integer);
+    }
+    emit("cmp %s, %d", reg(DI, size), span);
+    emit("ja %s", default_label);
+    emit("shl rdi, 3");
+    emit("lea rax, %s", table);
+    emit("add rax, rdi");
+    emit("mov rax, [rax]");
+    emit("jmp rax");
+
+    asm_puts(".section .rodata\n");
+    asm_puts(".align 8\n");
+    asm_label(table);
+    size_t i = lo;
+    for (int k = 0; k <= span; k++) {
+      Node* clause = cases->ptr[i];
+      if (clause->integer == first->integer + k) {
+        emit(".quad %s", clause->name);
+        i++;
+      } else {
+        emit(".quad %s", default_label);
+      }
+    }
+    asm_puts(".text\n");
+    return;
+  }
+
+  if (how == SW_SPLIT) {
+    size_t mid = (lo + hi) / 2;
+    Node* pivot = cases->ptr[mid];
+    char* upper = new_label("upper");
+    emit("cmp %s, %d", reg(AX, size), pivot->integer);
+    emit("jge %s", upper);
+    emit_switch(size, cases, lo, mid, default_label);
+    asm_label(upper);
+    emit_switch(size, cases, mid, hi, default_label);
+    return;
+  }
+
+  for (size_t i = lo; i < hi; i++) {
+    Node* clause = cases->ptr[i];
+    emit("cmp %s, %d", reg(AX, size), clause->integer);
+    emit("je %s", clause->name);
+  }
+  emit("jmp %s", default_label);
 }
 
 static void emit_node(Node* node) {
@@ -162,22 +655,24 @@ static void emit_node(Node* node) {
   switch (node->tag) {
   case NINT:
     comment("start NINT");
-    pushi(node->integer);
+    emit("mov %s, %d", reg64[push_value()], node->integer);
     comment("end NINT");
     break;
   case NVAR: {
     comment("start NVAR");
-    emit_lval(node);
-
-    if (node->type->array_size == 0) {
-      pop(AX);
-      load(AX, size_of(type_of(node)));
-      push(AX);
+    size_t size = size_of(type_of(node));
+    int r = find_reg_var(node);
+    if (r >= 0 && size == 1) {
+      emit("movsx %s, %s", reg(push_value(), 4), var_reg8[r]);
+    } else if (r >= 0) {
+      emit("mov %s, %s", reg(push_value(), size), var_reg(r, size));
+    } else if (node->type->array_size == 0) {
+      load(push_value(), "rbp", var_offset(node), size);
     } else {
       // nodeが配列型の変数の場合、lvalとしてコンパイルする（配列の先頭へのポインタになる）
       comment("emit array var");
+      emit_lval(node);
     }
-
     comment("end NVAR");
     break;
   }
@@ -186,9 +681,7 @@ static void emit_node(Node* node) {
     emit_lval(node);
 
     if (node->type->array_size == 0) {
-      pop(AX);
-      load(AX, size_of(type_of(node)));
-      push(AX);
+      load(top(0), reg64[top(0)], 0, size_of(type_of(node)));
     } else {
       // nodeが配列型の変数の場合、lvalとしてコンパイルする（配列の先頭へのポインタになる）
       comment("emit array var");
@@ -199,25 +692,13 @@ static void emit_node(Node* node) {
   }
   case NADD: {
     comment("start NADD");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    size_t size = size_of(type_of(node));
-    emit("add %s, %s", reg(AX, size), reg(DI, size));
-    push(AX);
+    emit_binop("add", node, size_of(type_of(node)));
     comment("end NADD");
     break;
   }
   case NSUB: {
     comment("start NSUB");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    size_t size = size_of(type_of(node));
-    emit("sub %s, %s", reg(AX, size), reg(DI, size));
-    push(AX);
+    emit_binop("sub", node, size_of(type_of(node)));
     comment("end NSUB");
     break;
   }
@@ -225,235 +706,93 @@ static void emit_node(Node* node) {
     comment("start NMUL");
     emit_node(node->lhs);
     emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
     size_t size = size_of(type_of(node->lhs));
-    emit("imul %s", reg(DI, size));
-    push(AX);
+    if (size == 1) {
+      size = 4;
+    }
+    emit("imul %s, %s", reg(top(1), size), reg(top(0), size));
+    pop_value();
     comment("end NMUL");
     break;
   }
   case NDIV: {
     comment("start NDIV");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    emit("mov %s, %d", reg64[DX], 0);
-    size_t size = size_of(type_of(node->lhs));
-    emit("div %s", reg(DI, size));
-    push(AX);
+    emit_div(node, false);
     comment("end NDIV");
     break;
   }
   case NMOD: {
     comment("start NMOD");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    emit("mov %s, %d", reg64[DX], 0);
-    size_t size = size_of(type_of(node->lhs));
-    emit("div %s", reg(DI, size));
-    push(DX);
+    emit_div(node, true);
     comment("end NMOD");
     break;
   }
-  case NLT: {
-    comment("start NLT");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    size_t size = size_of(type_of(node->lhs));
-    emit("cmp %s, %s", reg(AX, size), reg(DI, size));
-    emit("setl al");
-    emit("movzx rax, al");
-    push(AX);
-    comment("end NLT");
-    break;
-  }
-  case NLE: {
-    comment("start NLE");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    size_t size = size_of(type_of(node->lhs));
-    emit("cmp %s, %s", reg(AX, size), reg(DI, size));
-    emit("setle al");
-    emit("movzx rax, al");
-    push(AX);
-    comment("end NLE");
-    break;
-  }
-  case NGT: {
-    comment("start NGT");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    size_t size = size_of(type_of(node->lhs));
-    emit("cmp %s, %s", reg(AX, size), reg(DI, size));
-    emit("setg al");
-    emit("movzx rax, al");
-    push(AX);
-    comment("end NGT");
-    break;
-  }
-  case NGE: {
-    comment("start NGE");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    size_t size = size_of(type_of(node->lhs));
-    emit("cmp %s, %s", reg(AX, size), reg(DI, size));
-    emit("setge al");
-    emit("movzx rax, al");
-    push(AX);
-    comment("end NGE");
-    break;
-  }
-  case NEQ: {
-    comment("start NEQ");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    size_t size = size_of(type_of(node->lhs));
-    emit("cmp %s, %s", reg(AX, size), reg(DI, size));
-    emit("sete al");
-    emit("movzx rax, al");
-    push(AX);
-    comment("end NEQ");
-    break;
-  }
+  case NLT:
+  case NLE:
+  case NGT:
+  case NGE:
+  case NEQ:
   case NNE: {
-    comment("start NNE");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    size_t size = size_of(type_of(node->lhs));
-    emit("cmp %s, %s", reg(AX, size), reg(DI, size));
-    emit("setne al");
-    emit("movzx rax, al");
-    push(AX);
-    comment("end NNE");
+    comment("start comparison");
+    emit_set(node);
+    comment("end comparison");
     break;
   }
   case NLOGNOT: {
     comment("start NLOGNOT");
     emit_node(node->expr);
-    pop(AX);
-    emit("cmp %s, 0", reg(AX, 4));
-    emit("sete al");
-    emit("movzx rax, al");
-    push(AX);
+    Reg r = top(0);
+    emit("cmp %s, 0", reg(r, 4));
+    emit("sete %s", reg8[r]);
+    emit("movzx %s, %s", reg64[r], reg8[r]);
     comment("end NLOGNOT");
     break;
   }
   case NNOT: {
     comment("start NNOT");
     emit_node(node->expr);
-    pop(AX);
-    emit("not rax");
-    push(AX);
+    emit("not %s", reg64[top(0)]);
     comment("end NNOT");
     break;
   }
   case NAND: {
     comment("start NAND");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    emit("and %s, %s", reg(AX, size_of(type_of(node))), reg(DI, size_of(type_of(node))));
-    push(AX);
+    emit_binop("and", node, size_of(type_of(node)));
     comment("end NAND");
     break;
   }
   case NOR: {
     comment("start NOR");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    emit("or %s, %s", reg(AX, size_of(type_of(node))), reg(DI, size_of(type_of(node))));
-    push(AX);
+    emit_binop("or", node, size_of(type_of(node)));
     comment("end NOR");
     break;
   }
   case NXOR: {
     comment("start NXOR");
-    emit_node(node->lhs);
-    emit_node(node->rhs);
-    pop(DI);
-    pop(AX);
-    emit("xor %s, %s", reg(AX, size_of(type_of(node))), reg(DI, size_of(type_of(node))));
-    push(AX);
+    emit_binop("xor", node, size_of(type_of(node)));
     comment("end NXOR");
     break;
   }
-  case NLOGAND: {
-    comment("start NLOGAND");
-    char* when_false = new_label("when_false");
-    char* when_true = new_label("when_true");
-
-    emit_node(node->lhs);
-    pop(AX);
-    emit("cmp %s, 0", reg(AX, size_of(type_of(node->lhs))));
-    emit("je %s", when_false);
-
-    emit_node(node->rhs);
-    pop(AX);
-    emit("cmp %s, 0", reg(AX, size_of(type_of(node->rhs))));
-    emit("je %s", when_false);
-
-    emit("mov rax, 1");
-    emit("jmp %s", when_true);
-
-    printf("%s:\n", when_false);
-    emit("mov rax, 0");
-    printf("%s:\n", when_true);
-    push(AX);
-    comment("end NLOGAND");
-    break;
-  }
+  case NLOGAND:
   case NLOGOR: {
-    comment("start NLOGAND");
+    comment("start NLOGAND/NLOGOR");
     char* when_false = new_label("when_false");
-    char* when_true = new_label("when_true");
-    char* next = new_label("next");
-
-    emit_node(node->lhs);
-    pop(AX);
-    emit("cmp %s, 0", reg(AX, size_of(type_of(node->lhs))));
-    emit("jne %s", when_true);
-
-    emit_node(node->rhs);
-    pop(AX);
-    emit("cmp %s, 0", reg(AX, size_of(type_of(node->rhs))));
-    emit("je %s", when_false);
-
-    printf("%s:\n", when_true);
-    emit("mov rax, 1");
-    push(AX);
-    emit("jmp %s", next);
-
-    printf("%s:\n", when_false);
-    emit("mov rax, 0");
-    push(AX);
+    char* end = new_label("end");
 
-    printf("%s:\n", next);
-    comment("end NLOGAND");
+    // 結果の場所を先に取っておき、どちらの道でも同じレジスタに値を入れる
+    Reg r = push_value();
+    emit_cond_jump(node, false, when_false);
+    emit("mov %s, 1", reg64[r]);
+    emit("jmp %s", end);
+    asm_label(when_false);
+    emit("mov %s, 0", reg64[r]);
+    asm_label(end);
+    comment("end NLOGAND/NLOGOR");
     break;
   }
   case NCOMMA: {
     comment("start NCOMMA");
-    emit_node(node->lhs);
-    pop_unused_value(node->lhs);
+    emit_stmt(node->lhs);
     emit_node(node->rhs);
     comment("end NCOMMA");
     break;
@@ -478,29 +817,7 @@ static void emit_node(Node* node) {
       break;
     }
 
-    // function call
-    for (size_t i = 0; i < node->args->length; i++) {
-      emit_node(node->args->ptr[i]);
-    }
-    for (ptrdiff_t i = node->args->length - 1; i >= 0; i--) {
-      pop(argregs[i]);
-    }
-
-    // スタックをがりがりいじりながらコード生成してるので、
-    // rspのアライメントをうまいこと扱う必要がある。
-    align_rsp();
-
-    push(R10);
-    push(R11);
-    emit("mov %s, %d", reg64[AX], 0);
-
-    emit("call %s", node->name);
-    pop(R11);
-    pop(R10);
-
-    revert_rsp();
-
-    push(AX);
+    emit_call(node);
     comment("end NCALL");
     break;
   }
@@ -513,100 +830,93 @@ static void emit_node(Node* node) {
   case NDEREF: {
     comment("start NDEREF");
     emit_node(node->expr);
-    pop(AX);
-    load(AX, size_of(node->expr->type->ptr_to));
-    push(AX);
+    load(top(0), reg64[top(0)], 0, size_of(node->expr->type->ptr_to));
     comment("end NDEREF");
     break;
   }
   case NMEMBER: {
     comment("start NMEMBER");
-    emit_lval(node);
-    pop(AX);
-    load(AX, size_of(node->type));
-    push(AX);
+    emit_lval(node->expr);
+    size_t offset = field_offset(type_of(node->expr)->fields, node->name);
+    load(top(0), reg64[top(0)], offset, size_of(node->type));
     comment("end NMEMBER");
     break;
   }
   case NEXPR_STMT:
     comment("start NEXPR_STMT");
     emit_node(node->expr);
-    if (node->expr->type != NULL || node->expr->type->ty != TY_VOID) {
-      pop(AX);
-    }
+    pop_value();
     comment("end NEXPR_STMT");
     break;
   case NRETURN:
     comment("start NRETURN");
     if (node->expr) {
       emit_node(node->expr);
-      pop(AX);
+      mov(AX, top(0));
+      pop_value();
     }
     emit("jmp %s", func_end_label);
     comment("end NRETURN");
     break;
   case NIF: {
     comment("start NIF");
-    emit_node(node->cond);
-    pop(AX);
-    emit("cmp %s, %d", reg64[AX], 0);
     char* l = new_label("end");
-    emit("je %s", l);
-    emit_node(node->then);
-    printf("%s:\n", l);
+    emit_cond_jump(node->cond, false, l);
+    emit_stmt(node->then);
+    asm_label(l);
     comment("end NIF");
     break;
   }
   case NIFELSE: {
     comment("start NIFELSE");
-    emit_node(node->cond);
-    pop(AX);
-    emit("cmp %s, %d", reg64[AX], 0);
     char* els = new_label("else");
-    emit("je %s", els);
-    emit_node(node->then);
+    emit_cond_jump(node->cond, false, els);
+    emit_stmt(node->then);
     char* end = new_label("end");
     emit("jmp %s", end);
-    printf("%s:\n", els);
-    emit_node(node->els);
-    printf("%s:\n", end);
+    asm_label(els);
+    emit_stmt(node->els);
+    asm_label(end);
     comment("end NIFELSE");
     break;
   }
   case NWHILE: {
+    // 条件を本体の後ろに置き、1回まわるごとの分岐を条件の1つだけにする
     comment("start NWHILE");
-    char* begin = new_label("begin");
+    char* body = new_label("body");
+    char* cond = new_label("cond");
     char* end = new_label("end");
     char* prev_break = break_label;
     break_label = end;
-    printf("%s:\n", begin);
-    emit_node(node->cond);
-    pop(AX);
-    emit("cmp %s, %d", reg64[AX], 0);
-    emit("je %s", end);
-    emit_node(node->body);
-    emit("jmp %s", begin);
-    printf("%s:\n", end);
+    emit("jmp %s", cond);
+    asm_label(body);
+    emit_stmt(node->body);
+    asm_label(cond);
+    emit_cond_jump(node->cond, true, body);
+    asm_label(end);
     break_label = prev_break;
     comment("end NWHILE");
     break;
   }
   case NFOR: {
     comment("start NFOR");
-    char* begin = new_label("begin");
+    char* body = new_label("body");
+    char* cond = new_label("cond");
     char* end = new_label("end");
     char* prev_break = break_label;
     break_label = end;
-    emit_node(node->init);
-    printf("%s:\n", begin);
-    emit_node(node->cond);
-    pop(AX);
-    emit("cmp %s, %d", reg64[AX], 0);
-    emit("je %s", end);
-    emit_node(node->body);
-    emit_node(node->step);
-    emit("jmp %s", begin);
-    printf("%s:\n", end);
+    emit_stmt(node->init);
+    emit("jmp %s", cond);
+    asm_label(body);
+    emit_stmt(node->body);
+    emit_stmt(node->step);
+    asm_label(cond);
+    if (node->cond) {
+      emit_cond_jump(node->cond, true, body);
+    } else {
+      emit("jmp %s", body);
+    }
+    asm_label(end);
     break_label = prev_break;
     comment("end NFOR");
     break;
@@ -614,14 +924,14 @@ static void emit_node(Node* node) {
   case NBLOCK: {
     comment("start NBLOCK");
     for (size_t i = 0; i < node->stmts->length; i++) {
-      emit_node(node->stmts->ptr[i]);
+      emit_stmt(node->stmts->ptr[i]);
     }
     comment("end NBLOCK");
     break;
   }
   case NSIZEOF: {
     comment("start NSIZEOF");
-    pushi(size_of(type_of(node->expr)));
+    emit("mov %s, %zu", reg64[push_value()], size_of(type_of(node->expr)));
     comment("end NSIZEOF");
     break;
   }
@@ -629,47 +939,44 @@ static void emit_node(Node* node) {
     comment("start NSWITCH");
     emit_node(node->expr);
 
-    Node* clause;
-    for (int i = 0; i < node->cases->length; i++) {
-      clause = node->cases->ptr[i];
+    char* prev_break = break_label;
+    break_label = new_label("break");
 
-      if (clause->tag == NDEFAULT) {
-        emit("jmp %s", clause->name);
-      } else {
-       emit_node(clause->expr); // TODO: emit_const
-       pop(DI);
-       pop(AX);
-       push(AX);
-       size_t size = size_of(type_of(node->expr));
-       emit("cmp %s, %s", reg(AX, size), reg(DI, size));
-       emit("je %s", clause->name);
-      }
+    // どのcaseにも一致しなければdefaultへ、defaultがなければ抜ける
+    char* default_label = break_label;
+    size_t n = num_case_values(node);
+    if (n < node->cases->length) {
+      Node* default_clause = vec_last(node->cases);
+      default_label = default_clause->name;
     }
-    pop(AX); // pop node->expr
 
-    char* prev_break = break_label;
-    break_label = new_label("break");
+    mov(AX, top(0));
+    pop_value();
+    size_t size = size_of(type_of(node->expr));
+    if (size == 1) {
+      emit("movsx eax, al");
+      size = 4;
+    }
+    emit_switch(size, node->cases, 0, n, default_label);
 
-    emit_node(node->body);
+    emit_stmt(node->body);
 
-    printf("%s:\n", break_label);
+    asm_label(break_label);
     break_label = prev_break;
     comment("end NSWITCH");
     break;
   }
   case NCASE: {
     comment("start NCASE");
-    printf("%s:\n", node->name);
-    emit_node(node->body);
-    pop_unused_value(node->body);
+    asm_label(node->name);
+    emit_stmt(node->body);
     comment("end NCASE");
     break;
   }
   case NDEFAULT: {
     comment("start NDEFAULT");
-    printf("%s:\n", node->name);
-    emit_node(node->body);
-    pop_unused_value(node->body);
+    asm_label(node->name);
+    emit_stmt(node->body);
     comment("end NDEFAULT");
     break;
   }
@@ -719,13 +1026,15 @@ static void emit_function(Function* func) {
     return;
   }
 
+  func_name = func->name;
+  label_id = 0;
   func_end_label = new_label("end");
 
   if (!func->is_static) {
-    printf(".global %s\n", func->name);
+    asm_printf(".global %s\n", func->name);
   }
 
-  printf("%s:\n", func->name);
+  asm_label(func->name);
   emit("push rbp");
   emit("mov rbp, rsp");
 
@@ -737,15 +1046,31 @@ static void emit_function(Function* func) {
 
   emit("sub rsp, %lu", func->local_size);
 
+  assign_var_regs(func);
+  for (int i = 0; i < num_reg_vars; i++) {
+    emit("push %s", var_reg64[i]);
+  }
+
   for (size_t i = 0; i < func->params->length; i++) {
     Node* param = func->params->ptr[i];
-    emit_var(param);
-    store(argregs[i], size_of(param->type));
+    size_t size = size_of(param->type);
+    int r = find_reg_var(param);
+    if (r >= 0) {
+      emit("mov %s, %s", var_reg(r, size), reg(argregs[i], size));
+    } else {
+      store("rbp", var_offset(param), argregs[i], size);
+    }
   }
 
+  depth = 0;
   emit_node(func->body);
+  assert(depth == 0);
 
-  printf("%s:\n", func_end_label);
+  asm_label(func_end_label);
+  // 退避した値はrbpからの位置で読み、leaveでrspを戻す
+  for (int i = 0; i < num_reg_vars; i++) {
+    emit("mov %s, %d[rbp]", var_reg64[i], saved_reg_offset(func, i));
+  }
   emit("leave");
   emit("ret");
 
@@ -771,12 +1096,17 @@ static void emit_const(Type* type, Node* node) {
     break;
   }
   case NGVAR: {
-    if (size_of(type) == 1) {
-      emit(".byte %s", node->name);
-    } else if (size_of(type) == 4) {
-      emit(".int %s", node->name);
+    // foldでintegerにアドレスからのオフセットが入っている
+    char* addr = node->name;
+    if (node->integer > 0) {
+      addr = format("%s+%d", node->name, node->integer);
+    } else if (node->integer < 0) {
+      addr = format("%s%d", node->name, node->integer);
+    }
+    if (size_of(type) == 4) {
+      emit(".int %s", addr);
     } else if (size_of(type) == 8) {
-      emit(".quad %s", node->name);
+      emit(".quad %s", addr);
     } else {
       bad_token(node->token, "emit error: emit_const(invalid size)");
     }
@@ -787,31 +1117,60 @@ static void emit_const(Type* type, Node* node) {
   }
 }
 
-void emit_x86(Program* prog) {
-  puts(".intel_syntax noprefix");
+void emit_set_var_regs(bool enabled) {
+  use_var_regs = enabled;
+}
+
+void emit_x86_func(Function* func) {
+  emit_function(func);
+}
+
+// 関数より前に出力する部分
+void emit_x86_globals(GVar* globals) {
+  asm_puts(".intel_syntax noprefix\n");
 
-  puts(".data");
-  for (GVar* gvar = prog->globals; gvar != NULL; gvar = gvar->next) {
+  asm_puts(".data\n");
+  for (GVar* gvar = globals; gvar != NULL; gvar = gvar->next) {
     if (gvar->init != NULL && !gvar->is_extern) {
-      printf("%s:\n", gvar->name);
+      asm_label(gvar->name);
       emit_const(gvar->type, gvar->init);
-    } else if (gvar->inits != NULL && !gvar->is_extern) {
-      printf("%s:\n", gvar->name);
+    } else if (gvar->inits != NULL && !gvar->is_extern && !gvar->is_string) {
+      asm_label(gvar->name);
+      for (size_t i = 0; i < gvar->inits->length; i++) {
+        emit_const(gvar->type->ptr_to, gvar->inits->ptr[i]);
+      }
+      // 初期化子が足りない要素は0にする
+      size_t rest = size_of(gvar->type) - gvar->inits->length * size_of(gvar->type->ptr_to);
+      if (rest > 0) {
+        emit(".zero %zu", rest);
+      }
+    }
+  }
+
+  // 文字列リテラルは書き換えないので.rodataに置く
+  asm_puts(".section .rodata\n");
+  for (GVar* gvar = globals; gvar != NULL; gvar = gvar->next) {
+    if (gvar->is_string) {
+      asm_label(gvar->name);
       for (size_t i = 0; i < gvar->inits->length; i++) {
         emit_const(gvar->type->ptr_to, gvar->inits->ptr[i]);
       }
     }
   }
 
-  puts(".bss");
-  for (GVar* gvar = prog->globals; gvar != NULL; gvar = gvar->next) {
+  asm_puts(".bss\n");
+  for (GVar* gvar = globals; gvar != NULL; gvar = gvar->next) {
     if (gvar->init == NULL && gvar->inits == NULL && !gvar->is_extern) {
-      printf("%s:\n", gvar->name);
+      asm_label(gvar->name);
       emit(".zero %zu", size_of(gvar->type));
     }
   }
 
-  puts(".text");
+  asm_puts(".text\n");
+}
+
+void emit_x86(Program* prog) {
+  emit_x86_globals(prog->globals);
   for (size_t i = 0; i < prog->funcs->length; i++) {
     emit_function(prog->funcs->ptr[i]);
   }
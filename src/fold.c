@@ -0,0 +1,359 @@
+#include "hoc.h"
+
+// semaの後、バックエンドの前に式を畳み込む。
+// 定数どうしの演算をNINTにし、x*1やx+0のような何もしない演算を取り除き、sizeof(expr)を計算する。
+// ポインタの足し算につくsizeofの掛け算や、-xを表す0-xの多くはここで消える。
+// 大域変数の初期化式はさらに整数か「大域変数のアドレス+定数」まで計算し、実行時の初期化をなくす
+
+static Node* fold_node(Node* node);
+
+static Node* new_int(Node* node, int val) {
+  Node* new = new_node(NINT, node->token);
+  new->integer = val;
+  new->type = node->type;
+  return new;
+}
+
+static bool is_int(Node* node, int val) {
+  return node->tag == NINT && node->integer == val;
+}
+
+static void fold_vec(Vector* v) {
+  if (!v) {
+    return;
+  }
+  for (size_t i = 0; i < v->length; i++) {
+    v->ptr[i] = fold_node(v->ptr[i]);
+  }
+}
+
+#define FOLD_INT_MAX 2147483647
+
+static bool add_overflows(int a, int b) {
+  if (a > 0 && b > FOLD_INT_MAX - a) {
+    return true;
+  }
+  if (a < 0 && b < 0 - FOLD_INT_MAX - 1 - a) {
+    return true;
+  }
+  return false;
+}
+
+static bool mul_overflows(int a, int b) {
+  if (a == 0 || b == 0) {
+    return false;
+  }
+  if (a < 0 - FOLD_INT_MAX || b < 0 - FOLD_INT_MAX) {
+    return true;
+  }
+  if (a < 0) {
+    a = 0 - a;
+  }
+  if (b < 0) {
+    b = 0 - b;
+  }
+  return a > FOLD_INT_MAX / b;
+}
+
+// 結果がintに収まらない演算。longやポインタの値は8バイトで計算されるが、NINTはintしか持てない
+static bool overflows(Node* node, int a, int b) {
+  switch (node->tag) {
+  case NADD:
+    return add_overflows(a, b);
+  case NSUB:
+    if (b < 0 - FOLD_INT_MAX) {
+      return a >= 0;
+    }
+    return add_overflows(a, 0 - b);
+  case NMUL:
+    return mul_overflows(a, b);
+  default:
+    return false;
+  }
+}
+
+// 両辺がNINTの二項演算を計算する。計算できなければNULL
+static Node* fold_binop(Node* node) {
+  int a = node->lhs->integer;
+  int b = node->rhs->integer;
+  // intの演算は32bitで折り返すので、そのまま計算してよい
+  if (size_of(node->type) > 4 && overflows(node, a, b)) {
+    return NULL;
+  }
+  switch (node->tag) {
+  case NADD: return new_int(node, a + b);
+  case NSUB: return new_int(node, a - b);
+  case NMUL: return new_int(node, a * b);
+  case NDIV:
+  case NMOD:
+    // バックエンドの除算は符号なしなので、符号で結果が変わらないときだけ計算する
+    if (a < 0 || b <= 0) {
+      return NULL;
+    }
+    if (node->tag == NDIV) {
+      return new_int(node, a / b);
+    }
+    return new_int(node, a % b);
+  case NLT: return new_int(node, a < b);
+  case NLE: return new_int(node, a <= b);
+  case NGT: return new_int(node, a > b);
+  case NGE: return new_int(node, a >= b);
+  case NEQ: return new_int(node, a == b);
+  case NNE: return new_int(node, a != b);
+  case NAND: return new_int(node, a & b);
+  case NOR: return new_int(node, a | b);
+  case NXOR: return new_int(node, a ^ b);
+  case NLOGAND: return new_int(node, a && b);
+  case NLOGOR: return new_int(node, a || b);
+  default: return NULL;
+  }
+}
+
+// 演算を取り除いてもよい残りの式。char+0はintに拡張されるので、大きさが変わるときは残す
+static Node* keep_operand(Node* node, Node* operand) {
+  if (size_of(type_of(operand)) != size_of(node->type)) {
+    return NULL;
+  }
+  return operand;
+}
+
+// 片方が定数で、結果がもう片方の値そのままになる演算。そうでなければNULL
+static Node* fold_identity(Node* node) {
+  Node* lhs = node->lhs;
+  Node* rhs = node->rhs;
+  switch (node->tag) {
+  case NADD:
+  case NOR:
+  case NXOR:
+    if (is_int(lhs, 0)) {
+      return keep_operand(node, rhs);
+    }
+    if (is_int(rhs, 0)) {
+      return keep_operand(node, lhs);
+    }
+    return NULL;
+  case NSUB:
+    if (is_int(rhs, 0)) {
+      return keep_operand(node, lhs);
+    }
+    return NULL;
+  case NMUL:
+    if (is_int(lhs, 1)) {
+      return keep_operand(node, rhs);
+    }
+    if (is_int(rhs, 1)) {
+      return keep_operand(node, lhs);
+    }
+    return NULL;
+  case NDIV:
+    if (is_int(rhs, 1)) {
+      return keep_operand(node, lhs);
+    }
+    return NULL;
+  case NAND:
+    if (is_int(lhs, -1)) {
+      return keep_operand(node, rhs);
+    }
+    if (is_int(rhs, -1)) {
+      return keep_operand(node, lhs);
+    }
+    return NULL;
+  case NLOGAND:
+    // 右辺は評価されないので捨ててよい
+    if (is_int(lhs, 0)) {
+      return new_int(node, 0);
+    }
+    return NULL;
+  case NLOGOR:
+    if (lhs->tag == NINT && lhs->integer != 0) {
+      return new_int(node, 1);
+    }
+    return NULL;
+  default:
+    return NULL;
+  }
+}
+
+static Node* fold_node(Node* node) {
+  if (!node) {
+    return NULL;
+  }
+  if (node->tag == NSIZEOF) {
+    // 中身を畳み込むと型が変わることがあるので先に計算する
+    return new_int(node, size_of(type_of(node->expr)));
+  }
+
+  node->lhs = fold_node(node->lhs);
+  node->rhs = fold_node(node->rhs);
+  node->expr = fold_node(node->expr);
+  node->cond = fold_node(node->cond);
+  node->then = fold_node(node->then);
+  node->els = fold_node(node->els);
+  node->init = fold_node(node->init);
+  node->step = fold_node(node->step);
+  node->body = fold_node(node->body);
+  fold_vec(node->stmts);
+  fold_vec(node->args);
+
+  switch (node->tag) {
+  case NADD: case NSUB: case NMUL: case NDIV: case NMOD:
+  case NLT: case NLE: case NGT: case NGE: case NEQ: case NNE:
+  case NAND: case NOR: case NXOR: case NLOGAND: case NLOGOR: {
+    Node* folded = NULL;
+    if (node->lhs->tag == NINT && node->rhs->tag == NINT) {
+      folded = fold_binop(node);
+    }
+    if (!folded) {
+      folded = fold_identity(node);
+    }
+    if (folded) {
+      return folded;
+    }
+    return node;
+  }
+  case NNOT: {
+    if (node->expr->tag == NINT) {
+      return new_int(node, ~node->expr->integer);
+    }
+    return node;
+  }
+  case NLOGNOT: {
+    if (node->expr->tag == NINT) {
+      return new_int(node, !node->expr->integer);
+    }
+    return node;
+  }
+  case NCAST: {
+    // charへのキャストは下位8bitを符号拡張した値になる。intとlongへのキャストはintの値を変えない
+    if (node->expr->tag == NINT) {
+      int val = node->expr->integer;
+      if (size_of(node->type) == 1) {
+        val = val & 255;
+        if (val >= 128) {
+          val = val - 256;
+        }
+      }
+      return new_int(node, val);
+    }
+    return node;
+  }
+  default:
+    return node;
+  }
+}
+
+/* 大域変数の初期化式 */
+
+static Node* eval_const(Node* node);
+
+static void not_constant(Node* node) {
+  bad_token(node->token, "initializer element is not constant");
+}
+
+// nameのアドレスにoffsetを足した値。NGVARのintegerにオフセットを入れて表す
+static Node* new_address(Node* node, char* name, int offset) {
+  Node* new = new_node(NGVAR, node->token);
+  new->name = name;
+  new->integer = offset;
+  new->type = node->type;
+  return new;
+}
+
+static Node* eval_address(Node* node) {
+  switch (node->tag) {
+  case NGVAR:
+    return new_address(node, node->name, 0);
+  case NDEREF: {
+    Node* addr = eval_const(node->expr);
+    if (addr->tag != NGVAR) {
+      not_constant(node);
+    }
+    return addr;
+  }
+  case NMEMBER: {
+    Node* base = eval_address(node->expr);
+    return new_address(node, base->name, base->integer + field_offset(type_of(node->expr)->fields, node->name));
+  }
+  default:
+    not_constant(node);
+  }
+  return NULL;
+}
+
+// 畳み込んだ初期化式を、NINTか大域変数のアドレスにオフセットを足したものにする
+static Node* eval_const(Node* node) {
+  switch (node->tag) {
+  case NINT:
+    return node;
+  case NGVAR:
+    // 配列と文字列リテラルは先頭のアドレスになる
+    if (type_of(node)->array_size > 0) {
+      return new_address(node, node->name, 0);
+    }
+    break;
+  case NADDR:
+    return eval_address(node->expr);
+  case NCAST:
+    return eval_const(node->expr);
+  case NMUL:
+  case NADD:
+  case NSUB: {
+    Node* lhs = eval_const(node->lhs);
+    Node* rhs = eval_const(node->rhs);
+    // 畳み込まれずに残った定数どうしの演算は、longの値がintに収まらなかったもの。
+    // 初期値はintで持つので、切り捨てずにエラーにする
+    if (lhs->tag == NINT && rhs->tag == NINT) {
+      bad_token(node->token, "initializer does not fit in int");
+    }
+    if (node->tag == NMUL) {
+      break;
+    }
+    if (overflows(node, lhs->integer, rhs->integer)) {
+      bad_token(node->token, "initializer does not fit in int");
+    }
+    if (lhs->tag == NGVAR && rhs->tag == NINT) {
+      if (node->tag == NSUB) {
+        return new_address(node, lhs->name, lhs->integer - rhs->integer);
+      }
+      return new_address(node, lhs->name, lhs->integer + rhs->integer);
+    }
+    if (node->tag == NADD && lhs->tag == NINT && rhs->tag == NGVAR) {
+      return new_address(node, rhs->name, rhs->integer + lhs->integer);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+  not_constant(node);
+  return NULL;
+}
+
+static void fold_gvar(GVar* gvar) {
+  if (gvar->init) {
+    gvar->init = eval_const(fold_node(gvar->init));
+  }
+  if (gvar->inits) {
+    fold_vec(gvar->inits);
+    for (size_t i = 0; i < gvar->inits->length; i++) {
+      gvar->inits->ptr[i] = eval_const(gvar->inits->ptr[i]);
+    }
+    if (gvar->inits->length > gvar->type->array_size) {
+      Node* extra = gvar->inits->ptr[gvar->type->array_size];
+      bad_token(extra->token, "too many initializers");
+    }
+  }
+}
+
+void fold(Program* prog) {
+  for (GVar* gvar = prog->globals; gvar != NULL; gvar = gvar->next) {
+    if (!gvar->is_extern) {
+      fold_gvar(gvar);
+    }
+  }
+
+  for (size_t i = 0; i < prog->funcs->length; i++) {
+    Function* fn = prog->funcs->ptr[i];
+    fn->body = fold_node(fn->body);
+  }
+}
@@ -6,11 +6,13 @@
 //   IReg* reg;
 // } VarEnv;
 
-static int label_id;
+// ブロックと仮想レジスタの番号は関数ごとに振り直す。
+// 関数を並列に生成しても、逐次の場合と同じ出力になる
 static int reg_id;
+static IFunc* current_func;
 static Block* current_block;
-static char* break_label;
-static Vector* blocks;
+static Block* break_block;
+static Map* case_blocks; // Map(char*, Block*) case、defaultのラベル -> ブロック
 // static VarEnv* var_env;
 
 // static void assign_var(char* name, IReg* reg) {
@@ -30,43 +32,34 @@ static Vector* blocks;
 //   return NULL;
 // }
 
-static char* new_label(char* name) {
-  char* label = format(".L%s%d", name, label_id);
-  label_id++;
-  return label;
-}
-
 static IReg* new_reg(size_t size) {
-  IReg* new = calloc(1, sizeof(IReg));
+  IReg* new = arena_alloc(ARENA_IR, sizeof(IReg));
   new->id = reg_id++;
   new->size = size;
   return new;
 }
 
-static Block* new_block(char* label) {
-  Block* new = calloc(1, sizeof(Block));
-  new->label = label;
-  new->instrs = new_vec();
-  return new;
-}
+static IR* jmp(Block* jump_to);
+static void emit_ir(IR* ir);
 
-static void in_new_block(char* label) {
-  Block* block = new_block(label);
-  vec_push(blocks, block);
+// 今のブロックが終端命令で終わっていなければ、次のブロックへのジャンプを足してから移る
+static void in_new_block(Block* block) {
+  if (current_block && !terminator(current_block)) {
+    emit_ir(jmp(block));
+  }
+  append_block(current_func, block);
   current_block = block;
 }
 
 static IR* imm(IReg* reg, int val) {
-  IR* new = calloc(1, sizeof(IR));
-  new->op = IIMM;
+  IR* new = new_ir(IIMM);
   new->r0 = reg;
   new->imm_int = val;
   return new;
 }
 
 static IR* label(IReg* reg, char* name) {
-  IR* new = calloc(1, sizeof(IR));
-  new->op = ILABEL;
+  IR* new = new_ir(ILABEL);
   new->r0 = reg;
   new->label = name;
   return new;
@@ -117,15 +110,24 @@ static IR* move(IReg* dst, IReg* src) {
   return new;
 }
 
-static IR* branch(IReg* cond, char* then_label, char* else_label) {
+static IR* branch(IReg* cond, Block* then, Block* els) {
   IR* new = new_ir(IBR);
   new->r1 = cond;
-  new->then = then_label;
-  new->els = else_label;
+  new->cond = INE;
+  new->then = then;
+  new->els = els;
+  return new;
+}
+
+static IR* compare_branch(enum IRTag cond, IReg* lhs, IReg* rhs, size_t size, Block* then, Block* els) {
+  IR* new = branch(lhs, then, els);
+  new->cond = cond;
+  new->r2 = rhs;
+  new->size = size;
   return new;
 }
 
-static IR* jmp(char* jump_to) {
+static IR* jmp(Block* jump_to) {
   IR* new = new_ir(IJMP);
   new->jump_to = jump_to;
   return new;
@@ -144,6 +146,112 @@ static void emit_ir(IR* ir) {
 
 static IReg* emit_expr(Node* node);
 
+// 比較の結果は0か1だが、three_to_twoで左辺を結果のレジスタに移してから比べるので、
+// 結果のレジスタは大きい方のオペランドに合わせる
+static size_t compare_size(Node* node) {
+  size_t lhs = size_of(type_of(node->lhs));
+  size_t rhs = size_of(type_of(node->rhs));
+  if (lhs < rhs) {
+    return rhs;
+  }
+  return lhs;
+}
+
+// 比較のノードに対応するIRの命令。比較でなければIIMM
+static enum IRTag compare_op(Node* node) {
+  switch (node->tag) {
+  case NLT: return ILT;
+  case NLE: return ILE;
+  case NGT: return IGT;
+  case NGE: return IGE;
+  case NEQ: return IEQ;
+  case NNE: return INE;
+  default: return IIMM;
+  }
+}
+
+// condが成り立てばthen、成り立たなければelsへ分岐する。
+// 比較や論理演算は0/1の値にせず、比較つきのIBRにする
+static void emit_cond(Node* cond, Block* then, Block* els) {
+  if (compare_op(cond) != IIMM) {
+    IReg* lhs = emit_expr(cond->lhs);
+    IReg* rhs = emit_expr(cond->rhs);
+    emit_ir(compare_branch(compare_op(cond), lhs, rhs, compare_size(cond), then, els));
+  } else if (cond->tag == NLOGNOT) {
+    emit_cond(cond->expr, els, then);
+  } else if (cond->tag == NLOGAND) {
+    Block* rhs = new_block("and_rhs");
+    emit_cond(cond->lhs, rhs, els);
+    in_new_block(rhs);
+    emit_cond(cond->rhs, then, els);
+  } else if (cond->tag == NLOGOR) {
+    Block* rhs = new_block("or_rhs");
+    emit_cond(cond->lhs, then, rhs);
+    in_new_block(rhs);
+    emit_cond(cond->rhs, then, els);
+  } else {
+    emit_ir(branch(emit_expr(cond), then, els));
+  }
+}
+
+static Block* case_block(Node* clause) {
+  return map_get(case_blocks, clause->name);
+}
+
+// 並べたcasesのlo番目からhi番目の手前までの中からvalに一致するcaseへ飛ぶ。
+// どれにも一致しなければdefault_blockへ
+static void emit_switch(IReg* val, Vector* cases, size_t lo, size_t hi, Block* default_block) {
+  enum SwitchLowering how = switch_lowering(cases, lo, hi);
+
+  if (how == SW_TABLE) {
+    Node* first = cases->ptr[lo];
+    Node* last = cases->ptr[hi - 1];
+    IR* ir = new_ir(ISWITCH);
+    ir->r1 = val;
+    ir->imm_int = first->integer;
+    ir->size = val->size;
+    ir->table = new_vec();
+    ir->els = default_block;
+    size_t i = lo;
+    for (int k = 0; k <= last->integer - first->integer; k++) {
+      Node* clause = cases->ptr[i];
+      if (clause->integer == first->integer + k) {
+        vec_push(ir->table, case_block(clause));
+        i++;
+      } else {
+        vec_push(ir->table, default_block);
+      }
+    }
+    emit_ir(ir);
+    return;
+  }
+
+  if (how == SW_SPLIT) {
+    size_t mid = (lo + hi) / 2;
+    Node* pivot = cases->ptr[mid];
+    IReg* c_val = new_reg(val->size);
+    emit_ir(imm(c_val, pivot->integer));
+    Block* lower = new_block("lower");
+    Block* upper = new_block("upper");
+    emit_ir(compare_branch(ILT, val, c_val, val->size, lower, upper));
+    in_new_block(lower);
+    emit_switch(val, cases, lo, mid, default_block);
+    in_new_block(upper);
+    emit_switch(val, cases, mid, hi, default_block);
+    return;
+  }
+
+  for (size_t i = lo; i < hi; i++) {
+    Node* clause = cases->ptr[i];
+    IReg* c_val = new_reg(val->size);
+    emit_ir(imm(c_val, clause->integer));
+    Block* next = new_block("next");
+    emit_ir(compare_branch(IEQ, val, c_val, val->size, case_block(clause), next));
+    in_new_block(next);
+  }
+  emit_ir(jmp(default_block));
+}
+
 static IReg* emit_lval(Node* node) {
   switch (node->tag) {
   case NVAR: {
@@ -177,7 +285,12 @@ static IReg* emit_lval(Node* node) {
 static IReg* emit_expr(Node* node) {
   switch (node->tag) {
   case NINT: {
-    IReg* reg = new_reg(4);
+    // ポインタに足す負のオフセットは64bitに符号拡張しておく
+    size_t size = 4;
+    if (size_of(type_of(node)) == 8) {
+      size = 8;
+    }
+    IReg* reg = new_reg(size);
     emit_ir(imm(reg, node->integer));
     return reg;
   }
@@ -249,42 +362,42 @@ static IReg* emit_expr(Node* node) {
   case NLT: {
     IReg* lhs = emit_expr(node->lhs);
     IReg* rhs = emit_expr(node->rhs);
-    IReg* reg = new_reg(size_of(type_of(node)));
+    IReg* reg = new_reg(compare_size(node));
     emit_ir(new_binop_ir(ILT, reg, lhs, rhs));
     return reg;
   }
   case NLE: {
     IReg* lhs = emit_expr(node->lhs);
     IReg* rhs = emit_expr(node->rhs);
-    IReg* reg = new_reg(size_of(type_of(node)));
+    IReg* reg = new_reg(compare_size(node));
     emit_ir(new_binop_ir(ILE, reg, lhs, rhs));
     return reg;
   }
   case NGT: {
     IReg* lhs = emit_expr(node->lhs);
     IReg* rhs = emit_expr(node->rhs);
-    IReg* reg = new_reg(size_of(type_of(node)));
+    IReg* reg = new_reg(compare_size(node));
     emit_ir(new_binop_ir(IGT, reg, lhs, rhs));
     return reg;
   }
   case NGE: {
     IReg* lhs = emit_expr(node->lhs);
     IReg* rhs = emit_expr(node->rhs);
-    IReg* reg = new_reg(size_of(type_of(node)));
+    IReg* reg = new_reg(compare_size(node));
     emit_ir(new_binop_ir(IGE, reg, lhs, rhs));
     return reg;
   }
   case NEQ: {
     IReg* lhs = emit_expr(node->lhs);
     IReg* rhs = emit_expr(node->rhs);
-    IReg* reg = new_reg(size_of(type_of(node)));
+    IReg* reg = new_reg(compare_size(node));
     emit_ir(new_binop_ir(IEQ, reg, lhs, rhs));
     return reg;
   }
   case NNE: {
     IReg* lhs = emit_expr(node->lhs);
     IReg* rhs = emit_expr(node->rhs);
-    IReg* reg = new_reg(size_of(type_of(node)));
+    IReg* reg = new_reg(compare_size(node));
     emit_ir(new_binop_ir(INE, reg, lhs, rhs));
     return reg;
   }
@@ -323,55 +436,22 @@ static IReg* emit_expr(Node* node) {
     emit_ir(new_binop_ir(IXOR, reg, lhs, rhs));
     return reg;
   }
-  case NLOGAND: {
-    char* when_lhs_false = new_label("when_lhs_false");
-    char* when_lhs_true = new_label("when_lhs_true");
-    char* end = new_label("end");
-
-    IReg* lhs = emit_expr(node->lhs);
-    IReg* zero = new_reg(size_of(type_of(node->lhs)));
-    emit_ir(imm(zero, 0));
-    IReg* lhs_cond = new_reg(size_of(type_of(node->lhs)));
-    emit_ir(new_binop_ir(IEQ, lhs_cond, lhs, zero));
-    emit_ir(branch(lhs_cond, when_lhs_false, when_lhs_true));
-
-    IReg* reg = new_reg(size_of(type_of(node)));
-
-    in_new_block(when_lhs_true);
-    IReg* rhs = emit_expr(node->rhs);
-    emit_ir(move(reg, rhs));
-    emit_ir(jmp(end));
-
-    in_new_block(when_lhs_false);
-    emit_ir(imm(reg, 0));
-    emit_ir(jmp(end));
-
-    in_new_block(end);
-    return reg;
-  }
+  case NLOGAND:
   case NLOGOR: {
-    char* when_lhs_false = new_label("when_lhs_false");
-    char* when_lhs_true = new_label("when_lhs_true");
-    char* end = new_label("end");
-
-    IReg* lhs = emit_expr(node->lhs);
-    IReg* zero = new_reg(size_of(type_of(node->lhs)));
-    emit_ir(imm(zero, 0));
-    IReg* lhs_cond = new_reg(size_of(type_of(node->lhs)));
-    emit_ir(new_binop_ir(IEQ, lhs_cond, lhs, zero));
-    emit_ir(branch(lhs_cond, when_lhs_false, when_lhs_true));
-
+    Block* when_true = new_block("when_true");
+    Block* when_false = new_block("when_false");
+    Block* end = new_block("end");
     IReg* reg = new_reg(size_of(type_of(node)));
 
-    in_new_block(when_lhs_true);
-    emit_ir(move(reg, lhs));
-    emit_ir(jmp(end));
+    emit_cond(node, when_true, when_false);
 
-    in_new_block(when_lhs_false);
-    IReg* rhs = emit_expr(node->rhs);
-    emit_ir(move(reg, rhs));
+    in_new_block(when_true);
+    emit_ir(imm(reg, 1));
     emit_ir(jmp(end));
 
+    in_new_block(when_false);
+    emit_ir(imm(reg, 0));
+
     in_new_block(end);
     return reg;
   }
@@ -446,13 +526,11 @@ static void emit_stmt(Node* node) {
   case NRETURN: {
     if (node->expr) {
       IReg* val = emit_expr(node->expr);
-      IR* new = calloc(1, sizeof(IR));
-      new->op = IRET;
+      IR* new = new_ir(IRET);
       new->r1 = val;
       emit_ir(new);
     } else {
-      IR* new = calloc(1, sizeof(IR));
-      new->op = IRET;
+      IR* new = new_ir(IRET);
       emit_ir(new);
     }
     break;
@@ -467,145 +545,122 @@ static void emit_stmt(Node* node) {
     break;
   }
   case NIF: {
-    IReg* cond = emit_expr(node->cond);
-
-    char* then_label = new_label("then");
-    char* end_label = new_label("endif");
+    Block* then_block = new_block("then");
+    Block* end_block = new_block("endif");
 
-    emit_ir(branch(cond, then_label, end_label));
+    emit_cond(node->cond, then_block, end_block);
 
-    in_new_block(then_label);
+    in_new_block(then_block);
     emit_stmt(node->then);
 
-    in_new_block(end_label);
+    in_new_block(end_block);
     break;
   }
   case NIFELSE: {
-    IReg* cond = emit_expr(node->cond);
-
-    char* then_label = new_label("then");
-    char* else_label = new_label("else");
-    char* end_label = new_label("endif");
+    Block* then_block = new_block("then");
+    Block* else_block = new_block("else");
+    Block* end_block = new_block("endif");
 
-    emit_ir(branch(cond, then_label, else_label));
+    emit_cond(node->cond, then_block, else_block);
 
-    in_new_block(then_label);
+    in_new_block(then_block);
     emit_stmt(node->then);
-    emit_ir(jmp(end_label));
+    emit_ir(jmp(end_block));
 
-    in_new_block(else_label);
+    in_new_block(else_block);
     emit_stmt(node->els);
 
-    in_new_block(end_label);
+    in_new_block(end_block);
     break;
   }
   case NCOMMA: {
     // for initializer
-    warn_token(node->token, "warning(expr_stmt): NCOMMA");
     emit_expr(node->lhs);
     emit_expr(node->rhs);
     break;
   }
   case NWHILE: {
-    char* begin = new_label("begin");
-    char* end = new_label("end");
-    char* prev_break = break_label;
-    break_label = end;
-
-    in_new_block(begin);
-    IReg* cond = emit_expr(node->cond);
-    IReg* zero = new_reg(size_of(type_of(node->cond)));
-    emit_ir(imm(zero, 0));
-    IReg* cond1 = new_reg(size_of(type_of(node->cond)));
-    emit_ir(new_binop_ir(IEQ, cond1, cond, zero));
-    char* body = new_label("body");
-    emit_ir(branch(cond1, end, body));
+    // 条件を本体の後ろに置き、1回まわるごとの分岐を条件の1つだけにする
+    Block* body = new_block("body");
+    Block* cond = new_block("cond");
+    Block* end = new_block("end");
+    Block* prev_break = break_block;
+    break_block = end;
+
+    emit_ir(jmp(cond));
 
     in_new_block(body);
     emit_stmt(node->body);
-    emit_ir(jmp(begin));
+
+    in_new_block(cond);
+    emit_cond(node->cond, body, end);
 
     in_new_block(end);
-    break_label = prev_break;
+    break_block = prev_break;
     break;
   }
   case NFOR: {
-    char* begin = new_label("begin");
-    char* end = new_label("end");
-    char* prev_break = break_label;
-    break_label = end;
+    Block* body = new_block("body");
+    Block* cond = new_block("cond");
+    Block* end = new_block("end");
+    Block* prev_break = break_block;
+    break_block = end;
 
     if (node->init) {
       emit_expr(node->init);
     }
-
-    in_new_block(begin);
-
-    assert(node->cond);
-    char* body = new_label("body");
-    if (node->cond) {
-      IReg* cond = emit_expr(node->cond);
-      IReg* cond1 = new_reg(size_of(type_of(node->cond)));
-      IReg* zero = new_reg(size_of(type_of(node->cond)));
-      emit_ir(imm(zero, 0));
-      emit_ir(new_binop_ir(IEQ, cond1, cond, zero));
-
-      emit_ir(branch(cond1, end, body));
-    } else {
-      emit_ir(jmp(body));
-    }
+    emit_ir(jmp(cond));
 
     in_new_block(body);
     emit_stmt(node->body);
     if (node->step) {
       emit_expr(node->step);
     }
-    emit_ir(jmp(begin));
 
-    in_new_block(end);
-    break_label = prev_break;
+    in_new_block(cond);
+    assert(node->cond);
+    emit_cond(node->cond, body, end);
 
+    in_new_block(end);
+    break_block = prev_break;
     break;
   }
   case NSWITCH: {
     IReg* val = emit_expr(node->expr);
+    Block* prev_break = break_block;
+    break_block = new_block("break");
+    Block* default_block = break_block;
 
     for (size_t i = 0; i < node->cases->length; i++) {
       Node* clause = node->cases->ptr[i];
-
+      Block* block = new_block("case");
+      map_put(case_blocks, clause->name, block);
       if (clause->tag == NDEFAULT) {
-        emit_ir(jmp(clause->name));
-      } else {
-        IReg* c_val = emit_expr(clause->expr);
-        IReg* cond = new_reg(4);
-        emit_ir(new_binop_ir(IEQ, cond, val, c_val));
-        char* next = new_label("next");
-        emit_ir(branch(cond, clause->name, next));
-        in_new_block(next);
+        default_block = block;
       }
     }
-    char* prev_break = break_label;
-    break_label = new_label("break");
+    emit_switch(val, node->cases, 0, num_case_values(node), default_block);
+
     emit_stmt(node->body);
 
-    in_new_block(break_label);
-    break_label = prev_break;
+    in_new_block(break_block);
+    break_block = prev_break;
     
     break;
   }
   case NCASE: {
-    in_new_block(node->name);
+    in_new_block(case_block(node));
     emit_stmt(node->body);
     break;
   }
   case NDEFAULT: {
-    in_new_block(node->name);
+    in_new_block(case_block(node));
     emit_stmt(node->body);
     break;
   }
   case NBREAK: {
-    assert(break_label);
-    emit_ir(jmp(break_label));
+    assert(break_block);
+    emit_ir(jmp(break_block));
     break;
   }
   case NINT: case NVAR: case NGVAR:
@@ -619,7 +674,9 @@ static void emit_stmt(Node* node) {
 }
 
 static IFunc* emit_func(Function* func) {
-  IFunc* ifunc = calloc(1, sizeof(IFunc));
+  reg_id = 0;
+
+  IFunc* ifunc = arena_alloc(ARENA_IR, sizeof(IFunc));
   ifunc->name = func->name;
   ifunc->is_static = func->is_static;
   ifunc->has_va_arg = func->has_va_arg;
@@ -630,10 +687,11 @@ static IFunc* emit_func(Function* func) {
   }
 
   ifunc->blocks = new_vec();
-  blocks = ifunc->blocks;
+  current_func = ifunc;
+  current_block = NULL;
+  case_blocks = new_map();
 
-  ifunc->entry_label = new_label("entry");
-  in_new_block(ifunc->entry_label);
+  in_new_block(new_block("entry"));
 
   for (int i = 0; i < func->params->length; i++) {
     Node* param = func->params->ptr[i];
@@ -647,47 +705,51 @@ static IFunc* emit_func(Function* func) {
   }
 
   emit_stmt(func->body);
+  if (!terminator(current_block)) {
+    emit_ir(new_ir(IRET));
+  }
+  ifunc->num_regs = reg_id;
 
   return ifunc;
 }
 
-IFunc* is_defined_proto(Vector* funcs, char* name) {
-  for (size_t i = 0; i < funcs->length; i++) {
-    IFunc* func = funcs->ptr[i];
-    if (streq(func->name, name) && !func->blocks) {
-      return func;
-    }
-  }
-  return false;
+IFunc* gen_ir_func(Function* func) {
+  return emit_func(func);
 }
 
-IFunc* is_defined(Vector* funcs, char* name) {
-  for (size_t i = 0; i < funcs->length; i++) {
-    IFunc* func = funcs->ptr[i];
-    if (streq(func->name, name) && func->blocks) {
-      return func;
+// IRに変換する関数の並び。後から出てきた定義は先に出てきたプロトタイプ宣言の位置に置き換える。
+// gen_x86ではプロトタイプ宣言のままのものを外部関数だと解釈する
+Vector* ir_funcs(Program* program) {
+  Vector* funcs = new_vec();
+  Map* index = new_map(); // Map(char*, long) funcsでの位置+1
+
+  for (int i = 0; i < program->funcs->length; i++) {
+    Function* func = program->funcs->ptr[i];
+    long pos = (long)map_get(index, func->name);
+    Function* proto = NULL;
+    if (pos) {
+      proto = funcs->ptr[pos - 1];
+    }
+
+    if (proto && !proto->body) {
+      funcs->ptr[pos - 1] = func;
+    } else {
+      vec_push(funcs, func);
+      map_put(index, func->name, (void*)funcs->length);
     }
   }
-  return false;
+
+  return funcs;
 }
 
 IProgram* gen_ir(Program* program) {
-  IProgram* ip = calloc(1, sizeof(IProgram));
+  IProgram* ip = arena_alloc(ARENA_IR, sizeof(IProgram));
   ip->globals = program->globals;
   ip->ifuncs = new_vec();
 
-  for (int i = 0; i < program->funcs->length; i++) {
-    Function* func = program->funcs->ptr[i];
-    IFunc* ifunc = emit_func(func);
-
-    // プロトタイプ宣言を上書きする。
-    // gen_x86ですべてのプロトタイプ宣言を外部関数だと解釈する
-    IFunc* proto = is_defined_proto(ip->ifuncs, func->name);
-    if (proto) {
-      memcpy(proto, ifunc, sizeof(IFunc));
-    } else {
-      vec_push(ip->ifuncs, ifunc);
-    }
+  Vector* funcs = ir_funcs(program);
+  for (int i = 0; i < funcs->length; i++) {
+    vec_push(ip->ifuncs, emit_func(funcs->ptr[i]));
   }
 
   return ip;
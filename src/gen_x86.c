@@ -1,20 +1,57 @@
 #include "hoc.h"
 
-static char* regs[NUM_REGS] = { "r10", "r11", "rbx", "r12", "r13", "r14", "r15" };
-static char* regs32[NUM_REGS] = { "r10d", "r11d", "ebx", "r12d", "r13d", "r14d", "r15d" };
-static char* regs8[NUM_REGS] = { "r10b", "r11b", "bl", "r12b", "r13b", "r14b", "r15b" };
+// 割り当てに使うNUM_REGS個のレジスタの後ろに、スピルした仮想レジスタを読み書きするraxとrcxを置く
+#define SCRATCH0 7 // NUM_REGS
+#define SCRATCH1 8
+static char* regs[9] = { "r10", "r11", "rbx", "r12", "r13", "r14", "r15", "rax", "rcx" };
+static char* regs32[9] = { "r10d", "r11d", "ebx", "r12d", "r13d", "r14d", "r15d", "eax", "ecx" };
+static char* regs8[9] = { "r10b", "r11b", "bl", "r12b", "r13b", "r14b", "r15b", "al", "cl" };
 
 static char* argregs[6] = { "rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 static char* argregs32[6] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
-static char* argregs8[6] = {"di", "si", "dx", "cx", "r8b", "r9b"};
+static char* argregs8[6] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
 static int numgp;
-#define REGAREA_SIZE 176
 
 static char* func_end_label;
+static char* func_name;
 static int label_id = 0;
+static Block* next_block; // 今のブロックの次に置くブロック。飛び越さずに落ちていける
 
+// ラベルは関数ごとの名前空間に置く
 static char* new_label(char* name) {
-  return format(".L%s%u", name, label_id++);
+  return format(".L%s.%s%u", func_name, name, label_id++);
+}
+
+static char* block_label(Block* block) {
+  return format(".L%s.%s%d", func_name, block->name, block->id);
+}
+
+// IBRのcondが成り立つときに飛ぶjccの条件。negateなら成り立たないときに飛ぶ
+static char* jump_cond(enum IRTag cond, bool negate) {
+  if (negate) {
+    if (cond == ILT) {
+      cond = IGE;
+    } else if (cond == ILE) {
+      cond = IGT;
+    } else if (cond == IGT) {
+      cond = ILE;
+    } else if (cond == IGE) {
+      cond = ILT;
+    } else if (cond == IEQ) {
+      cond = INE;
+    } else {
+      cond = IEQ;
+    }
+  }
+
+  switch (cond) {
+  case ILT: return "l";
+  case ILE: return "le";
+  case IGT: return "g";
+  case IGE: return "ge";
+  case IEQ: return "e";
+  default: return "ne";
+  }
 }
 
 static char* get_reg(int rn, size_t size) {
@@ -33,9 +70,10 @@ __attribute__((format(printf, 1, 2))) static void emit(char *fmt, ...);
 static void emit(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  printf("\t");
-  vprintf(fmt, ap);
-  printf("\n");
+  asm_putc('\t');
+  asm_vprintf(fmt, ap);
+  va_end(ap);
+  asm_putc('\n');
 }
 
 static void emit_const(Type* type, Node* node) {
@@ -46,23 +84,28 @@ static void emit_const(Type* type, Node* node) {
   switch (node->tag) {
   case NINT: {
     if (size_of(type) == 1) {
-      emit("db %d", node->integer);
+      emit(".byte %d", node->integer);
     } else if (size_of(type) == 4) {
-      emit("dd %d", node->integer);
+      emit(".int %d", node->integer);
     } else if (size_of(type) == 8) {
-      emit("dq %d", node->integer);
+      emit(".quad %d", node->integer);
     } else {
       bad_token(node->token, "emit error: emit_const(invalid size)");
     }
     break;
   }
   case NGVAR: {
-    if (size_of(type) == 1) {
-      emit("db %s", node->name);
-    } else if (size_of(type) == 4) {
-      emit("dd %s", node->name);
+    // foldでintegerにアドレスからのオフセットが入っている
+    char* addr = node->name;
+    if (node->integer > 0) {
+      addr = format("%s+%d", node->name, node->integer);
+    } else if (node->integer < 0) {
+      addr = format("%s%d", node->name, node->integer);
+    }
+    if (size_of(type) == 4) {
+      emit(".int %s", addr);
     } else if (size_of(type) == 8) {
-      emit("dq %s", node->name);
+      emit(".quad %s", addr);
     } else {
       bad_token(node->token, "emit error: emit_const(invalid size)");
     }
@@ -81,9 +124,13 @@ static void emit_mov(char* dst, char* src) {
 
 static void emit_builtin_va_start(IReg* addr) {
   emit("push rcx");
-  emit("mov rax, %s", get_reg(addr->real_reg, 8));
-  emit("mov dword [rax], %d", numgp * 8);
-  emit("mov dword [rax + 4], 48");
+  if (addr->spill) {
+    emit("mov rax, [rbp - %d]", addr->spill_offset);
+  } else {
+    emit_mov("rax", get_reg(addr->real_reg, 8));
+  }
+  emit("mov DWORD PTR [rax], %d", numgp * 8);
+  emit("mov DWORD PTR [rax + 4], 48");
   emit("lea rcx, [rbp - %d]", REGAREA_SIZE);
   emit("mov [rax + 16], rcx");
   emit("pop rcx");
@@ -96,7 +143,7 @@ static void emit_ir(IR* ir) {
     break;
   }
   case ILABEL: {
-    emit("lea %s, [%s]", get_reg(ir->r0->real_reg, ir->r0->size), ir->label);
+    emit("lea %s, %s", get_reg(ir->r0->real_reg, ir->r0->size), ir->label);
     break;
   }
   case IADD: {
@@ -200,7 +247,7 @@ static void emit_ir(IR* ir) {
   }
   case ILOAD: {
     if (ir->r0->size == 1) {
-      emit("movsx %s, byte [%s]", get_reg(ir->r0->real_reg, 4), get_reg(ir->r1->real_reg, 8));
+      emit("movsx %s, BYTE PTR [%s]", get_reg(ir->r0->real_reg, 4), get_reg(ir->r1->real_reg, 8));
     } else {
       emit("mov %s, [%s]", get_reg(ir->r0->real_reg, ir->r0->size), get_reg(ir->r1->real_reg, 8));
     }
@@ -229,15 +276,30 @@ static void emit_ir(IR* ir) {
     }
 
     for (size_t i = 0; i < ir->args->length; i++) {
-      emit_mov(argregs[i], get_reg(((IReg*)ir->args->ptr[i])->real_reg, 8));
+      IReg* arg = ir->args->ptr[i];
+      if (arg->spill) {
+        emit("mov %s, [rbp - %d]", argregs[i], arg->spill_offset);
+      } else {
+        emit_mov(argregs[i], get_reg(arg->real_reg, 8));
+      }
     }
 
-    emit("push r10");
-    emit("push r11");
+    // 呼び出しをまたいで生きている呼び出し元保存のレジスタだけ保存する。rspは16の倍数に保つ
+    Vector* saved = ir->save_regs;
+    if (saved->length % 2) {
+      emit("sub rsp, 8");
+    }
+    for (size_t i = 0; i < saved->length; i++) {
+      emit("push %s", regs[(long)saved->ptr[i]]);
+    }
     emit("mov rax, 0");
     emit("call %s", ir->func_name);
-    emit("pop r11");
-    emit("pop r10");
+    for (size_t i = saved->length; i > 0; i--) {
+      emit("pop %s", regs[(long)saved->ptr[i - 1]]);
+    }
+    if (saved->length % 2) {
+      emit("add rsp, 8");
+    }
     emit_mov(get_reg(ir->r0->real_reg, 8), "rax");
     break;
   }
@@ -245,7 +307,9 @@ static void emit_ir(IR* ir) {
     if (ir->r1) {
       emit_mov("rax", get_reg(ir->r1->real_reg, 8));
     } 
-    emit("jmp %s", func_end_label);
+    if (next_block) {
+      emit("jmp %s", func_end_label);
+    }
     break;
   }
   case IMOV: {
@@ -253,22 +317,118 @@ static void emit_ir(IR* ir) {
     break;
   }
   case IBR: {
-    emit("cmp %s, 0", get_reg(ir->r1->real_reg, ir->r1->size));
-    emit("je %s", ir->els);
-    emit("jmp %s", ir->then);
+    if (ir->r2) {
+      emit("cmp %s, %s", get_reg(ir->r1->real_reg, ir->size), get_reg(ir->r2->real_reg, ir->size));
+    } else {
+      emit("cmp %s, 0", get_reg(ir->r1->real_reg, ir->r1->size));
+    }
+    if (ir->then == next_block) {
+      emit("j%s %s", jump_cond(ir->cond, true), block_label(ir->els));
+    } else if (ir->els == next_block) {
+      emit("j%s %s", jump_cond(ir->cond, false), block_label(ir->then));
+    } else {
+      emit("j%s %s", jump_cond(ir->cond, false), block_label(ir->then));
+      emit("jmp %s", block_label(ir->els));
+    }
     break;
   }
   case IJMP: {
-    emit("jmp %s", ir->jump_to);
+    if (ir->jump_to != next_block) {
+      emit("jmp %s", block_label(ir->jump_to));
+    }
     break;
   }
+  case ISWITCH: {
+    // raxにテーブルの番号を作り、符号なしで比べて範囲外ならelsへ。r1はraxに読み直されていることがある
+    size_t size = ir->size;
+    if (size == 1) {
+      emit("movsx eax, %s", get_reg(ir->r1->real_reg, 1));
+      size = 4;
+    } else if (size == 4) {
+      // 32bitのmovで上位32bitを0にする。r1がeaxでも省かない
+      emit("mov eax, %s", get_reg(ir->r1->real_reg, 4));
+    } else {
+      emit_mov(get_reg(SCRATCH0, size), get_reg(ir->r1->real_reg, size));
+    }
+    if (ir->imm_int != 0) {
+      emit("sub %s, %d", get_reg(SCRATCH0, size), ir->imm_int);
+    }
+    emit("cmp %s, %zu", get_reg(SCRATCH0, size), ir->table->length - 1);
+    emit("ja %s", block_label(ir->els));
+
+    char* table = new_label("table");
+    emit("shl rax, 3");
+    emit("lea rcx, %s", table);
+    emit("add rax, rcx");
+    emit("mov rax, [rax]");
+    emit("jmp rax");
+
+    asm_puts(".section .rodata\n");
+    asm_puts(".align 8\n");
+    asm_label(table);
+    for (size_t i = 0; i < ir->table->length; i++) {
+      emit(".quad %s", block_label(ir->table->ptr[i]));
+    }
+    asm_puts(".text\n");
+    break;
+  }
+  case IARG: {
+    if (ir->r0->size == 1) {
+      emit_mov(get_reg(ir->r0->real_reg, 1), argregs8[ir->imm_int]);
+    } else if (ir->r0->size == 4) {
+      emit_mov(get_reg(ir->r0->real_reg, 4), argregs32[ir->imm_int]);
+    } else {
+      emit_mov(get_reg(ir->r0->real_reg, 8), argregs[ir->imm_int]);
+    }
+    break;
+  }
+  case IPHI: {
+    error("gen_x86: phi must be removed by leave_ssa\n");
+  }
+  }
+}
+
+static void reload(IReg* reg, int scratch) {
+  if (reg && reg->spill) {
+    reg->real_reg = scratch;
+    emit("mov %s, [rbp - %d]", regs[scratch], reg->spill_offset);
+  }
+}
+
+// スピルした仮想レジスタは命令の前にスロットから読み、命令の後にスロットへ書き戻す。
+// ICALLの引数は直接引数レジスタに読む。IARGの結果はrcxを壊さないようraxから書き戻す
+static void emit_ir_spilled(IR* ir) {
+  if (ir->op == IMOV && ir->r0->spill && ir->r1->spill && ir->r0->spill_offset == ir->r1->spill_offset) {
+    return;
+  }
+
+  if (ir->op != ICALL) {
+    reload(ir->r1, SCRATCH0);
+    if (ir->r2 != ir->r1) {
+      reload(ir->r2, SCRATCH1);
+    }
+  }
+
+  IReg* r0 = ir->r0;
+  if (r0 && r0->spill && r0 != ir->r1) {
+    if (ir->op == ICALL || ir->op == IARG) {
+      r0->real_reg = SCRATCH0;
+    } else {
+      r0->real_reg = SCRATCH1;
+    }
+  }
+
+  emit_ir(ir);
+
+  if (r0 && r0->spill) {
+    emit("mov [rbp - %d], %s", r0->spill_offset, regs[r0->real_reg]);
   }
 }
 
 static void emit_block(Block* block) {
-  printf("%s:\n", block->label);
+  asm_label(block_label(block));
   for (size_t i = 0; i < block->instrs->length; i++) {
-    emit_ir(block->instrs->ptr[i]);
+    emit_ir_spilled(block->instrs->ptr[i]);
   }
 }
 
@@ -296,17 +456,27 @@ static void emit_regsave_area(void) {
 
 static void emit_function(IFunc* func) {
   if (!func->blocks) {
-    printf("extern %s\n", func->name);
     return;
   }
 
+  func_name = func->name;
+  label_id = 0;
   func_end_label = new_label("end");
 
   if (!func->is_static) {
-    printf("global %s\n", func->name);
+    asm_printf(".global %s\n", func->name);
   }
-  printf("%s:\n", func->name);
+  asm_label(func->name);
 
+  // 呼び出し先保存のレジスタはrbpより上に積むので、ローカル変数の位置は変わらない。
+  // レジスタ保存領域のmovapsのため、rbpは16の倍数に保つ
+  Vector* saved = func->callee_saved;
+  for (size_t i = 0; i < saved->length; i++) {
+    emit("push %s", regs[(long)saved->ptr[i]]);
+  }
+  if (saved->length % 2) {
+    emit("sub rsp, 8");
+  }
   emit("push rbp");
   emit("mov rbp, rsp");
 
@@ -319,44 +489,74 @@ static void emit_function(IFunc* func) {
   emit("and rsp, -16");
 
   for (size_t i = 0; i < func->blocks->length; i++) {
+    next_block = NULL;
+    if (i + 1 < func->blocks->length) {
+      next_block = func->blocks->ptr[i + 1];
+    }
     emit_block(func->blocks->ptr[i]);
   }
 
-  printf("%s:\n", func_end_label);
+  asm_label(func_end_label);
   emit("mov rsp, rbp");
   emit("pop rbp");
+  if (saved->length % 2) {
+    emit("add rsp, 8");
+  }
+  for (size_t i = saved->length; i > 0; i--) {
+    emit("pop %s", regs[(long)saved->ptr[i - 1]]);
+  }
   emit("ret");
 }
 
-void gen_x86(IProgram* prog) {
-  for (GVar* gvar = prog->globals; gvar != NULL; gvar = gvar->next) {
-    if (gvar->is_extern) {
-      printf("extern %s\n", gvar->name);
-    }
-  }
+void gen_x86_func(IFunc* func) {
+  emit_function(func);
+}
 
-  puts("section .data");
-  for (GVar* gvar = prog->globals; gvar != NULL; gvar = gvar->next) {
+// 関数より前に出力する部分。emit.cと同じGASのIntel記法で書く
+void gen_x86_globals(GVar* globals) {
+  asm_puts(".intel_syntax noprefix\n");
+
+  asm_puts(".data\n");
+  for (GVar* gvar = globals; gvar != NULL; gvar = gvar->next) {
     if (gvar->init && !gvar->is_extern) {
-      printf("%s:\n", gvar->name);
+      asm_label(gvar->name);
       emit_const(gvar->type, gvar->init);
-    } else if (gvar->inits && !gvar->is_extern) {
-      printf("%s:\n", gvar->name);
+    } else if (gvar->inits && !gvar->is_extern && !gvar->is_string) {
+      asm_label(gvar->name);
+      for (size_t i = 0; i < gvar->inits->length; i++) {
+        emit_const(gvar->type->ptr_to, gvar->inits->ptr[i]);
+      }
+      // 初期化子が足りない要素は0にする
+      size_t rest = size_of(gvar->type) - gvar->inits->length * size_of(gvar->type->ptr_to);
+      if (rest > 0) {
+        emit(".zero %zu", rest);
+      }
+    }
+  }
+
+  asm_puts(".section .rodata\n");
+  for (GVar* gvar = globals; gvar != NULL; gvar = gvar->next) {
+    if (gvar->is_string) {
+      asm_label(gvar->name);
       for (size_t i = 0; i < gvar->inits->length; i++) {
         emit_const(gvar->type->ptr_to, gvar->inits->ptr[i]);
       }
     }
   }
 
-  puts("section .bss");
-  for (GVar* gvar = prog->globals; gvar != NULL; gvar = gvar->next) {
+  asm_puts(".bss\n");
+  for (GVar* gvar = globals; gvar != NULL; gvar = gvar->next) {
     if (gvar->init == NULL && gvar->inits == NULL && !gvar->is_extern) {
-      printf("%s:\n", gvar->name);
-      emit("resb %zu", size_of(gvar->type));
+      asm_label(gvar->name);
+      emit(".zero %zu", size_of(gvar->type));
     }
   }
 
-  puts("section .text");
+  asm_puts(".text\n");
+}
+
+void gen_x86(IProgram* prog) {
+  gen_x86_globals(prog->globals);
   for (size_t i = 0; i < prog->ifuncs->length; i++) {
     emit_function(prog->ifuncs->ptr[i]);
   }
@@ -13,6 +13,7 @@ void free(void* ptr);
 #define assert(e) e
 
 extern void* stderr;
+extern void* stdout;
 
 int printf();
 int fprintf();
@@ -30,9 +31,41 @@ int isdigit(int c);
 int isalnum(int c);
 int isalpha(int c);
 int strcmp(char* s1, char* s2);
+int strncmp(char* s1, char* s2, size_t n);
 size_t strlen(char* s);
 FILE* fopen(char* path, char* mode);
 int fclose(FILE* stream);
+size_t fwrite(void* ptr, size_t size, size_t count, FILE* stream);
+int fputs(char* s, FILE* stream);
+int fflush(FILE* stream);
+FILE* tmpfile(void);
+
+#define O_RDONLY 0
+#define SEEK_SET 0
+#define SEEK_END 2
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define PROT_EXEC 4
+#define MAP_PRIVATE 2
+#define MAP_ANONYMOUS 32
+#define _SC_PAGESIZE 30
+int open(char* path, int flags);
+int close(int fd);
+long read(int fd, void* buf, size_t count);
+long write(int fd, void* buf, size_t count);
+int creat(char* path, int mode);
+long lseek(int fd, long offset, int whence);
+long sysconf(int name);
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, long offset);
+int mprotect(void* addr, size_t length, int prot);
+char* realpath(char* path, char* resolved);
+int fork(void);
+int wait(int* status);
+int dup2(int oldfd, int newfd);
+int fileno(FILE* stream);
+int mkdir(char* path, int mode);
+int atoi(char* s);
+char* strrchr(char* s, int c);
 
 struct __va_list_elem {
   int gp_offset;
@@ -66,6 +99,7 @@ extern int optind;
 
 #endif
 #ifndef __hoc__
+#define _GNU_SOURCE // realpath, RTLD_DEFAULT
 #include <stdnoreturn.h>
 #include <stdbool.h>
 #include <ctype.h>
@@ -78,12 +112,19 @@ extern int optind;
 #include <libgen.h>
 #include <getopt.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dlfcn.h>
 #endif
 
 typedef struct {
   void **ptr;
   size_t capacity;
   size_t length;
+  int arena;
 } Vector;
 
 enum TokenTag {
@@ -193,7 +234,7 @@ typedef struct Node {
   Type* type; // type
   struct Node* lhs; // left-hand side
   struct Node* rhs; // right-hand side
-  int integer; // integer literal
+  int integer; // integer literal, caseの値
   Vector* stmts; // block
 
   // "return" expr
@@ -224,9 +265,19 @@ typedef struct Node {
   struct Node* step;
   struct Node* body;
 
-  Vector* cases; // for switch-case
+  Vector* cases; // for switch-case。semaでcaseの値の順に並べ、defaultを最後に置く
 } Node;
 
+// switchの分岐の方法。sema.cのswitch_loweringで決めて、両方のバックエンドで使う
+enum SwitchLowering {
+  SW_LINEAR, // caseの値と順に比べる
+  SW_TABLE,  // 範囲を確かめてからジャンプテーブルを引く
+  SW_SPLIT,  // 真ん中の値と比べて二分する
+};
+
+#define SWITCH_LINEAR_MAX 3    // これ以下のcaseは順に比べる
+#define SWITCH_TABLE_DENSITY 4 // 値の幅がcaseの数のこの倍未満ならジャンプテーブルにする
+
 typedef struct Function {
   char* name;
   Type* ret_type;
@@ -244,6 +295,7 @@ typedef struct GVar {
   Node* init;
   Vector* inits;
   bool is_extern;
+  bool is_string; // 文字列リテラル。.rodataに置く
 } GVar;
 
 typedef struct Program {
@@ -262,9 +314,8 @@ typedef struct IReg {
   size_t size;
 
   // for register allocation
-  int def;
-  int last_use;
   bool spill;
+  int spill_offset; // スピルしたときのスロットの位置(rbpからの距離)
 } IReg;
 
 enum IRTag {
@@ -294,12 +345,25 @@ enum IRTag {
   ICALL,
   IBR,
   IJMP,
+  ISWITCH,
   IRET,
+  IPHI,
+  IARG,
 };
 
+// 基本ブロック。最後の命令は必ずIJMP、IBR、ISWITCH、IRETのどれか。
+// ラベルは.L<関数名>.<name><id>としてgen_x86で作る
 typedef struct Block {
-  char* label;
+  int id;         // func->blocksでの位置
+  char* name;
   Vector* instrs;
+  Vector* succs;  // 後続ブロック(Block*)。ここから下はcfg.cで求める
+  Vector* preds;  // 先行ブロック(Block*)
+  int rpo;        // 逆後順での番号。到達しなければ-1
+  struct Block* idom;   // 直接支配するブロック。入口は自分自身
+  Vector* dom_children; // 支配木の子(Block*)
+  Vector* frontier;     // 支配辺境(Block*)
+  int loop_depth;       // 囲んでいるループの数
 } Block;
 
 typedef struct IR {
@@ -327,22 +391,30 @@ typedef struct IR {
      ISTORE r1 r2
      r0 = IMOV r1
      r0 = ICALL func_name args
-     IBR r1 then els
+     IBR r1 then els (r1が0でなければthenへ)
+     IBR r1 cond r2 size then els (condはILTからINE。sizeバイトで比べて成り立てばthenへ)
      IJMP jump_to
+     ISWITCH r1 imm_int size table els (r1-imm_intがtableの範囲ならその飛び先へ、範囲外ならelsへ)
      RET r1
+     r0 = IPHI args phi_preds (imm_intは変数の番号。SSAの間だけ使う)
+     r0 = IARG imm_int (imm_int番目の引数のレジスタ)
    */
   enum IRTag op;
+  enum IRTag cond;
   int imm_int;
   size_t size;
   IReg* r0;
   IReg* r1;
   IReg* r2;
   char* label;
-  char* jump_to;
-  char* then;
-  char* els;
+  Block* jump_to;
+  Block* then;
+  Block* els;
   char* func_name;
   Vector* args;
+  Vector* save_regs; // ICALLの前後で保存する呼び出し元保存のレジスタの番号
+  Vector* phi_preds; // IPHIのargsのそれぞれの値が来る前のブロック(Block*)
+  Vector* table;     // ISWITCHのジャンプテーブル(Block*)
 } IR;
 
 typedef struct IFunc {
@@ -350,14 +422,20 @@ typedef struct IFunc {
   bool is_static;
   bool has_va_arg;
   Vector* params;
-  Vector* blocks;
-  char* entry_label;
+  Vector* blocks; // 先頭が入口のブロック
+  Vector* rpo;    // 到達するブロックを逆後順に並べたもの。build_cfgで求める
+  int num_regs; // 仮想レジスタの数。新しく作るときの番号
+  int spill_size; // スピル用のスロットの大きさ。count_stack_sizeに含まれる
+  Vector* callee_saved; // 使っている呼び出し先保存のレジスタの番号
+  int num_spills;        // -stats用
+  int num_moves_removed; // -stats用。同じレジスタどうしになって消えたIMOVの数
 } IFunc;
 
 // ir.c
 int count_stack_size(IFunc* func);
 char* show_ireg(IReg* reg);
 char* show_ir(IR* ir);
+char* show_block_name(Block* block);
 char* show_block(int* inst_count, Block* block);
 char* show_ifunc(IFunc* ifunc);
 
@@ -380,11 +458,38 @@ Type* field_type(Field* fields, char* name);
 size_t field_offset(Field* fields, char* name);
 
 // containers.c
+// 各フェーズのオブジェクトを確保するアリーナ
+enum ArenaKind {
+  ARENA_TOKEN, // 字句解析・プリプロセスの作業用。preprocessの後に解放する
+  ARENA_AST,   // プリプロセス後のトークン、Node、Type
+  ARENA_IR,    // IR、IReg、Block。gen_x86の後に解放する
+  ARENA_INCLUDE, // キャッシュしたインクルードファイルのトークン。解放しない
+};
+#define NUM_ARENAS 4
+
+void* arena_alloc(int kind, size_t size);
+void arena_release(int kind);
+void use_arena(int kind);
+void dump_arena_stats(void);
+
 Vector* new_vec();
 void vec_push(Vector* v, void* elem);
 void* vec_pop(Vector* v);
 void* vec_last(Vector* v);
 
+// intern済みの文字列をキーにするハッシュ表
+typedef struct Map {
+  char** keys;
+  void** vals;
+  size_t capacity;
+  size_t length;
+} Map;
+
+Map* new_map(void);
+void* map_get(Map* map, char* key);
+void map_put(Map* map, char* key, void* val);
+void map_delete(Map* map, char* key);
+
 // emit.c
 typedef enum {
   AX,
@@ -399,6 +504,9 @@ typedef enum {
 } Reg;
 
 void emit_x86(Program* prog);
+void emit_x86_globals(GVar* globals);
+void emit_x86_func(Function* func);
+void emit_set_var_regs(bool enabled);
 
 // token.c
 void warn_token(Token* tok, char* msg);
@@ -409,13 +517,33 @@ void bad_token(Token* tok, char* msg);
 noreturn void bad_token(Token* tok, char* msg);
 #endif
 Token* lex(char* path);
+Token* lex_into(char* path, int arena);
+char* read_file(char* path);
+char* read_fd(int fd);
 
 // parse.c
+// ファイルスコープの宣言を読み終えた時点のパーサの状態
+typedef struct ParserState {
+  Map* tag_env;  // Map(char*, Type*)
+  Map* enum_env; // Map(char*, Node*)
+  Map* typedefs; // Map(char*, Type*)
+  GVar* globals;
+  Vector* funcs; // Vector(Function*)
+  size_t str_count;
+} ParserState;
+
 Program* parse(Token* tokens);
+ParserState* parser_state(Program* prog);
+void preload_parser_state(ParserState* state);
+
+// fold.c
+void fold(Program* prog);
 
 // sema.c
 void walk(Node* node);
 void sema(Program* prog);
+size_t num_case_values(Node* sw);
+enum SwitchLowering switch_lowering(Vector* cases, size_t lo, size_t hi);
 
 // utils.c
 #ifdef __hoc__
@@ -430,6 +558,8 @@ void eprintf(const char* fmt, ...);
 #endif
 int roundup(int x, int round_to);
 int streq(char* s0, char* s1);
+char* intern(char* str);
+char* intern_len(char* str, size_t len);
 
 typedef struct StringBuilder {
   char* buf;
@@ -438,8 +568,17 @@ typedef struct StringBuilder {
 } StringBuilder;
 
 StringBuilder* new_sb(void);
+void sb_reserve(StringBuilder* sb, size_t size);
 void sb_putc(StringBuilder* sb, char c);
+void sb_append(StringBuilder* sb, char* str, size_t len);
 void sb_puts(StringBuilder* sb, char* str);
+#ifdef __hoc__
+void sb_printf(StringBuilder* sb, char* fmt, ...);
+#endif
+#ifndef __hoc__
+void sb_printf(StringBuilder* sb, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+#endif
+void sb_reset(StringBuilder* sb);
 char* sb_run(StringBuilder* sb);
 void sb_destory(StringBuilder* sb);
 
@@ -451,8 +590,57 @@ char* show_type(Type* ty);
 void dump_type(Type* ty);
 void dump_function(Function* func);
 
+// asm.c
+void asm_open(char* path);
+void asm_open_object(char* path);
+void asm_capture(void);
+char* asm_take(void);
+void asm_close(void);
+void asm_flush(void);
+void asm_set_comments(bool enabled);
+bool asm_comments(void);
+void asm_putc(char c);
+void asm_write(char* s, size_t n);
+void asm_puts(char* s);
+void asm_label(char* label);
+void asm_long(long v);
+void asm_int(int v);
+void asm_ulong(size_t v);
+// hocは配列型の引数をポインタとして扱わないので、va_listを渡すときはポインタで受ける
+#ifdef __hoc__
+void asm_vprintf(char* fmt, struct __va_list_elem* ap);
+#endif
+#ifndef __hoc__
+void asm_vprintf(char* fmt, va_list ap);
+#endif
+#ifdef __hoc__
+void asm_printf(char* fmt, ...);
+#endif
+#ifndef __hoc__
+void asm_printf(char* fmt, ...) __attribute__((format(printf, 1, 2)));
+#endif
+int fork_workers(int jobs);
+
+// elf.c
+void write_object(char* path, char* text);
+int run_object(char* text, int argc, char** argv);
+
 // cpp.c
+typedef struct MacroEnv {
+  char* name;
+  Token* tokens;
+  Vector* params; // 関数形式マクロの仮引数。オブジェクト形式ならNULL
+} MacroEnv;
+
 Token* preprocess(char* dir, Token* tokens);
+char* canonical_path(char* path);
+void preload_macros(Map* macros, char* header);
+Map* macro_table(void);
+
+// pch.c
+void write_pch(char* path, char* header, Program* prog);
+void read_pch(char* path);
+void dump_include_stats(void);
 
 // ir.c
 char* show_iprog(IProgram* iprog);
@@ -462,10 +650,31 @@ IR* new_binop_ir(enum IRTag op, IReg* r0, IReg* r1, IReg* r2);
 
 // gen_ir.c
 IProgram* gen_ir(Program* program);
+Vector* ir_funcs(Program* program);
+IFunc* gen_ir_func(Function* func);
+
+// cfg.c
+Block* new_block(char* name);
+void append_block(IFunc* func, Block* block);
+bool is_terminator(IR* inst);
+IR* terminator(Block* block);
+void build_cfg(IFunc* func);
+void compute_dominators(IFunc* func);
+bool dominates(Block* a, Block* b);
+void compute_loops(IFunc* func);
+
+// ssa.c
+void build_ssa(IFunc* func);
+void leave_ssa(IFunc* func);
 
 // regalloc.c
 void alloc_regs(IProgram* prog);
+void alloc_func_regs(IFunc* func);
 
 // gen_x86.c
 #define NUM_REGS 7
+#define NUM_CALLER_SAVED 2 // 割り当てに使うレジスタのうち先頭のr10とr11は呼び出し元保存
+#define REGAREA_SIZE 176 // 可変長引数の関数でレジスタの引数を保存する領域
 void gen_x86(IProgram* prog);
+void gen_x86_globals(GVar* globals);
+void gen_x86_func(IFunc* func);
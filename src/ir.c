@@ -3,7 +3,7 @@
 /* create IR */
 
 IR* new_ir(enum IRTag op) {
-  IR* new = calloc(1, sizeof(IR));
+  IR* new = arena_alloc(ARENA_IR, sizeof(IR));
   new->op = op;
   return new;
 }
@@ -19,7 +19,7 @@ IR* new_binop_ir(enum IRTag op, IReg* r0, IReg* r1, IReg* r2) {
 /* count local variable size */
 
 int count_stack_size(IFunc* func) {
-  int size = 0;
+  int size = func->spill_size;
 
   for (int i = 0; i < func->blocks->length; i++) {
     Block* block = func->blocks->ptr[i];
@@ -38,7 +38,10 @@ int count_stack_size(IFunc* func) {
 
 /* printing IR */
 char* show_ireg(IReg* reg) {
-  return format("$%d(%zu,%d,%d->%d)", reg->id, reg->size, reg->real_reg, reg->def, reg->last_use);
+  if (reg->spill) {
+    return format("$%d(%zu,[rbp-%d])", reg->id, reg->size, reg->spill_offset);
+  }
+  return format("$%d(%zu,%d)", reg->id, reg->size, reg->real_reg);
 }
 
 static char* show_args(Vector* args) {
@@ -54,6 +57,30 @@ static char* show_args(Vector* args) {
   return sb_run(sb);
 }
 
+static char* show_table(Vector* table) {
+  StringBuilder* sb = new_sb();
+  sb_puts(sb, "[");
+  for (int i = 0; i < table->length; i++) {
+    if (i) {
+      sb_puts(sb, " ");
+    }
+    sb_puts(sb, show_block_name(table->ptr[i]));
+  }
+  sb_puts(sb, "]");
+  return sb_run(sb);
+}
+
+static char* show_cond(enum IRTag cond) {
+  switch (cond) {
+  case ILT: return "<";
+  case ILE: return "<=";
+  case IGT: return ">";
+  case IGE: return ">=";
+  case IEQ: return "==";
+  default: return "!=";
+  }
+}
+
 char* show_ir(IR* ir) {
   switch (ir->op) {
   case IIMM:
@@ -105,9 +132,20 @@ char* show_ir(IR* ir) {
   case ICALL:
     return format("%s = call %s %s", show_ireg(ir->r0), ir->func_name, show_args(ir->args));
   case IBR:
-    return format("br %s %s %s", show_ireg(ir->r1), ir->then, ir->els);
+    if (ir->r2) {
+      return format("br %s %s %s %s %s", show_ireg(ir->r1), show_cond(ir->cond), show_ireg(ir->r2),
+                    show_block_name(ir->then), show_block_name(ir->els));
+    }
+    return format("br %s %s %s", show_ireg(ir->r1), show_block_name(ir->then), show_block_name(ir->els));
   case IJMP:
-    return format("jmp %s", ir->jump_to);
+    return format("jmp %s", show_block_name(ir->jump_to));
+  case ISWITCH:
+    return format("switch %s - %d %s %s", show_ireg(ir->r1), ir->imm_int, show_table(ir->table),
+                  show_block_name(ir->els));
+  case IPHI:
+    return format("%s = phi %s", show_ireg(ir->r0), show_args(ir->args));
+  case IARG:
+    return format("%s = arg %d", show_ireg(ir->r0), ir->imm_int);
   case IRET:
     if (ir->r1) {
       return format("ret %s", show_ireg(ir->r1));
@@ -118,11 +156,22 @@ char* show_ir(IR* ir) {
   error("unreachable\n");
 }
 
+char* show_block_name(Block* block) {
+  return format("%s%d", block->name, block->id);
+}
+
 char* show_block(int* inst_count, Block* block) {
   StringBuilder* sb = new_sb();
-  sb_puts(sb, format("%s: {\n", block->label));
+  sb_printf(sb, "%s: preds(", show_block_name(block));
+  for (size_t i = 0; i < block->preds->length; i++) {
+    if (i > 0) {
+      sb_puts(sb, " ");
+    }
+    sb_puts(sb, show_block_name(block->preds->ptr[i]));
+  }
+  sb_printf(sb, ") depth %d {\n", block->loop_depth);
   for (int i = 0; i < block->instrs->length; i++, (*inst_count)++) {
-    sb_puts(sb, format(" [%d] ", *inst_count));
+    sb_printf(sb, " [%d] ", *inst_count);
     sb_puts(sb, show_ir(block->instrs->ptr[i]));
     sb_puts(sb, "\n");
   }
@@ -135,9 +184,14 @@ char* show_ifunc(IFunc* ifunc) {
     return format("extern %s", ifunc->name);
   }
 
+  // 先行ブロックとループの深さは今のブロックの並びで求め直して表示する
+  build_cfg(ifunc);
+  compute_dominators(ifunc);
+  compute_loops(ifunc);
+
   StringBuilder* sb = new_sb();
   int inst_count = 0;
-  sb_puts(sb, format("=== %s(%s) ===\n", ifunc->name, ifunc->entry_label));
+  sb_printf(sb, "=== %s ===\n", ifunc->name);
   sb_puts(sb, "params: ");
   for (int i = 0; i < ifunc->params->length; i++) {
     sb_puts(sb, show_ireg(ifunc->params->ptr[i]));
@@ -1,26 +1,65 @@
 #include "hoc.h"
 
-int main(int argc, char** argv)
-{
-  bool dump = false;
-  bool use_ir = false;
+static bool dump = false;
+static bool use_ir = false;
+static bool stats = false;
+static bool emit_pch = false;
+static bool object = false;
+static bool run = false;
+static char* output = NULL;
+static int func_jobs = 1;
 
-  int opt;
-  while ((opt = getopt(argc, argv, "di")) != -1) {
-    switch (opt) {
-    case 'd':
-      dump = true;
-      break;
-    case 'i':
-      use_ir = true;
-      break;
-    default:
-      error("Usage: %s [-d] [-i] filename\n", argv[0]);
+static void usage(char* name) {
+  error("Usage: %s [-d] [-i] [-stats] [-no-comments] [-no-reg-vars] [-c] [-func-jobs n] [-include-pch file] [-o file] filename\n       %s -j jobs [-i] [-no-comments] [-c] [-include-pch file] -o outdir filename...\n       %s -emit-pch header -o file\n       %s [-i] [-include-pch file] -run filename [args...]\n", name, name, name, name);
+}
+
+static void dump_regalloc_stats(IFunc* ifunc) {
+  if (stats && ifunc->blocks) {
+    eprintf("regalloc: %s: %d moves removed, %d registers spilled\n", ifunc->name, ifunc->num_moves_removed, ifunc->num_spills);
+  }
+}
+
+// 関数ごとのコード生成をfunc_jobs個のプロセスに分ける。
+// 各プロセスは連続した範囲の関数を受け持ち、出力は元の順につなげる
+static void codegen_parallel(Program* prog) {
+  Vector* funcs = prog->funcs;
+  if (use_ir) {
+    use_arena(ARENA_IR);
+    funcs = ir_funcs(prog);
+    gen_x86_globals(prog->globals);
+  } else {
+    emit_x86_globals(prog->globals);
+  }
+
+  int w = fork_workers(func_jobs);
+  if (w < 0) {
+    return;
+  }
+
+  size_t begin = funcs->length * w / func_jobs;
+  size_t end = funcs->length * (w + 1) / func_jobs;
+  for (size_t i = begin; i < end; i++) {
+    if (use_ir) {
+      IFunc* ifunc = gen_ir_func(funcs->ptr[i]);
+      alloc_func_regs(ifunc);
+      dump_regalloc_stats(ifunc);
+      if (dump) {
+        eprintf("%s\n", show_ifunc(ifunc));
+      }
+      gen_x86_func(ifunc);
+    } else {
+      emit_x86_func(funcs->ptr[i]);
     }
   }
+  asm_close();
+  exit(0);
+}
 
-  char* path = format("%s/%s", dirname(format("%s", argv[optind])), basename(format("%s", argv[optind])));
+// 1つの翻訳単位をコンパイルして、アセンブリを標準出力かasm_openしたファイルに書く
+static void compile(char* input) {
+  char* path = format("%s/%s", dirname(format("%s", input)), basename(format("%s", input)));
 
+  use_arena(ARENA_TOKEN);
   Token* tokens = lex(path);
 
   if (dump) {
@@ -31,6 +70,12 @@ int main(int argc, char** argv)
   }
 
   tokens = preprocess(dirname(format("%s", path)), tokens);
+  // プリプロセス後のトークンはASTのアリーナにあるので、作業用のトークンは捨てられる。
+  // ただし-emit-pchではマクロ表を書き出すまで残す
+  if (!emit_pch) {
+    arena_release(ARENA_TOKEN);
+  }
+  use_arena(ARENA_AST);
 
   if (dump) {
     for (Token* t = tokens; t != NULL; t = t->next) {
@@ -40,7 +85,14 @@ int main(int argc, char** argv)
   }
 
   Program* prog = parse(tokens);
+
+  if (emit_pch) {
+    write_pch(output, path, prog);
+    return;
+  }
+
   sema(prog);
+  fold(prog);
 
   if (dump) {
     for (size_t i = 0; i < prog->funcs->length; i++) {
@@ -48,15 +100,186 @@ int main(int argc, char** argv)
     }
   }
 
-  if (use_ir) {
+  if (func_jobs > 1) {
+    codegen_parallel(prog);
+  } else if (use_ir) {
+    use_arena(ARENA_IR);
     IProgram* iprog = gen_ir(prog);
-    eprintf("%s\n", show_iprog(iprog));
     alloc_regs(iprog);
-    eprintf("%s\n", show_iprog(iprog));
+    for (size_t i = 0; i < iprog->ifuncs->length; i++) {
+      dump_regalloc_stats(iprog->ifuncs->ptr[i]);
+    }
+    if (dump) {
+      eprintf("%s\n", show_iprog(iprog));
+    }
     gen_x86(iprog);
+    arena_release(ARENA_IR);
   } else {
     emit_x86(prog);
   }
 
+  asm_close();
+
+  if (stats) {
+    dump_arena_stats();
+    dump_include_stats();
+  }
+}
+
+// outdir/foo.c -> outdir/foo.s (-cのときはoutdir/foo.o)
+static char* output_path(char* outdir, char* input) {
+  char* name = basename(format("%s", input));
+  char* dot = strrchr(name, '.');
+  if (dot) {
+    *dot = '\0';
+  }
+  if (object) {
+    return format("%s/%s.o", outdir, name);
+  }
+  return format("%s/%s.s", outdir, name);
+}
+
+static void open_output(char* path) {
+  if (object) {
+    asm_open_object(path);
+  } else {
+    asm_open(path);
+  }
+}
+
+static bool wait_job(void) {
+  int status = 0;
+  if (wait(&status) < 0) {
+    error("wait failed\n");
+  }
+  return status != 0;
+}
+
+// 翻訳単位ごとにプロセスをforkし、同時にjobs個までコンパイルする。
+// コンパイラの状態はすべてプロセスごとに独立し、読み込み済みのプリコンパイル済みヘッダは子に引き継がれる
+static bool compile_all(Vector* inputs, char* outdir, int jobs) {
+  mkdir(outdir, 493); // 0755。既にあれば何もしない
+
+  int running = 0;
+  bool failed = false;
+  for (size_t i = 0; i < inputs->length; i++) {
+    if (running == jobs) {
+      if (wait_job()) {
+        failed = true;
+      }
+      running--;
+    }
+
+    int pid = fork();
+    if (pid < 0) {
+      error("fork failed\n");
+    }
+    if (pid == 0) {
+      open_output(output_path(outdir, inputs->ptr[i]));
+      compile(inputs->ptr[i]);
+      exit(0);
+    }
+    running++;
+  }
+
+  while (running > 0) {
+    if (wait_job()) {
+      failed = true;
+    }
+    running--;
+  }
+  return failed;
+}
+
+int main(int argc, char** argv)
+{
+  int jobs = 0;
+  char* pch = NULL;
+  int run_argc = 0;
+  char** run_argv = NULL;
+  Vector* inputs = new_vec();
+
+  for (int i = 1; i < argc; i++) {
+    if (streq(argv[i], "-d")) {
+      dump = true;
+    } else if (streq(argv[i], "-i")) {
+      use_ir = true;
+    } else if (streq(argv[i], "-stats")) {
+      stats = true;
+    } else if (streq(argv[i], "-c")) {
+      object = true;
+    } else if (streq(argv[i], "-run") && i + 1 < argc) {
+      // 以降の引数は実行するプログラムに渡す
+      run = true;
+      vec_push(inputs, argv[i + 1]);
+      run_argc = argc - i - 1;
+      run_argv = argv + i + 1;
+      break;
+    } else if (streq(argv[i], "-no-comments")) {
+      asm_set_comments(false);
+    } else if (streq(argv[i], "-no-reg-vars")) {
+      // ローカル変数をすべてフレームに置く
+      emit_set_var_regs(false);
+    } else if (streq(argv[i], "-emit-pch")) {
+      emit_pch = true;
+    } else if (streq(argv[i], "-include-pch") && i + 1 < argc) {
+      i++;
+      pch = argv[i];
+    } else if (streq(argv[i], "-o") && i + 1 < argc) {
+      i++;
+      output = argv[i];
+    } else if (streq(argv[i], "-func-jobs") && i + 1 < argc) {
+      i++;
+      func_jobs = atoi(argv[i]);
+    } else if (streq(argv[i], "-j") && i + 1 < argc) {
+      i++;
+      jobs = atoi(argv[i]);
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+    } else {
+      vec_push(inputs, argv[i]);
+    }
+  }
+
+  if (inputs->length == 0 || jobs < 0 || func_jobs < 1 || (emit_pch && output == NULL) || (object && emit_pch) || (run && (object || emit_pch || output || jobs || func_jobs > 1))) {
+    usage(argv[0]);
+  }
+
+  if (object || run) {
+    asm_set_comments(false); // 組み込みのアセンブラには不要
+  }
+
+  if (pch) {
+    read_pch(pch);
+  }
+
+  // アセンブリをメモリ上で機械語に直し、このプロセスの中でmainを呼ぶ
+  if (run) {
+    asm_capture();
+    compile(inputs->ptr[0]);
+    return run_object(asm_take(), run_argc, run_argv);
+  }
+
+  // -jか複数のファイルを指定したときは、-oは出力先のディレクトリ
+  if (jobs == 0 && inputs->length == 1) {
+    if (object && output == NULL) {
+      output = output_path(".", inputs->ptr[0]);
+    }
+    if (output && !emit_pch) {
+      open_output(output);
+    }
+    compile(inputs->ptr[0]);
+    return 0;
+  }
+
+  if (output == NULL || emit_pch) {
+    usage(argv[0]);
+  }
+  if (jobs == 0) {
+    jobs = 1;
+  }
+  if (compile_all(inputs, output, jobs)) {
+    return 1;
+  }
   return 0;
 }
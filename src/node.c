@@ -1,7 +1,7 @@
 #include "hoc.h"
 
 Node *new_node(enum NodeTag tag, Token *token) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = arena_alloc(ARENA_AST, sizeof(Node));
   node->tag = tag;
   node->token = token;
   return node;
@@ -10,7 +10,7 @@ Node *new_node(enum NodeTag tag, Token *token) {
 size_t size_of(Type *ty) { return ty->size; }
 
 Type *new_type(enum TypeTag tag, size_t size) {
-  Type *ty = calloc(1, sizeof(Type));
+  Type *ty = arena_alloc(ARENA_AST, sizeof(Type));
   ty->ty = tag;
   ty->size = size;
   ty->align = size;
@@ -18,13 +18,13 @@ Type *new_type(enum TypeTag tag, size_t size) {
 }
 
 Type *clone_type(Type *t) {
-  Type *new = calloc(1, sizeof(Type));
+  Type *new = arena_alloc(ARENA_AST, sizeof(Type));
   memcpy(new, t, sizeof(Type));
   return new;
 }
 
 Node *clone_node(Node *node) {
-  Node *new = calloc(1, sizeof(Node));
+  Node *new = arena_alloc(ARENA_AST, sizeof(Node));
   memcpy(new, node, sizeof(Node));
   return new;
 }
@@ -54,7 +54,7 @@ Type *type_of(Node *node) { return node->type; }
 
 Field *look_struct(Field *fields, char *name) {
   for (Field *f = fields; f != NULL; f = f->next) {
-    if (streq(f->name, name)) {
+    if (f->name == name) {
       return f;
     }
   }
@@ -63,7 +63,7 @@ Field *look_struct(Field *fields, char *name) {
       // Unnamed substructures
       Field *sub = look_struct(f->type->fields, name);
       if (sub) {
-        Field *g = calloc(1, sizeof(Field));
+        Field *g = arena_alloc(ARENA_AST, sizeof(Field));
         g->name = sub->name;
         g->type = sub->type;
         g->next = sub->next;
@@ -2,36 +2,24 @@
 
 typedef struct LVar {
   struct LVar *next;
+  struct LVar *shadow; // 同じ名前の外側の変数
   char *name;
   Type *type;
   int offset;
 } LVar;
 
-typedef struct Tag {
-  struct Tag *next;
-  Type *type;
-} Tag;
-
-typedef struct TypeDef {
-  struct TypeDef *next;
-  char *name;
-  Type *type;
-} TypeDef;
-
-typedef struct Enum {
-  struct Enum *next;
-  char *name;
-  Node *val;
-} Enum;
-
+// 名前はすべてintern済みなので、表はポインタをキーにして引く
 static Token *tokens;
-static LVar *local_env;
+static LVar *local_env;     // 宣言順のリスト。スコープを抜けるときに巻き戻す
+static Map *local_vars;     // Map(char*, LVar*)
 static size_t local_size;
-static Tag *tag_env;
-static Enum *enum_env;
+static Map *tag_env;        // Map(char*, Type*)
+static Map *enum_env;       // Map(char*, Node*)
 static GVar *global_env;
-static TypeDef *typedefs;
+static Map *global_vars;    // Map(char*, GVar*)
+static Map *typedefs;       // Map(char*, Type*)
 static size_t str_count;
+static ParserState *preloaded; // プリコンパイル済みヘッダの状態
 
 static Node *new_int_node(Token *token, int i) {
   Node *node = new_node(NINT, token);
@@ -56,24 +44,21 @@ static Node *new_gvar(Token *tok, char *name, Type *type) {
 }
 
 static Node *find_var(Token *tok, char *name) {
-  for (LVar *env = local_env; env != NULL; env = env->next) {
-    if (streq(name, env->name)) {
-      return new_var(tok, env->name, env->type, env->offset);
-    }
+  LVar *lvar = map_get(local_vars, name);
+  if (lvar) {
+    return new_var(tok, lvar->name, lvar->type, lvar->offset);
   }
 
-  for (GVar *env = global_env; env != NULL; env = env->next) {
-    if (streq(name, env->name)) {
-      return new_gvar(tok, env->name, env->type);
-    }
+  GVar *gvar = map_get(global_vars, name);
+  if (gvar) {
+    return new_gvar(tok, gvar->name, gvar->type);
   }
 
-  for (Enum *env = enum_env; env != NULL; env = env->next) {
-    if (streq(name, env->name)) {
-      Node *val = clone_node(env->val);
-      val->token = tok;
-      return val;
-    }
+  Node *enum_val = map_get(enum_env, name);
+  if (enum_val) {
+    Node *val = clone_node(enum_val);
+    val->token = tok;
+    return val;
   }
 
   bad_token(tok, format("%s is not defined\n", name));
@@ -82,64 +67,61 @@ static Node *find_var(Token *tok, char *name) {
 
 static void add_lvar(Token *tok, char *name, Type *ty) {
   local_size += size_of(ty);
-  LVar *lvar = calloc(sizeof(LVar), 1);
+  LVar *lvar = arena_alloc(ARENA_AST, sizeof(LVar));
   lvar->name = name;
   lvar->type = ty;
   lvar->offset = local_size;
   lvar->next = local_env;
+  lvar->shadow = map_get(local_vars, name);
   local_env = lvar;
+  map_put(local_vars, name, lvar);
+}
+
+// スコープを抜けるとき、saved以降に宣言した変数の束縛を元に戻す
+static void end_scope(LVar *saved) {
+  for (LVar *lvar = local_env; lvar != saved; lvar = lvar->next) {
+    if (lvar->shadow) {
+      map_put(local_vars, lvar->name, lvar->shadow);
+    } else {
+      map_delete(local_vars, lvar->name);
+    }
+  }
+  local_env = saved;
 }
 
 static void add_gvar(Token *tok, char *name, Type *type, Node *init,
                      Vector *inits) {
-  GVar *gvar = calloc(sizeof(GVar), 1);
+  GVar *gvar = arena_alloc(ARENA_AST, sizeof(GVar));
   gvar->name = name;
   gvar->type = type;
   gvar->init = init;
   gvar->inits = inits;
   gvar->next = global_env;
   global_env = gvar;
+  map_put(global_vars, name, gvar);
 }
 
 static void add_enum(char *name, int val) {
-  Enum *e = calloc(1, sizeof(Enum));
-  e->name = name;
-  e->val = new_int_node(NULL, val);
-  e->next = enum_env;
-  enum_env = e;
+  map_put(enum_env, name, new_int_node(NULL, val));
 }
 
 static void add_typedef(char *name, Type *type) {
-  TypeDef *td = calloc(1, sizeof(TypeDef));
-  td->name = name;
-  td->type = type;
-  td->next = typedefs;
-  typedefs = td;
+  map_put(typedefs, name, type);
 }
 
 static void init_typedef(void) {
-  add_typedef("void", void_type());
-  add_typedef("char", char_type());
-  add_typedef("int", int_type());
-  add_typedef("long", long_type());
+  add_typedef(intern("void"), void_type());
+  add_typedef(intern("char"), char_type());
+  add_typedef(intern("int"), int_type());
+  add_typedef(intern("long"), long_type());
 }
 
 static Type *find_type(char *name) {
-  for (TypeDef *td = typedefs; td != NULL; td = td->next) {
-    if (streq(name, td->name)) {
-      return td->type;
-    }
-  }
-  return NULL;
+  return map_get(typedefs, name);
 }
 
 static Type *find_tag(char *tag_name) {
-  for (Tag *tag = tag_env; tag != NULL; tag = tag->next) {
-    if (streq(tag_name, tag->type->tag)) {
-      return tag->type;
-    }
-  }
-  return NULL;
+  return map_get(tag_env, tag_name);
 }
 
 static Node *new_subscript(Token *token, Node *value, Node *index) {
@@ -252,7 +234,7 @@ static Field *read_field() {
   }
 
   Node *def = declarator(type_specifier());
-  Field *field = calloc(1, sizeof(Field));
+  Field *field = arena_alloc(ARENA_AST, sizeof(Field));
   field->name = def->name;
   field->type = def->type;
   field->next = read_field();
@@ -273,10 +255,7 @@ static Type *type_specifier() {
       if (!ty) {
         ty = new_type(TY_STRUCT, 0);
         ty->tag = tag;
-        Tag *new_tag = calloc(sizeof(Tag), 1);
-        new_tag->type = ty;
-        new_tag->next = tag_env;
-        tag_env = new_tag;
+        map_put(tag_env, tag, ty);
       }
       consume();
     } else {
@@ -493,9 +472,9 @@ static Node *string() {
 
   char *str = expect(TSTRING, "string")->str;
   Vector *str_vec = new_vec();
-  char *str_label = format(
+  char *str_label = intern(format(
       "Lstring%zu",
-      str_count++); // TODO:
+      str_count++)); // TODO:
                     // -iオプションが渡されているかいないかでラベル名を変える
 
   for (char *c = str; *c != '\0'; c++) {
@@ -505,6 +484,7 @@ static Node *string() {
 
   add_gvar(token, str_label, array_of(char_type(), strlen(str) + 1), NULL,
            str_vec);
+  global_env->is_string = true;
   return find_var(token, str_label);
 }
 
@@ -742,12 +722,8 @@ static int is_typename(Token *t) {
     return 1;
   }
 
-  if (t->tag == TIDENT || t->tag == TRESERVED) {
-    for (TypeDef *td = typedefs; td != NULL; td = td->next) {
-      if (streq(t->ident, td->name)) {
-        return 1;
-      }
-    }
+  if ((t->tag == TIDENT || t->tag == TRESERVED) && find_type(t->ident)) {
+    return 1;
   }
   return 0;
 }
@@ -944,7 +920,7 @@ static Node *statement() {
 
     node->body = statement();
 
-    local_env = tmp;
+    end_scope(tmp);
 
     return node;
   } else if ((tok = match("switch"))) {
@@ -990,7 +966,7 @@ static Node *statement() {
       parse_error("}", peek(0));
     }
 
-    local_env = tmp; // end scope
+    end_scope(tmp); // end scope
 
     return node;
   } else {
@@ -1059,9 +1035,9 @@ static Function *funcdef(bool is_static) {
   }
 
   if (match(";")) {
-    local_env = tmp; // end scope
+    end_scope(tmp); // end scope
 
-    Function *func = calloc(1, sizeof(Function));
+    Function *func = arena_alloc(ARENA_AST, sizeof(Function));
     func->name = name;
     func->ret_type = ret_type;
     func->body = NULL;
@@ -1074,9 +1050,9 @@ static Function *funcdef(bool is_static) {
 
   Node *body = statement();
 
-  local_env = tmp; // end scope
+  end_scope(tmp); // end scope
 
-  Function *func = calloc(1, sizeof(Function));
+  Function *func = arena_alloc(ARENA_AST, sizeof(Function));
   func->name = name;
   func->ret_type = ret_type;
   func->body = body;
@@ -1112,6 +1088,13 @@ static void global_var(void) {
   Token *tok = peek(0);
   char *name = read_ident();
 
+  // int a[] = {...}のように大きさを省いた配列は、初期化子の数から大きさを決める
+  bool unsized = false;
+  if (eq_reserved(peek(0), "[") && eq_reserved(peek(1), "]")) {
+    consume();
+    consume();
+    unsized = true;
+  }
   type = read_type_suffix(type);
 
   if (match("=")) {
@@ -1125,10 +1108,30 @@ static void global_var(void) {
       if (!match("}")) {
         parse_error("}", peek(0));
       }
+      if (unsized) {
+        type = array_of(type, inits->length);
+      }
+      add_gvar(tok, name, type, NULL, inits);
+    } else if ((unsized || type->array_size > 0) && peek_tag(0) == TSTRING) {
+      // char s[] = "..."は文字列の中身をそのまま置く
+      char *str = expect(TSTRING, "string")->str;
+      Vector *inits = new_vec();
+      for (char *c = str; *c != '\0'; c++) {
+        vec_push(inits, new_int_node(tok, *c));
+      }
+      // 終端の0は入りきるときだけ置く。char s[3] = "abc"は0を持たない
+      if (unsized || inits->length < type->array_size) {
+        vec_push(inits, new_int_node(tok, 0));
+      }
+      if (unsized) {
+        type = array_of(type, inits->length);
+      }
       add_gvar(tok, name, type, NULL, inits);
     } else {
       add_gvar(tok, name, type, expr(), NULL);
     }
+  } else if (unsized) {
+    parse_error("=", peek(0));
   } else {
     add_gvar(tok, name, type, NULL, NULL);
   }
@@ -1153,14 +1156,50 @@ static Function *toplevel() {
   }
 }
 
+// parseの前に呼ぶと、ヘッダを読み終えた状態から続けて解析する
+void preload_parser_state(ParserState *state) { preloaded = state; }
+
+// progを解析し終えた時点の状態
+ParserState *parser_state(Program *prog) {
+  ParserState *state = arena_alloc(ARENA_AST, sizeof(ParserState));
+  state->funcs = prog->funcs;
+  state->tag_env = tag_env;
+  state->enum_env = enum_env;
+  state->typedefs = typedefs;
+  state->globals = global_env;
+  state->str_count = str_count;
+  return state;
+}
+
 Program *parse(Token *t) {
   tokens = t;
 
-  init_typedef();
-
-  Program *prog = calloc(1, sizeof(Program));
+  Program *prog = arena_alloc(ARENA_AST, sizeof(Program));
   prog->funcs = new_vec();
 
+  local_vars = new_map();
+  global_vars = new_map();
+  if (preloaded) {
+    tag_env = preloaded->tag_env;
+    enum_env = preloaded->enum_env;
+    typedefs = preloaded->typedefs;
+    str_count = preloaded->str_count;
+    global_env = preloaded->globals;
+    for (GVar *gvar = global_env; gvar != NULL; gvar = gvar->next) {
+      if (map_get(global_vars, gvar->name) == NULL) {
+        map_put(global_vars, gvar->name, gvar);
+      }
+    }
+    for (size_t i = 0; i < preloaded->funcs->length; i++) {
+      vec_push(prog->funcs, preloaded->funcs->ptr[i]);
+    }
+  } else {
+    tag_env = new_map();
+    enum_env = new_map();
+    typedefs = new_map();
+    init_typedef();
+  }
+
   while (tokens) {
     Function *func = toplevel();
     if (func) {
@@ -0,0 +1,461 @@
+#include "hoc.h"
+
+// プリコンパイル済みヘッダ
+//
+// ヘッダを前処理・構文解析し終えた時点のマクロ表とパーサの状態を、8バイトのワード列として書き出す。
+// 文字列はNUL終端して8バイト境界まで詰めるので、読み込み時はmmapしたファイルの中をそのまま指す。
+// 型やノードのように共有されうるオブジェクトは初出のときに中身を書き、2回目以降は番号で参照する。
+
+#define PCH_MAGIC "HOCPCH1"
+
+enum PchTag {
+  PCH_NULL,
+  PCH_REF, // 既出のオブジェクト。続くワードが番号
+  PCH_NEW, // 続けて中身を書く
+};
+
+/* writer */
+
+static StringBuilder* out;
+static Map* ids; // Map(void*, long) 書き出したオブジェクトの番号
+static long num_objs;
+
+static void put(long v) {
+  long word = v;
+  sb_append(out, (char*)&word, sizeof(long));
+}
+
+static void put_str(char* s) {
+  if (s == NULL) {
+    put(0);
+    return;
+  }
+  size_t len = strlen(s);
+  put(len + 1);
+  sb_append(out, s, len);
+  for (size_t i = len; i < roundup(len + 1, 8); i++) {
+    sb_putc(out, '\0');
+  }
+}
+
+// 初出ならtrueを返すので、呼び出し側が続けて中身を書く
+static bool put_ref(void* p) {
+  if (p == NULL) {
+    put(PCH_NULL);
+    return false;
+  }
+
+  long id = (long)map_get(ids, p);
+  if (id) {
+    put(PCH_REF);
+    put(id);
+    return false;
+  }
+
+  num_objs++;
+  map_put(ids, p, (void*)num_objs);
+  put(PCH_NEW);
+  return true;
+}
+
+static void put_source(char* source) {
+  if (put_ref(source)) {
+    put_str(source);
+  }
+}
+
+static void put_token(Token* t) {
+  if (!put_ref(t)) {
+    return;
+  }
+  put(t->tag);
+  put(t->integer);
+  put_str(t->ident);
+  put_str(t->str);
+  put(t->bol);
+  put_source(t->source);
+  put(t->start - t->source);
+}
+
+static void put_type(Type* ty) {
+  if (!put_ref(ty)) {
+    return;
+  }
+  put(ty->ty);
+  put(ty->align);
+  put(ty->size);
+  put_type(ty->ptr_to);
+  put(ty->array_size);
+  put_str(ty->tag);
+  for (Field* f = ty->fields; f != NULL; f = f->next) {
+    put(true);
+    put_str(f->name);
+    put_type(f->type);
+    put(f->offset);
+  }
+  put(false);
+}
+
+static void put_node(Node* node);
+
+static void put_nodes(Vector* nodes) {
+  if (nodes == NULL) {
+    put(0);
+    return;
+  }
+  put(nodes->length + 1);
+  for (size_t i = 0; i < nodes->length; i++) {
+    put_node(nodes->ptr[i]);
+  }
+}
+
+static void put_node(Node* node) {
+  if (!put_ref(node)) {
+    return;
+  }
+  put(node->tag);
+  put_token(node->token);
+  put_type(node->type);
+  put_node(node->lhs);
+  put_node(node->rhs);
+  put(node->integer);
+  put_nodes(node->stmts);
+  put_node(node->expr);
+  put_str(node->name);
+  put(node->offset);
+  put_nodes(node->args);
+  put_node(node->cond);
+  put_node(node->then);
+  put_node(node->els);
+  put_node(node->init);
+  put_node(node->step);
+  put_node(node->body);
+  put_nodes(node->cases);
+}
+
+static size_t map_count(Map* map) {
+  size_t count = 0;
+  for (size_t i = 0; i < map->capacity; i++) {
+    if (map->keys[i] && map->vals[i]) {
+      count++;
+    }
+  }
+  return count;
+}
+
+static void put_macro(MacroEnv* macro) {
+  put_str(macro->name);
+
+  if (macro->params) {
+    put(macro->params->length + 1);
+    for (size_t i = 0; i < macro->params->length; i++) {
+      put_str(macro->params->ptr[i]);
+    }
+  } else {
+    put(0);
+  }
+
+  for (Token* t = macro->tokens; t != NULL; t = t->next) {
+    put(true);
+    put_token(t);
+  }
+  put(false);
+}
+
+static void put_macros(Map* macros) {
+  put(map_count(macros));
+  for (size_t i = 0; i < macros->capacity; i++) {
+    if (macros->keys[i] && macros->vals[i]) {
+      put_macro(macros->vals[i]);
+    }
+  }
+}
+
+// valsがTypeかNodeの表を書く
+static void put_env(Map* env, bool is_type) {
+  put(map_count(env));
+  for (size_t i = 0; i < env->capacity; i++) {
+    if (env->keys[i] && env->vals[i]) {
+      put_str(env->keys[i]);
+      if (is_type) {
+        put_type(env->vals[i]);
+      } else {
+        put_node(env->vals[i]);
+      }
+    }
+  }
+}
+
+static void put_parser_state(ParserState* state) {
+  put_env(state->tag_env, true);
+  put_env(state->enum_env, false);
+  put_env(state->typedefs, true);
+
+  for (GVar* gvar = state->globals; gvar != NULL; gvar = gvar->next) {
+    put(true);
+    put_str(gvar->name);
+    put_type(gvar->type);
+    put_node(gvar->init);
+    put_nodes(gvar->inits);
+    put(gvar->is_extern);
+    put(gvar->is_string);
+  }
+  put(false);
+
+  put(state->funcs->length);
+  for (size_t i = 0; i < state->funcs->length; i++) {
+    Function* func = state->funcs->ptr[i];
+    put_str(func->name);
+    put_type(func->ret_type);
+    put_node(func->body);
+    put_nodes(func->params);
+    put(func->local_size);
+    put(func->is_static);
+    put(func->has_va_arg);
+  }
+
+  put(state->str_count);
+}
+
+// headerを解析し終えた直後に呼び、その時点のマクロ表とprogまでのパーサの状態をpathに書き出す
+void write_pch(char* path, char* header, Program* prog) {
+  out = new_sb();
+  ids = new_map();
+  num_objs = 0;
+
+  sb_append(out, PCH_MAGIC, 8);
+  put_str(canonical_path(header));
+  put_macros(macro_table());
+  put_parser_state(parser_state(prog));
+
+  FILE* fp = fopen(path, "w");
+  if (fp == NULL) {
+    error("cannot open file: %s\n", path);
+  }
+  fwrite(out->buf, 1, out->length, fp);
+  fclose(fp);
+}
+
+/* reader */
+
+static long* in;
+static size_t pos;
+static Vector* objs; // 番号順に読んだオブジェクト
+
+static long get(void) {
+  return in[pos++];
+}
+
+static char* get_str(void) {
+  long len = get();
+  if (len == 0) {
+    return NULL;
+  }
+  char* s = (char*)(in + pos);
+  pos += roundup(len, 8) / 8;
+  return s;
+}
+
+static char* get_ident(void) {
+  char* s = get_str();
+  if (s == NULL) {
+    return NULL;
+  }
+  return intern(s);
+}
+
+// PCH_NULLかPCH_REFのときのオブジェクト
+static void* get_obj(long tag) {
+  if (tag == PCH_NULL) {
+    return NULL;
+  }
+  return objs->ptr[get() - 1];
+}
+
+static char* get_source(void) {
+  long tag = get();
+  if (tag != PCH_NEW) {
+    return get_obj(tag);
+  }
+  vec_push(objs, NULL); // 中身を読む前に番号を確保する
+  size_t id = objs->length - 1;
+  char* source = get_str();
+  objs->ptr[id] = source;
+  return source;
+}
+
+static Token* get_token(void) {
+  long tag = get();
+  if (tag != PCH_NEW) {
+    return get_obj(tag);
+  }
+  Token* t = arena_alloc(ARENA_AST, sizeof(Token));
+  vec_push(objs, t);
+  t->tag = get();
+  t->integer = get();
+  t->ident = get_ident();
+  t->str = get_str();
+  t->bol = get();
+  t->source = get_source();
+  t->start = t->source + get();
+  return t;
+}
+
+static Type* get_type(void) {
+  long tag = get();
+  if (tag != PCH_NEW) {
+    return get_obj(tag);
+  }
+  Type* ty = arena_alloc(ARENA_AST, sizeof(Type));
+  vec_push(objs, ty);
+  ty->ty = get();
+  ty->align = get();
+  ty->size = get();
+  ty->ptr_to = get_type();
+  ty->array_size = get();
+  ty->tag = get_ident();
+
+  Field** tail = &ty->fields;
+  while (get()) {
+    Field* f = arena_alloc(ARENA_AST, sizeof(Field));
+    f->name = get_ident();
+    f->type = get_type();
+    f->offset = get();
+    *tail = f;
+    tail = &f->next;
+  }
+  return ty;
+}
+
+static Node* get_node(void);
+
+static Vector* get_nodes(void) {
+  long len = get();
+  if (len == 0) {
+    return NULL;
+  }
+  Vector* nodes = new_vec();
+  for (long i = 1; i < len; i++) {
+    vec_push(nodes, get_node());
+  }
+  return nodes;
+}
+
+static Node* get_node(void) {
+  long tag = get();
+  if (tag != PCH_NEW) {
+    return get_obj(tag);
+  }
+  Node* node = arena_alloc(ARENA_AST, sizeof(Node));
+  vec_push(objs, node);
+  node->tag = get();
+  node->token = get_token();
+  node->type = get_type();
+  node->lhs = get_node();
+  node->rhs = get_node();
+  node->integer = get();
+  node->stmts = get_nodes();
+  node->expr = get_node();
+  node->name = get_ident();
+  node->offset = get();
+  node->args = get_nodes();
+  node->cond = get_node();
+  node->then = get_node();
+  node->els = get_node();
+  node->init = get_node();
+  node->step = get_node();
+  node->body = get_node();
+  node->cases = get_nodes();
+  return node;
+}
+
+static Map* get_macros(void) {
+  Map* macros = new_map();
+  long count = get();
+  for (long i = 0; i < count; i++) {
+    MacroEnv* macro = arena_alloc(ARENA_AST, sizeof(MacroEnv));
+    macro->name = get_ident();
+
+    long num_params = get();
+    if (num_params) {
+      macro->params = new_vec();
+      for (long j = 1; j < num_params; j++) {
+        vec_push(macro->params, get_ident());
+      }
+    }
+
+    Token** tail = &macro->tokens;
+    while (get()) {
+      Token* t = get_token();
+      *tail = t;
+      tail = &t->next;
+    }
+    map_put(macros, macro->name, macro);
+  }
+  return macros;
+}
+
+static Map* get_env(bool is_type) {
+  Map* env = new_map();
+  long count = get();
+  for (long i = 0; i < count; i++) {
+    char* name = get_ident();
+    if (is_type) {
+      map_put(env, name, get_type());
+    } else {
+      map_put(env, name, get_node());
+    }
+  }
+  return env;
+}
+
+static ParserState* get_parser_state(void) {
+  ParserState* state = arena_alloc(ARENA_AST, sizeof(ParserState));
+  state->tag_env = get_env(true);
+  state->enum_env = get_env(false);
+  state->typedefs = get_env(true);
+
+  GVar** tail = &state->globals;
+  while (get()) {
+    GVar* gvar = arena_alloc(ARENA_AST, sizeof(GVar));
+    gvar->name = get_ident();
+    gvar->type = get_type();
+    gvar->init = get_node();
+    gvar->inits = get_nodes();
+    gvar->is_extern = get();
+    gvar->is_string = get();
+    *tail = gvar;
+    tail = &gvar->next;
+  }
+
+  state->funcs = new_vec();
+  long num_funcs = get();
+  for (long i = 0; i < num_funcs; i++) {
+    Function* func = arena_alloc(ARENA_AST, sizeof(Function));
+    func->name = get_ident();
+    func->ret_type = get_type();
+    func->body = get_node();
+    func->params = get_nodes();
+    func->local_size = get();
+    func->is_static = get();
+    func->has_va_arg = get();
+    vec_push(state->funcs, func);
+  }
+
+  state->str_count = get();
+  return state;
+}
+
+// pathのプリコンパイル済みヘッダを読み、以降のpreprocessとparseをその状態から始める
+void read_pch(char* path) {
+  in = (long*)read_file(path);
+  if (strncmp((char*)in, PCH_MAGIC, 8) != 0) {
+    error("%s: not a precompiled header\n", path);
+  }
+  pos = 1;
+  objs = new_vec();
+
+  char* header = get_ident();
+  preload_macros(get_macros(), header);
+  preload_parser_state(get_parser_state());
+}
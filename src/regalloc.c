@@ -1,5 +1,46 @@
 #include "hoc.h"
 
+// 線形走査によるレジスタ割り当て。
+// ブロック単位の生存解析で求めた穴のある生存区間にレジスタを割り当て、
+// 足りなければ区間ごとスタックのスロットにスピルする。
+// スピルした仮想レジスタの読み書きはgen_x86が命令の前後に挿入する。
+//
+// 命令にはブロックの並び順に番号nを振り、2nで読み、2n+1で書くものとする
+
+#define NOT_FREE 0
+#define ALWAYS_FREE 1000000000
+
+// 生存区間の一部。[from, to]で生きている
+typedef struct Range {
+  struct Range* next;
+  int from;
+  int to;
+} Range;
+
+// 仮想レジスタの生存区間。ループなどで穴があくのでRangeのリストで表す
+typedef struct Interval {
+  IReg* reg;
+  Range* ranges; // fromの昇順
+  int end;
+  bool crosses_call; // 関数呼び出しをまたいで生きる
+  struct Interval* next_start; // 同じ位置から始まる区間
+  struct Interval* merged_into; // 合併した先の区間。合併されていなければNULL
+  Vector* members; // 合併してきた区間の仮想レジスタ。同じレジスタかスロットを使う
+} Interval;
+
+static IFunc* func;
+static int nregs;
+static Interval** intervals; // 仮想レジスタの番号 -> Interval*
+static Vector** live_in;     // ブロックの番号 -> Vector(IReg*)
+static int* mark;            // 集合演算用の印。markerと同じ値なら印がついている
+static int marker;
+static int num_spills;
+static int spill_base; // スピル用のスロットはローカル変数の下に置く
+static int* block_from; // ブロックの最初の命令の位置
+static Vector* calls;   // 関数を呼び出すICALL。位置の昇順
+static int* call_pos;   // callsの位置
+static Vector* use_buf; // uses_ofの結果。生存解析の反復のたびに確保しないよう使い回す
+
 // Rewrite `A = B op C` to `A = B; A = A op C`.
 static void three_to_two(Block* block) {
   Vector* v = new_vec();
@@ -20,112 +61,616 @@ static void three_to_two(Block* block) {
   block->instrs = v;
 }
 
-static void set_last_use(IReg* reg, int last_use) {
-  if (reg && reg->last_use < last_use) {
-    reg->last_use = last_use;
+static Block* get_block(int i) {
+  return func->blocks->ptr[i];
+}
+
+static void new_marker(void) {
+  marker++;
+}
+
+static bool marked(IReg* reg) {
+  return mark[reg->id] == marker;
+}
+
+static void add_unmarked(Vector* set, IReg* reg) {
+  if (!marked(reg)) {
+    mark[reg->id] = marker;
+    vec_push(set, reg);
   }
 }
 
-static void set_def(IReg* reg, int def) {
-  if (reg && reg->def == 0) {
-    reg->def = def;
+// 後続ブロックの入口で生きているレジスタの和集合
+static Vector* live_out(int b) {
+  Vector* out = new_vec();
+  Vector* succs = get_block(b)->succs;
+
+  new_marker();
+  for (size_t i = 0; i < succs->length; i++) {
+    Block* succ = succs->ptr[i];
+    Vector* in = live_in[succ->id];
+    for (size_t j = 0; j < in->length; j++) {
+      add_unmarked(out, in->ptr[j]);
+    }
+  }
+  return out;
+}
+
+static void add_use(Vector* uses, IReg* reg) {
+  if (reg) {
+    vec_push(uses, reg);
   }
 }
 
-static bool collected(Vector* regs, IReg* reg) {
-  for (size_t i = 0; i < regs->length; i++) {
-    IReg* elem = regs->ptr[i];
-    if (reg->id == elem->id) {
+// 命令が読む仮想レジスタ。返すVectorは次の呼び出しで上書きされる
+static Vector* uses_of(IR* inst) {
+  use_buf->length = 0;
+  add_use(use_buf, inst->r1);
+  add_use(use_buf, inst->r2);
+  if (inst->args) {
+    for (size_t i = 0; i < inst->args->length; i++) {
+      add_use(use_buf, inst->args->ptr[i]);
+    }
+  }
+  return use_buf;
+}
+
+// live_in = ブロック内で定義より先に読むもの + (live_out - ブロック内で定義するもの)。
+// 大きくなったらtrueを返す
+static bool update_live_in(int b) {
+  Block* block = get_block(b);
+  Vector* out = live_out(b);
+  Vector* in = new_vec();
+
+  // 後ろから見て印をつけると、ブロック内で最初に読むか書くかがわかる
+  new_marker();
+  int used_first = marker;
+  new_marker();
+  int killed = marker;
+  for (size_t i = block->instrs->length; i > 0; i--) {
+    IR* inst = block->instrs->ptr[i - 1];
+    if (inst->r0) {
+      mark[inst->r0->id] = killed;
+    }
+    Vector* uses = uses_of(inst);
+    for (size_t j = 0; j < uses->length; j++) {
+      IReg* reg = uses->ptr[j];
+      mark[reg->id] = used_first;
+    }
+  }
+
+  Vector* upward = new_vec();
+  for (size_t i = 0; i < block->instrs->length; i++) {
+    IR* inst = block->instrs->ptr[i];
+    Vector* uses = uses_of(inst);
+    for (size_t j = 0; j < uses->length; j++) {
+      IReg* reg = uses->ptr[j];
+      if (mark[reg->id] == used_first) {
+        vec_push(upward, reg);
+      }
+    }
+  }
+  Vector* passed = new_vec();
+  for (size_t i = 0; i < out->length; i++) {
+    IReg* reg = out->ptr[i];
+    if (mark[reg->id] != killed && mark[reg->id] != used_first) {
+      vec_push(passed, reg);
+    }
+  }
+
+  new_marker();
+  for (size_t i = 0; i < upward->length; i++) {
+    add_unmarked(in, upward->ptr[i]);
+  }
+  for (size_t i = 0; i < passed->length; i++) {
+    add_unmarked(in, passed->ptr[i]);
+  }
+
+  bool changed = in->length > live_in[b]->length;
+  live_in[b] = in;
+  return changed;
+}
+
+static void compute_liveness(void) {
+  size_t n = func->blocks->length;
+  live_in = arena_alloc(ARENA_IR, sizeof(Vector*) * n);
+  for (size_t i = 0; i < n; i++) {
+    live_in[i] = new_vec();
+  }
+
+  // 後ろのブロックから伝播させると早く収束する
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = n; i > 0; i--) {
+      if (update_live_in(i - 1)) {
+        changed = true;
+      }
+    }
+  }
+}
+
+/* 生存区間 */
+
+static Interval* interval_of(IReg* reg) {
+  Interval* it = intervals[reg->id];
+  if (!it) {
+    it = arena_alloc(ARENA_IR, sizeof(Interval));
+    it->reg = reg;
+    it->end = -1;
+    it->members = new_vec();
+    intervals[reg->id] = it;
+  }
+  return it;
+}
+
+// 位置の大きい方から順に足していくので、先頭とつながるならまとめる
+static void add_range(IReg* reg, int from, int to) {
+  Interval* it = interval_of(reg);
+  if (it->ranges && it->ranges->from <= to + 1) {
+    if (from < it->ranges->from) {
+      it->ranges->from = from;
+    }
+    if (it->ranges->to < to) {
+      it->ranges->to = to;
+    }
+  } else {
+    Range* r = arena_alloc(ARENA_IR, sizeof(Range));
+    r->from = from;
+    r->to = to;
+    r->next = it->ranges;
+    it->ranges = r;
+  }
+  if (it->end < to) {
+    it->end = to;
+  }
+}
+
+// 定義した位置より前では生きていない
+static void add_def(IReg* reg, int pos) {
+  Interval* it = interval_of(reg);
+  if (it->ranges && it->ranges->from <= pos && pos <= it->ranges->to) {
+    it->ranges->from = pos;
+  } else {
+    add_range(reg, pos, pos);
+  }
+}
+
+// ブロックの命令を後ろから見て区間を延ばす
+static void build_block_intervals(int b, int from) {
+  Block* block = get_block(b);
+  if (block->instrs->length == 0) {
+    return;
+  }
+
+  int to = from + block->instrs->length * 2 - 1;
+  Vector* out = live_out(b);
+  for (size_t i = 0; i < out->length; i++) {
+    add_range(out->ptr[i], from, to);
+  }
+
+  for (size_t i = block->instrs->length; i > 0; i--) {
+    IR* inst = block->instrs->ptr[i - 1];
+    int pos = from + (i - 1) * 2;
+    if (inst->r0) {
+      add_def(inst->r0, pos + 1);
+    }
+    Vector* uses = uses_of(inst);
+    for (size_t j = 0; j < uses->length; j++) {
+      add_range(uses->ptr[j], from, pos);
+    }
+  }
+}
+
+static void build_intervals(void) {
+  for (size_t b = func->blocks->length; b > 0; b--) {
+    build_block_intervals(b - 1, block_from[b - 1]);
+  }
+}
+
+static bool covers(Interval* it, int pos) {
+  for (Range* r = it->ranges; r && r->from <= pos; r = r->next) {
+    if (pos <= r->to) {
       return true;
     }
   }
   return false;
 }
 
-static Vector* collect_regs(IFunc* func) {
-  int ic = 0;
-  Vector* regs = new_vec();
+// 2つの区間がともに生きている最初の位置。なければ-1
+static int next_intersection(Interval* a, Interval* b) {
+  Range* x = a->ranges;
+  Range* y = b->ranges;
+  while (x && y) {
+    if (x->to < y->from) {
+      x = x->next;
+    } else if (y->to < x->from) {
+      y = y->next;
+    } else if (x->from < y->from) {
+      return y->from;
+    } else {
+      return x->from;
+    }
+  }
+  return -1;
+}
+
+static void analyze(void) {
+  intervals = arena_alloc(ARENA_IR, sizeof(Interval*) * nregs);
+  compute_liveness();
+  build_intervals();
+}
 
-  for (int i = 0; i < func->blocks->length; i++) {
-    Block* block = func->blocks->ptr[i];
-    three_to_two(block);
+/* 移動命令の合併 */
 
-    for (int j = 0; j < block->instrs->length; j++, ic++) {
+static bool is_commutative(IR* inst) {
+  switch (inst->op) {
+  case IADD: case IMUL: case IAND: case IOR: case IXOR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// three_to_twoで作った`A = B; A = A op C`で、Bが命令の後も生きていてCが生きていなければ、
+// `A = C; A = A op B`に入れかえてAとCを合併できるようにする。入れかえたらtrueを返す
+static bool commute_operands(void) {
+  bool changed = false;
+  for (size_t i = 0; i < func->blocks->length; i++) {
+    Block* block = get_block(i);
+    for (size_t j = 1; j < block->instrs->length; j++) {
+      IR* mov = block->instrs->ptr[j - 1];
       IR* inst = block->instrs->ptr[j];
-      set_def(inst->r0, ic);
-      set_last_use(inst->r1, ic);
-      set_last_use(inst->r2, ic);
+      int def = block_from[i] + j * 2 + 1;
+      if (is_commutative(inst) && mov->op == IMOV && mov->r0 == inst->r0 && inst->r0 == inst->r1) {
+        IReg* b = mov->r1;
+        IReg* c = inst->r2;
+        if (b != c && b->size == c->size && covers(intervals[b->id], def) && !covers(intervals[c->id], def)) {
+          mov->r1 = c;
+          inst->r2 = b;
+          changed = true;
+        }
+      }
+    }
+  }
+  return changed;
+}
 
-      if (inst->args) {
-        for (size_t i = 0; i < inst->args->length; i++) {
-          set_last_use(inst->args->ptr[i], ic);
+static Interval* leader(Interval* it) {
+  while (it->merged_into) {
+    it = it->merged_into;
+  }
+  return it;
+}
+
+static void append_range(Range** head, Range** tail, Range* r) {
+  if (*tail && r->from <= (*tail)->to + 1) {
+    if ((*tail)->to < r->to) {
+      (*tail)->to = r->to;
+    }
+    return;
+  }
+  Range* new = arena_alloc(ARENA_IR, sizeof(Range));
+  new->from = r->from;
+  new->to = r->to;
+  if (*tail) {
+    (*tail)->next = new;
+  } else {
+    *head = new;
+  }
+  *tail = new;
+}
+
+// bの区間をaに合わせる
+static void merge_interval(Interval* a, Interval* b) {
+  Range* head = NULL;
+  Range* tail = NULL;
+  Range* x = a->ranges;
+  Range* y = b->ranges;
+  while (x || y) {
+    if (!y || (x && x->from < y->from)) {
+      append_range(&head, &tail, x);
+      x = x->next;
+    } else {
+      append_range(&head, &tail, y);
+      y = y->next;
+    }
+  }
+  a->ranges = head;
+  if (a->end < b->end) {
+    a->end = b->end;
+  }
+  b->merged_into = a;
+  vec_push(a->members, b->reg);
+  for (size_t i = 0; i < b->members->length; i++) {
+    vec_push(a->members, b->members->ptr[i]);
+  }
+}
+
+// `A = B`のAとBの区間が重ならなければ1つの区間にまとめて、同じレジスタを割り当てる。
+// Bの方が大きければ上位を切り捨てるmovが要るのでまとめない
+static void coalesce_moves(void) {
+  for (size_t i = 0; i < func->blocks->length; i++) {
+    Block* block = get_block(i);
+    for (size_t j = 0; j < block->instrs->length; j++) {
+      IR* inst = block->instrs->ptr[j];
+      if (inst->op == IMOV && inst->r0->size >= inst->r1->size) {
+        Interval* a = leader(intervals[inst->r0->id]);
+        Interval* b = leader(intervals[inst->r1->id]);
+        if (a != b && next_intersection(a, b) < 0) {
+          merge_interval(a, b);
         }
       }
+    }
+  }
+}
 
-      if (inst->r0 && !collected(regs, inst->r0)) {
-        vec_push(regs, inst->r0);
+static int count_removed_moves(void) {
+  int n = 0;
+  for (size_t i = 0; i < func->blocks->length; i++) {
+    Block* block = get_block(i);
+    for (size_t j = 0; j < block->instrs->length; j++) {
+      IR* inst = block->instrs->ptr[j];
+      if (inst->op == IMOV && !inst->r0->spill && !inst->r1->spill && inst->r0->real_reg == inst->r1->real_reg) {
+        n++;
       }
     }
   }
+  return n;
+}
+
+/* 関数呼び出し */
+
+static bool is_call(IR* inst) {
+  return inst->op == ICALL && !streq(inst->func_name, "__hoc_builtin_va_start");
+}
+
+// pos以降で最初の呼び出しの番号。なければcalls->length
+static int call_at_or_after(int pos) {
+  int lo = 0;
+  int hi = calls->length;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (call_pos[mid] < pos) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
 
-  return regs;
+// 呼び出しの引数を読む位置と結果を書く位置の両方で生きていれば、呼び出しをまたぐ
+static bool crosses_call(Interval* it) {
+  for (Range* r = it->ranges; r; r = r->next) {
+    int i = call_at_or_after(r->from);
+    if (i < calls->length && call_pos[i] + 1 <= r->to) {
+      return true;
+    }
+  }
+  return false;
 }
 
-static int choose_to_spill(IReg **used) {
-  int k = 0;
-  for (int i = 1; i < NUM_REGS; i++) {
-    if (used[k]->last_use < used[i]->last_use) {
-      k = i;
+// 呼び出し元保存のレジスタに割り当てた区間が呼び出しをまたぐなら、その呼び出しの前後で保存する
+static void mark_saved_around_calls(Interval* it) {
+  for (Range* r = it->ranges; r; r = r->next) {
+    for (int i = call_at_or_after(r->from); i < calls->length && call_pos[i] + 1 <= r->to; i++) {
+      IR* call = calls->ptr[i];
+      vec_push(call->save_regs, (void*)(long)it->reg->real_reg);
     }
   }
-  return k;
+}
 
+/* 線形走査 */
+
+static void spill(IReg* reg) {
+  reg->spill = true;
+  num_spills++;
+  reg->spill_offset = spill_base + num_spills * 8;
 }
 
-void scan(Vector* regs) {
-  IReg** used = calloc(NUM_REGS, sizeof(IReg*));
+// 終わった区間は捨て、残りはposで生きているかどうかで分ける
+static void classify(Interval* it, int pos, Vector* active, Vector* inactive) {
+  if (it->end < pos) {
+    return;
+  }
+  if (covers(it, pos)) {
+    vec_push(active, it);
+  } else {
+    vec_push(inactive, it);
+  }
+}
 
-  for (int i = 0; i < regs->length; i++) {
-    IReg* reg = regs->ptr[i];
-    bool found = false;
+static void scan(Interval** starts, int npos) {
+  Vector* active = new_vec();   // 今の位置で生きている割り当て済みの区間
+  Vector* inactive = new_vec(); // 穴の中にいる割り当て済みの区間
+  int* free_until = arena_alloc(ARENA_IR, sizeof(int) * NUM_REGS);
+  int* inactive_until = arena_alloc(ARENA_IR, sizeof(int) * NUM_REGS);
 
-    for (int i = 0; i < NUM_REGS - 1; i++) {
-      if (!(used[i] && reg->def < used[i]->last_use)) {
-        assert(i < NUM_REGS);
-        reg->real_reg = i;
-        used[i] = reg;
-        found = true;
-        break;
+  for (int pos = 0; pos < npos; pos++) {
+    for (Interval* cur = starts[pos]; cur; cur = cur->next_start) {
+      Vector* next_active = new_vec();
+      Vector* next_inactive = new_vec();
+      for (size_t i = 0; i < active->length; i++) {
+        classify(active->ptr[i], pos, next_active, next_inactive);
+      }
+      for (size_t i = 0; i < inactive->length; i++) {
+        classify(inactive->ptr[i], pos, next_active, next_inactive);
+      }
+      active = next_active;
+      inactive = next_inactive;
+
+      for (int r = 0; r < NUM_REGS; r++) {
+        inactive_until[r] = ALWAYS_FREE;
+      }
+      for (size_t i = 0; i < inactive->length; i++) {
+        Interval* it = inactive->ptr[i];
+        int x = next_intersection(it, cur);
+        if (x >= 0 && x < inactive_until[it->reg->real_reg]) {
+          inactive_until[it->reg->real_reg] = x;
+        }
+      }
+      for (int r = 0; r < NUM_REGS; r++) {
+        free_until[r] = inactive_until[r];
+      }
+      for (size_t i = 0; i < active->length; i++) {
+        Interval* it = active->ptr[i];
+        free_until[it->reg->real_reg] = NOT_FREE;
       }
-    }
 
-    if (!found) {
-      used[NUM_REGS - 1] = reg;
-      int k = choose_to_spill(used);
-      reg->real_reg = k;
-      used[k]->real_reg = NUM_REGS - 1;
-      used[k]->spill = true;
-      used[k] = reg;
-      error("error: register allocation %s\n", show_ireg(reg));
+      // 呼び出しをまたぐ区間は呼び出し先保存のレジスタを、それ以外は呼び出し元保存のレジスタを優先する。
+      // 呼び出し先保存のレジスタは関数の入口と出口で1回ずつ保存すればよい
+      int best = -1;
+      for (int i = 0; i < NUM_REGS; i++) {
+        int r = (i + NUM_CALLER_SAVED) % NUM_REGS;
+        if (!cur->crosses_call) {
+          r = i;
+        }
+        if (best < 0 && free_until[r] > cur->end) {
+          best = r;
+        }
+      }
+      if (best >= 0) {
+        cur->reg->real_reg = best;
+        vec_push(active, cur);
+      } else {
+        // 最も遠くまで生きる区間をスピルする
+        int victim = -1;
+        for (size_t i = 0; i < active->length; i++) {
+          Interval* it = active->ptr[i];
+          if (inactive_until[it->reg->real_reg] > cur->end && it->end > cur->end &&
+              (victim < 0 || ((Interval*)active->ptr[victim])->end < it->end)) {
+            victim = i;
+          }
+        }
+
+        if (victim < 0) {
+          spill(cur->reg);
+        } else {
+          Interval* it = active->ptr[victim];
+          spill(it->reg);
+          cur->reg->real_reg = it->reg->real_reg;
+          active->ptr[victim] = cur;
+        }
+      }
     }
   }
 }
 
-void alloc_regs(IProgram* prog) {
-  for (int i = 0; i < prog->ifuncs->length; i++) {
-    IFunc* func = prog->ifuncs->ptr[i];
-    if (func->blocks) {
-      Vector* regs = collect_regs(func);
-      scan(regs);
+void alloc_func_regs(IFunc* f) {
+  if (!f->blocks) {
+    return;
+  }
+
+  // 変数を仮想レジスタに昇格してから割り当てる
+  build_ssa(f);
+  leave_ssa(f);
+
+  func = f;
+  num_spills = 0;
+  nregs = 0;
+  calls = new_vec();
+  use_buf = new_vec();
+  block_from = arena_alloc(ARENA_IR, sizeof(int) * func->blocks->length);
+  int npos = 0;
+
+  for (size_t i = 0; i < func->blocks->length; i++) {
+    three_to_two(get_block(i));
+  }
+  build_cfg(func);
+
+  for (size_t i = 0; i < func->blocks->length; i++) {
+    Block* block = get_block(i);
+    block_from[i] = npos;
+    npos += block->instrs->length * 2;
+
+    for (size_t j = 0; j < block->instrs->length; j++) {
+      IR* inst = block->instrs->ptr[j];
+      if (is_call(inst)) {
+        inst->save_regs = new_vec();
+        vec_push(calls, inst);
+      }
+      if (inst->r0 && nregs <= inst->r0->id) {
+        nregs = inst->r0->id + 1;
+      }
+      Vector* uses = uses_of(inst);
+      for (size_t k = 0; k < uses->length; k++) {
+        IReg* reg = uses->ptr[k];
+        if (nregs <= reg->id) {
+          nregs = reg->id + 1;
+        }
+      }
+    }
+  }
 
-      for (int i = 0; i < regs->length; i++) {
-        eprintf("%s ", show_ireg(regs->ptr[i]));
+  call_pos = arena_alloc(ARENA_IR, sizeof(int) * (calls->length + 1));
+  int n = 0;
+  for (size_t i = 0; i < func->blocks->length; i++) {
+    Block* block = get_block(i);
+    for (size_t j = 0; j < block->instrs->length; j++) {
+      if (is_call(block->instrs->ptr[j])) {
+        call_pos[n] = block_from[i] + j * 2;
+        n++;
       }
-      eprintf("\n");
-    } 
+    }
+  }
 
-    // TODO: Reserve stack area to spilled register
+  mark = arena_alloc(ARENA_IR, sizeof(int) * nregs);
+  marker = 0;
+  analyze();
+  if (commute_operands()) {
+    analyze();
+  }
+  coalesce_moves();
 
-    // TODO: Convert accesses to spilled registers to load and stores
+  Interval** starts = arena_alloc(ARENA_IR, sizeof(Interval*) * (npos + 1));
+  for (int i = nregs; i > 0; i--) {
+    Interval* it = intervals[i - 1];
+    if (it && !it->merged_into) {
+      it->crosses_call = crosses_call(it);
+      it->next_start = starts[it->ranges->from];
+      starts[it->ranges->from] = it;
+    }
+  }
+  int locals = count_stack_size(func);
+  spill_base = roundup(locals, 8);
+  if (func->has_va_arg) {
+    spill_base += REGAREA_SIZE;
+  }
+  scan(starts, npos);
+
+  func->callee_saved = new_vec();
+  bool* used = arena_alloc(ARENA_IR, sizeof(bool) * NUM_REGS);
+  for (int i = 0; i < nregs; i++) {
+    Interval* it = intervals[i];
+    if (it && !it->merged_into) {
+      for (size_t j = 0; j < it->members->length; j++) {
+        IReg* reg = it->members->ptr[j];
+        reg->real_reg = it->reg->real_reg;
+        reg->spill = it->reg->spill;
+        reg->spill_offset = it->reg->spill_offset;
+      }
+    }
+    if (it && !it->merged_into && !it->reg->spill) {
+      used[it->reg->real_reg] = true;
+      if (it->reg->real_reg < NUM_CALLER_SAVED) {
+        mark_saved_around_calls(it);
+      }
+    }
+  }
+  for (int r = NUM_CALLER_SAVED; r < NUM_REGS; r++) {
+    if (used[r]) {
+      vec_push(func->callee_saved, (void*)(long)r);
+    }
+  }
+
+  func->spill_size = roundup(locals, 8) - locals + num_spills * 8;
+  func->num_spills = num_spills;
+  func->num_moves_removed = count_removed_moves();
+}
+
+void alloc_regs(IProgram* prog) {
+  for (int i = 0; i < prog->ifuncs->length; i++) {
+    alloc_func_regs(prog->ifuncs->ptr[i]);
   }
 }
@@ -1,6 +1,6 @@
 #include "hoc.h"
 
-static Vector* funcs; // Vector(Function*)
+static Map* funcs; // Map(char*, Function*)
 static Vector* switches; // Vector(Node*(NSWITCH))
 static int case_label_id;
 
@@ -10,6 +10,86 @@ static char* case_label(void) {
   return label;
 }
 
+// caseの値は定数でなければならない。enumの定数と文字はparseでNINTになっている
+static int case_value(Node* node) {
+  switch (node->tag) {
+  case NINT:
+    return node->integer;
+  case NADD:
+    return case_value(node->lhs) + case_value(node->rhs);
+  case NSUB:
+    return case_value(node->lhs) - case_value(node->rhs);
+  case NMUL:
+    return case_value(node->lhs) * case_value(node->rhs);
+  case NCAST:
+    return case_value(node->expr);
+  default:
+    bad_token(node->token, "case label must be an integer constant");
+  }
+  return 0;
+}
+
+// 値の小さい順に並んだvに挿入する。同じ値のcaseがあればエラー
+static void insert_case(Vector* v, Node* clause) {
+  vec_push(v, clause);
+  size_t j = v->length - 1;
+  while (j > 0 && ((Node*)v->ptr[j - 1])->integer >= clause->integer) {
+    Node* prev = v->ptr[j - 1];
+    if (prev->integer == clause->integer) {
+      bad_token(clause->token, "duplicate case value");
+    }
+    v->ptr[j] = prev;
+    j--;
+  }
+  v->ptr[j] = clause;
+}
+
+// casesをcaseの値の小さい順に並べ、defaultを最後に置く
+static void sort_cases(Node* sw) {
+  Vector* v = new_vec();
+  Node* default_clause = NULL;
+  for (size_t i = 0; i < sw->cases->length; i++) {
+    Node* clause = sw->cases->ptr[i];
+    if (clause->tag == NDEFAULT) {
+      if (default_clause) {
+        bad_token(clause->token, "multiple default labels in one switch");
+      }
+      default_clause = clause;
+    } else {
+      insert_case(v, clause);
+    }
+  }
+  if (default_clause) {
+    vec_push(v, default_clause);
+  }
+  sw->cases = v;
+}
+
+// defaultを除いたcaseの数
+size_t num_case_values(Node* sw) {
+  size_t n = sw->cases->length;
+  if (n > 0 && ((Node*)vec_last(sw->cases))->tag == NDEFAULT) {
+    n--;
+  }
+  return n;
+}
+
+// 並べたcasesのlo番目からhi番目の手前までを、どう分岐して探すか決める。
+// 数個なら順に比べ、値が密に並んでいればジャンプテーブルを引き、疎らなら真ん中の値で二分する
+enum SwitchLowering switch_lowering(Vector* cases, size_t lo, size_t hi) {
+  int n = hi - lo;
+  if (n <= SWITCH_LINEAR_MAX) {
+    return SW_LINEAR;
+  }
+  Node* first = cases->ptr[lo];
+  Node* last = cases->ptr[hi - 1];
+  int span = last->integer - first->integer; // 桁あふれすると負になる
+  if (span >= 0 && span < SWITCH_TABLE_DENSITY * n) {
+    return SW_TABLE;
+  }
+  return SW_SPLIT;
+}
+
 static void type_error(Type* expected, Node* node) {
   bad_token(node->token, format("expected %s, but got %s\n", show_type(expected), show_type(type_of(node))));
 }
@@ -25,7 +105,15 @@ void sema(Program* prog) {
     }
   }
 
-  funcs = prog->funcs;
+  funcs = new_map();
+  for (size_t i = 0; i < prog->funcs->length; i++) {
+    Function* fn = prog->funcs->ptr[i];
+    // 最初の宣言の返り値型を使う
+    if (!map_get(funcs, fn->name)) {
+      map_put(funcs, fn->name, fn);
+    }
+  }
+
   switches = new_vec();
   for (size_t i = 0; i < prog->funcs->length; i++) {
     Function* fn = prog->funcs->ptr[i];
@@ -35,11 +123,9 @@ void sema(Program* prog) {
 }
 
 static Type* ret_type(char* name) {
-  for (size_t i = 0; i < funcs->length; i++) {
-    Function* fn = funcs->ptr[i];
-    if (streq(name, fn->name)) {
-      return fn->ret_type;
-    }
+  Function* fn = map_get(funcs, name);
+  if (fn) {
+    return fn->ret_type;
   }
   eprintf("undefined function %s\n", name);
   return int_type();
@@ -428,11 +514,14 @@ void walk(Node* node) {
     node->cases = new_vec();
     vec_push(switches, node);
     walk(node->body);
+    vec_pop(switches);
+    sort_cases(node);
     node->type = NULL;
     break;
   }
   case NCASE: {
     walk(node->expr);
+    node->integer = case_value(node->expr);
     walk(node->body);
     node->type = NULL;
 
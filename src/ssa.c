@@ -0,0 +1,486 @@
+#include "hoc.h"
+
+// ローカル変数のSSA化(mem2reg)。
+// アドレスを取られないint、long、ポインタの変数と引数を仮想レジスタに昇格する。
+// 支配辺境にphiを置き、支配木をたどりながらILOAD/ISTOREを値の受け渡しに置きかえる。
+// leave_ssaでphiを前のブロックでのIMOVに戻してからレジスタ割り当てに渡す
+
+typedef struct Var {
+  size_t size;
+  bool promotable;
+  Vector* def_blocks; // 値を書くブロックの番号
+  Vector* stack;      // 名前の付け替えの途中での今の値(IReg*)
+  IReg* undef;        // 書く前に読んだときの値
+} Var;
+
+static IFunc* func;
+static int nblocks;
+static Var** vars;        // スタック上の位置 -> Var*
+static Var** addr_var;    // 仮想レジスタの番号 -> IADDRESSで得たアドレスが指す変数
+
+static IReg* new_reg(size_t size) {
+  IReg* reg = arena_alloc(ARENA_IR, sizeof(IReg));
+  reg->id = func->num_regs;
+  reg->size = size;
+  func->num_regs++;
+  return reg;
+}
+
+static Block* get_block(int i) {
+  return func->blocks->ptr[i];
+}
+
+/* 昇格する変数を探す */
+
+static void set_access_size(Var* var, size_t size) {
+  if (var->size == 0) {
+    var->size = size;
+  } else if (var->size != size) {
+    var->promotable = false;
+  }
+}
+
+// アドレスをILOAD、ISTORE、ISTOREARGのアドレスとしてしか使わない変数を昇格する
+static void check_use(IR* inst, IReg* reg, int b) {
+  if (!reg || !addr_var[reg->id]) {
+    return;
+  }
+
+  Var* var = addr_var[reg->id];
+  if (inst->op == ILOAD && inst->r1 == reg) {
+    set_access_size(var, inst->r0->size);
+  } else if (inst->op == ISTORE && inst->r1 == reg && inst->r2 != reg) {
+    set_access_size(var, inst->r2->size);
+    vec_push(var->def_blocks, (void*)(long)b);
+  } else if (inst->op == ISTOREARG && inst->r1 == reg) {
+    set_access_size(var, inst->size);
+    vec_push(var->def_blocks, (void*)(long)b);
+  } else {
+    var->promotable = false;
+  }
+}
+
+static bool find_vars(void) {
+  int nvars = count_stack_size(func) + 1;
+  vars = arena_alloc(ARENA_IR, sizeof(Var*) * nvars);
+  addr_var = arena_alloc(ARENA_IR, sizeof(Var*) * func->num_regs);
+
+  for (int i = 0; i < nblocks; i++) {
+    Block* block = get_block(i);
+    for (size_t j = 0; j < block->instrs->length; j++) {
+      IR* inst = block->instrs->ptr[j];
+      if (inst->op == IADDRESS) {
+        Var* var = vars[inst->imm_int];
+        if (!var) {
+          var = arena_alloc(ARENA_IR, sizeof(Var));
+          var->promotable = true;
+          var->def_blocks = new_vec();
+          var->stack = new_vec();
+          vars[inst->imm_int] = var;
+        }
+        addr_var[inst->r0->id] = var;
+      }
+    }
+  }
+
+  for (int i = 0; i < nblocks; i++) {
+    Block* block = get_block(i);
+    for (size_t j = 0; j < block->instrs->length; j++) {
+      IR* inst = block->instrs->ptr[j];
+      check_use(inst, inst->r1, i);
+      if (inst->r2 != inst->r1) {
+        check_use(inst, inst->r2, i);
+      }
+      if (inst->args) {
+        for (size_t k = 0; k < inst->args->length; k++) {
+          check_use(inst, inst->args->ptr[k], i);
+        }
+      }
+    }
+  }
+
+  // charは読むときに符号拡張するので、メモリを通さないと値が変わる
+  bool found = false;
+  for (int i = 0; i < nvars; i++) {
+    Var* var = vars[i];
+    if (var && var->size != 4 && var->size != 8) {
+      var->promotable = false;
+    }
+    if (var && var->promotable) {
+      found = true;
+    }
+  }
+  return found;
+}
+
+static Var* promoted(IReg* addr) {
+  if (addr && addr_var[addr->id] && addr_var[addr->id]->promotable) {
+    return addr_var[addr->id];
+  }
+  return NULL;
+}
+
+/* phiの配置 */
+
+static void insert_phi(int b, Var* var, int var_index) {
+  Block* block = get_block(b);
+  IR* phi = new_ir(IPHI);
+  phi->r0 = new_reg(var->size);
+  phi->imm_int = var_index;
+  phi->args = new_vec();
+  phi->phi_preds = new_vec();
+  for (size_t i = 0; i < block->preds->length; i++) {
+    vec_push(phi->args, NULL);
+    vec_push(phi->phi_preds, block->preds->ptr[i]);
+  }
+
+  Vector* v = new_vec();
+  vec_push(v, phi);
+  for (size_t i = 0; i < block->instrs->length; i++) {
+    vec_push(v, block->instrs->ptr[i]);
+  }
+  block->instrs = v;
+}
+
+static void place_phis(void) {
+  int nvars = count_stack_size(func) + 1;
+  int* has_phi = arena_alloc(ARENA_IR, sizeof(int) * nblocks); // 変数の番号+1
+  int* queued = arena_alloc(ARENA_IR, sizeof(int) * nblocks);
+
+  for (int v = 0; v < nvars; v++) {
+    Var* var = vars[v];
+    if (var && var->promotable) {
+      Vector* work = new_vec();
+      for (size_t i = 0; i < var->def_blocks->length; i++) {
+        int b = (long)var->def_blocks->ptr[i];
+        if (queued[b] != v + 1) {
+          queued[b] = v + 1;
+          vec_push(work, (void*)(long)b);
+        }
+      }
+
+      for (size_t i = 0; i < work->length; i++) {
+        Vector* df = get_block((long)work->ptr[i])->frontier;
+        for (size_t j = 0; j < df->length; j++) {
+          int d = ((Block*)df->ptr[j])->id;
+          if (has_phi[d] != v + 1) {
+            has_phi[d] = v + 1;
+            insert_phi(d, var, v);
+            if (queued[d] != v + 1) {
+              queued[d] = v + 1;
+              vec_push(work, (void*)(long)d);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/* 名前の付け替え */
+
+static IReg* current(Var* var) {
+  if (var->stack->length > 0) {
+    return var->stack->ptr[var->stack->length - 1];
+  }
+  if (!var->undef) {
+    var->undef = new_reg(var->size);
+  }
+  return var->undef;
+}
+
+static void rename_block(int b) {
+  Block* block = get_block(b);
+  Vector* pushed = new_vec(); // Var*
+  Vector* v = new_vec();
+
+  for (size_t i = 0; i < block->instrs->length; i++) {
+    IR* inst = block->instrs->ptr[i];
+    Var* var = NULL;
+    if (inst->op == IPHI) {
+      var = vars[inst->imm_int];
+      vec_push(var->stack, inst->r0);
+      vec_push(pushed, var);
+      vec_push(v, inst);
+    } else if (inst->op == IADDRESS && promoted(inst->r0)) {
+      // 使わなくなる
+    } else if (inst->op == ILOAD && promoted(inst->r1)) {
+      var = promoted(inst->r1);
+      inst->op = IMOV;
+      inst->r1 = current(var);
+      vec_push(v, inst);
+    } else if (inst->op == ISTORE && promoted(inst->r1)) {
+      var = promoted(inst->r1);
+      vec_push(var->stack, inst->r2);
+      vec_push(pushed, var);
+    } else if (inst->op == ISTOREARG && promoted(inst->r1)) {
+      var = promoted(inst->r1);
+      inst->op = IARG;
+      inst->r0 = new_reg(var->size);
+      inst->r1 = NULL;
+      vec_push(var->stack, inst->r0);
+      vec_push(pushed, var);
+      vec_push(v, inst);
+    } else {
+      vec_push(v, inst);
+    }
+  }
+  block->instrs = v;
+
+  for (size_t i = 0; i < block->succs->length; i++) {
+    Block* succ = block->succs->ptr[i];
+    for (size_t j = 0; j < succ->instrs->length && ((IR*)succ->instrs->ptr[j])->op == IPHI; j++) {
+      IR* phi = succ->instrs->ptr[j];
+      for (size_t k = 0; k < phi->phi_preds->length; k++) {
+        if (phi->phi_preds->ptr[k] == block) {
+          phi->args->ptr[k] = current(vars[phi->imm_int]);
+        }
+      }
+    }
+  }
+
+  for (size_t i = 0; i < block->dom_children->length; i++) {
+    Block* child = block->dom_children->ptr[i];
+    rename_block(child->id);
+  }
+
+  for (size_t i = 0; i < pushed->length; i++) {
+    Var* var = pushed->ptr[i];
+    var->stack->length--;
+  }
+}
+
+/* 使わないphiを消す */
+
+static bool* live; // 仮想レジスタの番号 -> phi以外の命令から使われるか
+
+static void mark_live(IReg* reg, Vector* worklist) {
+  if (reg && !live[reg->id]) {
+    live[reg->id] = true;
+    vec_push(worklist, reg);
+  }
+}
+
+// phi以外の命令が使う値から、phiの引数をたどって使われるphiに印をつける。
+// ループの先頭のphi同士で使い合っているだけのものは消える
+static void remove_dead_phis(void) {
+  live = arena_alloc(ARENA_IR, sizeof(bool) * func->num_regs);
+  IR** phi_of = arena_alloc(ARENA_IR, sizeof(IR*) * func->num_regs);
+  Vector* worklist = new_vec();
+
+  for (int i = 0; i < nblocks; i++) {
+    Block* block = get_block(i);
+    for (size_t j = 0; j < block->instrs->length; j++) {
+      IR* inst = block->instrs->ptr[j];
+      if (inst->op == IPHI) {
+        phi_of[inst->r0->id] = inst;
+      } else {
+        mark_live(inst->r1, worklist);
+        mark_live(inst->r2, worklist);
+        if (inst->args) {
+          for (size_t k = 0; k < inst->args->length; k++) {
+            mark_live(inst->args->ptr[k], worklist);
+          }
+        }
+      }
+    }
+  }
+
+  while (worklist->length > 0) {
+    IReg* reg = vec_pop(worklist);
+    IR* phi = phi_of[reg->id];
+    if (phi) {
+      for (size_t k = 0; k < phi->args->length; k++) {
+        mark_live(phi->args->ptr[k], worklist);
+      }
+    }
+  }
+
+  for (int i = 0; i < nblocks; i++) {
+    Block* block = get_block(i);
+    Vector* v = new_vec();
+    for (size_t j = 0; j < block->instrs->length; j++) {
+      IR* inst = block->instrs->ptr[j];
+      if (inst->op != IPHI || live[inst->r0->id]) {
+        vec_push(v, inst);
+      }
+    }
+    block->instrs = v;
+  }
+}
+
+// 値を書く前に読む変数は関数の入口で0にしておく。到達しないブロックから来るphiの引数も同じ
+static void define_undefs(void) {
+  for (int i = 0; i < nblocks; i++) {
+    Block* block = get_block(i);
+    for (size_t j = 0; j < block->instrs->length && ((IR*)block->instrs->ptr[j])->op == IPHI; j++) {
+      IR* phi = block->instrs->ptr[j];
+      for (size_t k = 0; k < phi->args->length; k++) {
+        if (!phi->args->ptr[k]) {
+          IReg* undef = current(vars[phi->imm_int]);
+          phi->args->ptr[k] = undef;
+          live[undef->id] = true;
+        }
+      }
+    }
+  }
+
+  int nvars = count_stack_size(func) + 1;
+  Block* entry = get_block(0);
+  Vector* v = new_vec();
+  for (int i = 0; i < nvars; i++) {
+    Var* var = vars[i];
+    if (var && var->undef && live[var->undef->id]) {
+      IR* inst = new_ir(IIMM);
+      inst->r0 = var->undef;
+      vec_push(v, inst);
+    }
+  }
+  for (size_t i = 0; i < entry->instrs->length; i++) {
+    vec_push(v, entry->instrs->ptr[i]);
+  }
+  entry->instrs = v;
+}
+
+void build_ssa(IFunc* f) {
+  if (!f->blocks) {
+    return;
+  }
+
+  func = f;
+  nblocks = func->blocks->length;
+  build_cfg(func);
+  if (!find_vars()) {
+    return;
+  }
+  compute_dominators(func);
+  place_phis();
+  rename_block(0);
+  remove_dead_phis();
+  define_undefs();
+}
+
+/* SSAから戻す */
+
+static bool has_phi(Block* block) {
+  return block->instrs->length > 0 && ((IR*)block->instrs->ptr[0])->op == IPHI;
+}
+
+static IR* move(IReg* dst, IReg* src) {
+  IR* inst = new_ir(IMOV);
+  inst->r0 = dst;
+  inst->r1 = src;
+  return inst;
+}
+
+static void retarget(IR* br, Block* from, Block* to) {
+  if (br->then == from) {
+    br->then = to;
+  }
+  if (br->els == from) {
+    br->els = to;
+  }
+  if (br->op == ISWITCH) {
+    for (size_t i = 0; i < br->table->length; i++) {
+      if (br->table->ptr[i] == from) {
+        br->table->ptr[i] = to;
+      }
+    }
+  }
+}
+
+// predから来たときのphiの値をtempsに移すmovを置く
+static void copy_phi_args(Block* block, Vector* phis, Vector* temps, Block* pred) {
+  Vector* copies = new_vec();
+  for (size_t i = 0; i < phis->length; i++) {
+    IR* phi = phis->ptr[i];
+    for (size_t k = 0; k < phi->phi_preds->length; k++) {
+      if (phi->phi_preds->ptr[k] == pred) {
+        vec_push(copies, move(temps->ptr[i], phi->args->ptr[k]));
+        break;
+      }
+    }
+  }
+
+  // 分岐の辺にはmovを置く場所がないので、辺を分けるブロックを関数の最後に足す
+  IR* last = terminator(pred);
+  if (last->op == IBR || last->op == ISWITCH) {
+    Block* split = new_block("split");
+    split->instrs = copies;
+    IR* jmp = new_ir(IJMP);
+    jmp->jump_to = block;
+    vec_push(split->instrs, jmp);
+    append_block(func, split);
+    retarget(last, block, split);
+    return;
+  }
+
+  Vector* v = new_vec();
+  for (size_t i = 0; i + 1 < pred->instrs->length; i++) {
+    vec_push(v, pred->instrs->ptr[i]);
+  }
+  for (size_t j = 0; j < copies->length; j++) {
+    vec_push(v, copies->ptr[j]);
+  }
+  vec_push(v, last);
+  pred->instrs = v;
+}
+
+// phiごとに一時レジスタを用意し、前のブロックの終わりで一時レジスタに移してから
+// ブロックの頭でphiの結果に移す。phiどうしで値を入れかえる場合もこれで正しく動く
+static void remove_phis(Block* block) {
+  Vector* phis = new_vec();
+  Vector* temps = new_vec();
+  for (size_t i = 0; i < block->instrs->length; i++) {
+    IR* inst = block->instrs->ptr[i];
+    if (inst->op == IPHI) {
+      vec_push(phis, inst);
+      vec_push(temps, new_reg(inst->r0->size));
+    }
+  }
+
+  IR* first = phis->ptr[0];
+  Vector* done = new_vec();
+  for (size_t k = 0; k < first->phi_preds->length; k++) {
+    Block* pred = first->phi_preds->ptr[k];
+    bool seen = false;
+    for (size_t j = 0; j < done->length; j++) {
+      if (done->ptr[j] == pred) {
+        seen = true;
+      }
+    }
+    if (!seen) {
+      vec_push(done, pred);
+      copy_phi_args(block, phis, temps, pred);
+    }
+  }
+
+  Vector* v = new_vec();
+  for (size_t i = 0; i < phis->length; i++) {
+    IR* phi = phis->ptr[i];
+    vec_push(v, move(phi->r0, temps->ptr[i]));
+  }
+  // 自分への辺では、このブロックにもmovが足されている
+  for (size_t i = 0; i < block->instrs->length; i++) {
+    IR* inst = block->instrs->ptr[i];
+    if (inst->op != IPHI) {
+      vec_push(v, inst);
+    }
+  }
+  block->instrs = v;
+}
+
+void leave_ssa(IFunc* f) {
+  if (!f->blocks) {
+    return;
+  }
+
+  func = f;
+  size_t n = func->blocks->length;
+  for (size_t i = 0; i < n; i++) {
+    Block* block = get_block(i);
+    if (has_phi(block)) {
+      remove_phis(block);
+    }
+  }
+}
@@ -7,6 +7,9 @@ static char* cur;
 // 行頭か否か
 static bool bol = 1;
 
+// トークンを確保するアリーナ
+static int token_arena = ARENA_TOKEN;
+
 static void print_line(char* start, char* pos) {
   size_t line = 0;
   size_t column = 0;
@@ -51,7 +54,7 @@ void bad_token(Token* tok, char* msg) {
 }
 
 static Token* new_token(enum TokenTag tag, char* start) {
-  Token* t = calloc(1, sizeof(Token));
+  Token* t = arena_alloc(token_arena, sizeof(Token));
   t->tag = tag;
   t->source = src;
   t->start = start;
@@ -59,14 +62,56 @@ static Token* new_token(enum TokenTag tag, char* start) {
   return t;
 }
 
-static char* read_file(FILE* file) {
-  StringBuilder* sb = new_sb();
+// パイプなどmmapできない入力を読み込む
+char* read_fd(int fd) {
+  size_t capacity = 4096;
+  size_t length = 0;
+  char* buf = malloc(capacity + 1);
 
-  char c;
-  while ((c = fgetc(file)) != EOF) {
-    sb_putc(sb, c);
+  for (;;) {
+    if (length == capacity) {
+      capacity *= 2;
+      buf = realloc(buf, capacity + 1);
+    }
+    long n = read(fd, buf + length, capacity - length);
+    if (n < 0) {
+      error("cannot read file\n");
+    }
+    if (n == 0) {
+      break;
+    }
+    length += n;
   }
-  return sb_run(sb);
+
+  buf[length] = '\0';
+  return buf;
+}
+
+// ファイルを読み取り専用でmmapする。
+// ファイル末尾のページの余りは0で埋められるので、それを終端文字として使う。
+// サイズがページ境界ちょうどの場合やmmapできない場合はread_fdにフォールバックする。
+char* read_file(char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    error("cannot open file: %s\n", path);
+  }
+
+  char* buf = NULL;
+  long size = lseek(fd, 0, SEEK_END);
+  if (size > 0 && size % sysconf(_SC_PAGESIZE) != 0) {
+    buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if ((long)buf < 0) { // MAP_FAILED
+      buf = NULL;
+    }
+  }
+
+  if (buf == NULL) {
+    lseek(fd, 0, SEEK_SET);
+    buf = read_fd(fd);
+  }
+
+  close(fd);
+  return buf;
 }
 
 static void consume() {
@@ -145,25 +190,75 @@ static void whitespace() {
   }
 }
 
-static char* punctuators[46] = {
-  "...", "<<=", ">>=",
-  "->", "++", "--", "<<", ">>", "<=", ">=", "==", "!=",
-  "&&", "||", "*=", "/=", "%=", "+=", "-=", "&=", "^=",
-  "|=",
-  "[", "]", "(", ")", "{", "}", ".", "&", "*", "+",
-  "-", "~", "!", "/", "%", "<", ">", "^", "|", "?",
-  ":", ";", "=", ","
-};
-
-static char* keywords[43] = {
-  "auto", "break", "case", "char", "const", "continue", "default",
-  "do", "double", "else", "enum", "extern", "float", "for", "goto",
-  "if", "inline", "int", "long", "register", "restrict", "return",
-  "short", "sizeof", "static", "struct", "switch", "typedef",
-  "union", "unsigned", "void", "volatile", "while",
-  "_Alignas", "_Alignof", "_Atomic", "_Bool", "_Complex", "_Generic",
-  "_Imaginary", "_Noreturn", "_Static_assert", "_Thread_local"
-};
+// 空白とコメントを読み飛ばす。長いコメントや空行の連続でも再帰しない
+static void skip_space(void) {
+  bool skipping = true;
+  while (skipping) {
+    if (*cur == ' ' || *cur == '\t' || *cur == '\n' || *cur == '\r') {
+      consume();
+    } else if (cur[0] == '/' && cur[1] == '*') {
+      while (!start_with("*/", cur)) {
+        consume();
+      }
+      consume();
+      consume();
+    } else if (cur[0] == '/' && cur[1] == '/') {
+      while (*cur != '\n' && *cur != '\0') {
+        consume();
+      }
+    } else {
+      skipping = false;
+    }
+  }
+}
+
+static bool is_kw(char* s, size_t len, char* keyword) {
+  return strlen(keyword) == len && strncmp(s, keyword, len) == 0;
+}
+
+// 読み込んだ識別子がキーワードかどうかを先頭文字で振り分けて判定する
+static bool is_keyword(char* s, size_t len) {
+  switch (s[0]) {
+  case 'a':
+    return is_kw(s, len, "auto");
+  case 'b':
+    return is_kw(s, len, "break");
+  case 'c':
+    return is_kw(s, len, "case") || is_kw(s, len, "char") || is_kw(s, len, "const") ||
+           is_kw(s, len, "continue");
+  case 'd':
+    return is_kw(s, len, "default") || is_kw(s, len, "do") || is_kw(s, len, "double");
+  case 'e':
+    return is_kw(s, len, "else") || is_kw(s, len, "enum") || is_kw(s, len, "extern");
+  case 'f':
+    return is_kw(s, len, "float") || is_kw(s, len, "for");
+  case 'g':
+    return is_kw(s, len, "goto");
+  case 'i':
+    return is_kw(s, len, "if") || is_kw(s, len, "inline") || is_kw(s, len, "int");
+  case 'l':
+    return is_kw(s, len, "long");
+  case 'r':
+    return is_kw(s, len, "register") || is_kw(s, len, "restrict") || is_kw(s, len, "return");
+  case 's':
+    return is_kw(s, len, "short") || is_kw(s, len, "sizeof") || is_kw(s, len, "static") ||
+           is_kw(s, len, "struct") || is_kw(s, len, "switch");
+  case 't':
+    return is_kw(s, len, "typedef");
+  case 'u':
+    return is_kw(s, len, "union") || is_kw(s, len, "unsigned");
+  case 'v':
+    return is_kw(s, len, "void") || is_kw(s, len, "volatile");
+  case 'w':
+    return is_kw(s, len, "while");
+  case '_':
+    return is_kw(s, len, "_Alignas") || is_kw(s, len, "_Alignof") || is_kw(s, len, "_Atomic") ||
+           is_kw(s, len, "_Bool") || is_kw(s, len, "_Complex") || is_kw(s, len, "_Generic") ||
+           is_kw(s, len, "_Imaginary") || is_kw(s, len, "_Noreturn") ||
+           is_kw(s, len, "_Static_assert") || is_kw(s, len, "_Thread_local");
+  }
+  return false;
+}
 
 static Token* integer(char* start) {
   Token* t = new_token(TINT, start);
@@ -177,12 +272,14 @@ static Token* integer(char* start) {
 
 static Token* ident(char* start) {
   Token* t = new_token(TIDENT, start);
-  StringBuilder* sb = new_sb();
   while (isalnum(*cur) || *cur == '_') {
-    sb_putc(sb, *cur);
     consume();
   }
-  t->ident = sb_run(sb);
+  size_t len = cur - start;
+  if (is_keyword(start, len)) {
+    t->tag = TRESERVED;
+  }
+  t->ident = intern_len(start, len);
   return t;
 }
 
@@ -192,6 +289,25 @@ static Token* new_reserved(char* start, char* ident) {
   return t;
 }
 
+// 記号を読む。候補のうち最も長いものを選ぶ
+static Token* punctuator(char* ident) {
+  Token* t = new_reserved(cur, ident);
+  cur += strlen(ident);
+  bol = false;
+  return t;
+}
+
+// c1, c2の順に続くかどうかで2文字・1文字の記号を選び分ける
+static Token* punct2(char c1, char* p1, char c2, char* p2, char* p) {
+  if (cur[1] == c1) {
+    return punctuator(p1);
+  }
+  if (c2 != '\0' && cur[1] == c2) {
+    return punctuator(p2);
+  }
+  return punctuator(p);
+}
+
 static char* read_include_path(void) {
   StringBuilder* sb = new_sb();
 
@@ -210,102 +326,69 @@ static char* read_include_path(void) {
   return sb_run(sb);
 }
 
-static Token* next_token(void) {
-  if (*cur == '\0') {
-    return NULL;
-  }
-
-  if (start_with("/*", cur)) {
-    while (!start_with("*/", cur)) {
-      consume();
-    }
-    consume();
-    consume();
-    return next_token();
+static Token* directive(void) {
+  consume();
+  if (start_with("define", cur)) {
+    Token* token = new_token(TDIRECTIVE, cur);
+    token->bol = true;
+    cur += strlen("define");
+    token->ident = "define";
+    return token;
+  } else if (start_with("include", cur)) {
+    Token* token = new_token(TDIRECTIVE, cur);
+    token->bol = true;
+    cur += strlen("include");
+    token->ident = "include";
+    whitespace();
+    token->str = read_include_path();
+    return token;
+  } else if (start_with("ifdef", cur)) {
+    Token* token = new_token(TDIRECTIVE, cur);
+    token->bol = true;
+    cur += strlen("ifdef");
+    token->ident = "ifdef";
+    return token;
+  } else if (start_with("ifndef", cur)) {
+    Token* token = new_token(TDIRECTIVE, cur);
+    token->bol = true;
+    cur += strlen("ifndef");
+    token->ident = "ifndef";
+    return token;
+  } else if (start_with("endif", cur)) {
+    Token* token = new_token(TDIRECTIVE, cur);
+    token->bol = true;
+    cur += strlen("endif");
+    token->ident = "endif";
+    return token;
+  } else if (start_with("pragma", cur)) {
+    // 引数はふつうのトークンとして続く
+    Token* token = new_token(TDIRECTIVE, cur);
+    token->bol = true;
+    cur += strlen("pragma");
+    token->ident = "pragma";
+    return token;
   }
+  print_line(src, cur);
+  error("invalid preprocessing directive\n");
+}
 
-  if (start_with("//", cur)) {
-    consume();
-    consume();
-    while (*cur != '\n') {
-      consume();
-    }
-    return next_token();
-  }
+// 先頭の1文字で振り分ける
+static Token* next_token(void) {
+  skip_space();
 
-  if (bol && *cur == '#') {
-    consume();
-    if (start_with("define", cur)) {
-      Token* token = new_token(TDIRECTIVE, cur);
-      token->bol = true;
-      cur += strlen("define");
-      token->ident = "define";
-      return token;
-    } else if (start_with("include", cur)) {
-      Token* token = new_token(TDIRECTIVE, cur);
-      token->bol = true;
-      cur += strlen("include");
-      token->ident = "include";
-      whitespace();
-      token->str = read_include_path();
-      return token;
-    } else if (start_with("ifdef", cur)) {
-      Token* token = new_token(TDIRECTIVE, cur);
-      token->bol = true;
-      cur += strlen("ifdef");
-      token->ident = "ifdef";
-      return token;
-    } else if (start_with("ifndef", cur)) {
-      Token* token = new_token(TDIRECTIVE, cur);
-      token->bol = true;
-      cur += strlen("ifndef");
-      token->ident = "ifndef";
-      return token;
-    } else if (start_with("endif", cur)) {
-      Token* token = new_token(TDIRECTIVE, cur);
-      token->bol = true;
-      cur += strlen("endif");
-      token->ident = "endif";
-      return token;
-    } else {
+  switch (*cur) {
+  case '\0':
+    return NULL;
+  case '#':
+    if (!bol) {
       print_line(src, cur);
-      error("invalid preprocessing directive\n");
+      error("invalid #\n");
     }
-  } else if (*cur == '#') {
-    print_line(src, cur);
-    error("invalid #\n");
-  }
-
-  if (strchr(" \t\n\r", *cur)) {
-    whitespace();
-    return next_token();
-  }
-
-  if (strchr("0123456789", *cur)) {
+    return directive();
+  case '0': case '1': case '2': case '3': case '4':
+  case '5': case '6': case '7': case '8': case '9':
     return integer(cur);
-  }
-
-  for (int i = 0; i < (sizeof(punctuators) / sizeof(char*)); i++) {
-    if (start_with(punctuators[i], cur)) {
-      Token* t = new_reserved(cur, punctuators[i]);
-      cur += strlen(punctuators[i]);
-      return t;
-    }
-  }
-
-  for (int i = 0; i < (sizeof(keywords) / sizeof(char*)); i++) {
-    if (start_with(keywords[i], cur)) {
-      Token* t = new_reserved(cur, keywords[i]);
-      cur += strlen(keywords[i]);
-      if (isalnum(*cur) || *cur == '_') {
-        cur -= strlen(keywords[i]);
-      } else {
-        return t;
-      }
-    }
-  }
-
-  if ('\"' == *cur) {
+  case '"': {
     char* start = cur;
     consume();
     StringBuilder* sb = new_sb();
@@ -317,8 +400,7 @@ static Token* next_token(void) {
     tok->str = sb_run(sb);
     return tok;
   }
-
-  if ('\'' == *cur) {
+  case '\'': {
     consume();
     Token* t = new_token(TINT, cur - 1);
     t->integer = read_char();
@@ -329,6 +411,67 @@ static Token* next_token(void) {
     consume();
     return t;
   }
+  case '.':
+    if (cur[1] == '.' && cur[2] == '.') {
+      return punctuator("...");
+    }
+    return punctuator(".");
+  case '<':
+    if (cur[1] == '<' && cur[2] == '=') {
+      return punctuator("<<=");
+    }
+    return punct2('<', "<<", '=', "<=", "<");
+  case '>':
+    if (cur[1] == '>' && cur[2] == '=') {
+      return punctuator(">>=");
+    }
+    return punct2('>', ">>", '=', ">=", ">");
+  case '-':
+    if (cur[1] == '>') {
+      return punctuator("->");
+    }
+    return punct2('-', "--", '=', "-=", "-");
+  case '+':
+    return punct2('+', "++", '=', "+=", "+");
+  case '&':
+    return punct2('&', "&&", '=', "&=", "&");
+  case '|':
+    return punct2('|', "||", '=', "|=", "|");
+  case '=':
+    return punct2('=', "==", '\0', NULL, "=");
+  case '!':
+    return punct2('=', "!=", '\0', NULL, "!");
+  case '*':
+    return punct2('=', "*=", '\0', NULL, "*");
+  case '/':
+    return punct2('=', "/=", '\0', NULL, "/");
+  case '%':
+    return punct2('=', "%=", '\0', NULL, "%");
+  case '^':
+    return punct2('=', "^=", '\0', NULL, "^");
+  case '[':
+    return punctuator("[");
+  case ']':
+    return punctuator("]");
+  case '(':
+    return punctuator("(");
+  case ')':
+    return punctuator(")");
+  case '{':
+    return punctuator("{");
+  case '}':
+    return punctuator("}");
+  case '~':
+    return punctuator("~");
+  case '?':
+    return punctuator("?");
+  case ':':
+    return punctuator(":");
+  case ';':
+    return punctuator(";");
+  case ',':
+    return punctuator(",");
+  }
 
   if (isalpha(*cur) || *cur == '_') {
     return ident(cur);
@@ -339,20 +482,22 @@ static Token* next_token(void) {
 }
 
 Token* lex(char* path) {
-  FILE* file = fopen(path, "r");
-  if (file == NULL) {
-    error("cannot open file: %s\n", path);
-  }
+  return lex_into(path, ARENA_TOKEN);
+}
 
-  src = read_file(file);
-  fclose(file);
+// トークンをarenaに確保して字句解析する
+Token* lex_into(char* path, int arena) {
+  src = read_file(path);
   cur = src;
-
-  Token* current = next_token();
-  Token* head = current;
-
-  while ((current->next = next_token()) != NULL) {
-    current = current->next;
+  bol = true;
+  token_arena = arena;
+
+  Token* head = NULL;
+  Token** tail = &head;
+  Token* tok;
+  while ((tok = next_token()) != NULL) {
+    *tail = tok;
+    tail = &tok->next;
   }
 
   return head;
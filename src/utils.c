@@ -48,27 +48,130 @@ int streq(char* s0, char* s1) {
   return strcmp(s0, s1) == 0;
 }
 
+/* string interning */
+
+static char** interned;
+static size_t interned_capacity;
+static size_t interned_length;
+
+static size_t hash_str(char* str, size_t len) {
+  size_t h = 5381;
+  for (size_t i = 0; i < len; i++) {
+    h = h * 33 + str[i];
+  }
+  return h;
+}
+
+static char** intern_slot(char** table, size_t capacity, char* str, size_t len) {
+  size_t i = hash_str(str, len) & (capacity - 1);
+  while (table[i] && !(strncmp(table[i], str, len) == 0 && table[i][len] == '\0')) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return table + i;
+}
+
+// 同じ内容の文字列には常に同じポインタを返す。
+// 識別子はすべてinternするので、名前の比較はポインタの比較で済む
+char* intern_len(char* str, size_t len) {
+  if (interned_length * 2 >= interned_capacity) {
+    size_t capacity = interned_capacity;
+    char** table = interned;
+
+    if (capacity == 0) {
+      interned_capacity = 1024;
+    } else {
+      interned_capacity = capacity * 2;
+    }
+    interned = calloc(interned_capacity, sizeof(char*));
+    for (size_t i = 0; i < capacity; i++) {
+      if (table[i]) {
+        char** slot = intern_slot(interned, interned_capacity, table[i], strlen(table[i]));
+        *slot = table[i];
+      }
+    }
+    free(table);
+  }
+
+  char** slot = intern_slot(interned, interned_capacity, str, len);
+  if (*slot == NULL) {
+    char* new = calloc(len + 1, sizeof(char));
+    memcpy(new, str, len);
+    *slot = new;
+    interned_length++;
+  }
+  return *slot;
+}
+
+char* intern(char* str) {
+  return intern_len(str, strlen(str));
+}
+
 StringBuilder* new_sb(void) {
   StringBuilder* sb = calloc(1, sizeof(StringBuilder));
-  sb->buf = calloc(8, sizeof(char));
-  sb->capacity = 8;
+  sb->buf = calloc(16, sizeof(char));
+  sb->capacity = 16;
   sb->length = 0;
   return sb;
 }
 
+// 少なくともsize文字を追記できるようにする。容量は倍々で増やす
+void sb_reserve(StringBuilder* sb, size_t size) {
+  if (sb->length + size <= sb->capacity) {
+    return;
+  }
+  size_t capacity = sb->capacity;
+  while (capacity < sb->length + size) {
+    capacity *= 2;
+  }
+  sb->buf = realloc(sb->buf, sizeof(char) * capacity);
+  sb->capacity = capacity;
+}
+
 void sb_putc(StringBuilder* sb, char c) {
-  while (sb->length >= sb->capacity) {
-    sb->capacity += 8;
-    sb->buf = realloc(sb->buf, sizeof(char) * sb->capacity);
+  if (sb->length == sb->capacity) {
+    sb_reserve(sb, 1);
   }
   sb->buf[sb->length] = c;
   sb->length++;
 }
 
+void sb_append(StringBuilder* sb, char* str, size_t len) {
+  sb_reserve(sb, len);
+  memcpy(sb->buf + sb->length, str, len);
+  sb->length += len;
+}
+
 void sb_puts(StringBuilder* sb, char* str) {
-  for (size_t i = 0; i < strlen(str); i++) {
-    sb_putc(sb, str[i]);
+  sb_append(sb, str, strlen(str));
+}
+
+#ifdef __hoc__
+void sb_printf(StringBuilder* sb, char* fmt, ...) {
+#endif
+#ifndef __hoc__
+void sb_printf(StringBuilder* sb, const char* fmt, ...) {
+#endif
+  va_list ap;
+  size_t avail = sb->capacity - sb->length;
+
+  va_start(ap, fmt);
+  size_t len = vsnprintf(sb->buf + sb->length, avail, fmt, ap);
+  va_end(ap);
+
+  // 入り切らなかった場合は領域を確保して書き直す
+  if (len >= avail) {
+    sb_reserve(sb, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(sb->buf + sb->length, len + 1, fmt, ap);
+    va_end(ap);
   }
+
+  sb->length += len;
+}
+
+// 確保済みの領域を残したまま中身を空にする
+void sb_reset(StringBuilder* sb) {
+  sb->length = 0;
 }
 
 char* sb_run(StringBuilder* sb) {
@@ -137,7 +240,7 @@ static void show_type_(StringBuilder* sb, Type* ty) {
     if (ty->array_size) {
       sb_puts(sb, "array(");
       show_type_(sb, ty->ptr_to);
-      sb_puts(sb, format(", %zu)", ty->array_size));
+      sb_printf(sb, ", %zu)", ty->array_size);
     } else {
       sb_puts(sb, "ptr(");
       show_type_(sb, ty->ptr_to);
@@ -146,7 +249,7 @@ static void show_type_(StringBuilder* sb, Type* ty) {
     break;
   case TY_STRUCT: {
     if (ty->tag) {
-      sb_puts(sb, format("struct %s", ty->tag));
+      sb_printf(sb, "struct %s", ty->tag);
     } else {
       sb_puts(sb, "struct");
     }
@@ -22,9 +22,55 @@ echo "~~~ gcc ~~~" &&
     cmp build/g1/node.s build/g2/node.s &&
     cmp build/g1/parse.s build/g2/parse.s &&
     cmp build/g1/sema.s build/g2/sema.s &&
+    cmp build/g1/fold.s build/g2/fold.s &&
     cmp build/g1/token.s build/g2/token.s &&
     cmp build/g1/utils.s build/g2/utils.s &&
     cmp build/g1/cpp.s build/g2/cpp.s &&
-    rm test/tmp.c test/tmp.s test/tmp.out test/tmp_hoc.s test/tmp_hoc.out &&
+    cmp build/g1/pch.s build/g2/pch.s &&
+    cmp build/g1/asm.s build/g2/asm.s &&
+    cmp build/g1/elf.s build/g2/elf.s &&
+    echo "~~~ parallel codegen ~~~" &&
+    ./hoc -func-jobs 4 src/parse.c > test/tmp_par.s &&
+    cmp build/g1/parse.s test/tmp_par.s &&
+    ./build/g1/hoc -func-jobs 3 test/tmp.c > test/tmp_par.s &&
+    gcc -static -o test/tmp_hoc.out test/tmp_par.s &&
+    ./test/tmp_hoc.out &&
+    echo "~~~ -o, -no-comments ~~~" &&
+    ./build/g1/hoc -no-comments -o test/tmp_par.s test/tmp.c &&
+    ! grep -q "^#" test/tmp_par.s &&
+    gcc -static -o test/tmp_hoc.out test/tmp_par.s &&
+    ./test/tmp_hoc.out &&
+    echo "~~~ object files ~~~" &&
+    ./build/g1/hoc -c -o test/tmp_hoc.o test/tmp.c &&
+    gcc -static -o test/tmp_hoc.out test/tmp_hoc.o &&
+    ./test/tmp_hoc.out &&
+    (for i in $(seq 20000); do echo "int f$i(int x) { return x * $i + $i; }"; done;
+     echo "int main() { return f20000(1) - 40000; }") > test/tmp_big.c &&
+    ./build/g1/hoc -c -func-jobs 2 -o test/tmp_hoc.o test/tmp_big.c > test/tmp_par.s &&
+    [ ! -s test/tmp_par.s ] &&
+    gcc -static -o test/tmp_hoc.out test/tmp_hoc.o &&
+    ./test/tmp_hoc.out &&
+    ./build/g1o/hoc -include-pch build/g1/hoc.pch src/parse.c > test/tmp_par.s &&
+    cmp build/g2/parse.s test/tmp_par.s &&
+    ./build/g1o/hoc -c -o test/tmp_hoc.o src/elf.c &&
+    cmp build/g1o/elf.o test/tmp_hoc.o &&
+    rm test/tmp_hoc.o &&
+    echo "~~~ IR backend ~~~" &&
+    ./build/g1/hoc -i test/tmp.c > test/tmp_hoc.s &&
+    gcc -static -o test/tmp_hoc.out test/tmp_hoc.s &&
+    ./test/tmp_hoc.out &&
+    ./build/g1/hoc -i -c -o test/tmp_hoc.o test/tmp.c &&
+    gcc -static -o test/tmp_hoc.out test/tmp_hoc.o &&
+    ./test/tmp_hoc.out &&
+    rm test/tmp_hoc.o &&
+    ./build/g1/ir/hoc src/parse.c > test/tmp_par.s &&
+    cmp build/g1/parse.s test/tmp_par.s &&
+    echo "~~~ initializers that do not fit ~~~" &&
+    echo "long big = (long)2000000000 + (long)2000000000;" > test/tmp_big.c &&
+    ! ./hoc test/tmp_big.c > /dev/null 2>&1 &&
+    echo "~~~ -run ~~~" &&
+    ./hoc -run test/tmp.c &&
+    (./hoc -run examples/fib.c; [ $? = 1 ]) &&
+    rm test/tmp.c test/tmp_big.c test/tmp.s test/tmp.out test/tmp_hoc.s test/tmp_hoc.out test/tmp_par.s &&
 
     echo OK
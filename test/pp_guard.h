@@ -0,0 +1,4 @@
+#ifndef PP_GUARD_H
+#define PP_GUARD_H
+int guarded;
+#endif
@@ -3,11 +3,16 @@
 #define G(A, B) (A + B)
 
 #include <pp_test.h>
+#include "pp_guard.h"
+#include "pp_guard.h"
+#include "pp_once.h"
+#include "pp_once.h"
 
 #ifdef A
 #endif
 
 int main(void) {
+  once = guarded;
   A;
   F(return 2);
   return G(2, 3);
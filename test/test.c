@@ -45,6 +45,22 @@ enum Enum {
 
 typedef int type_a;
 
+// 初期化式はコンパイル時に計算して.dataに置く
+int global_table[] = {2 * 8, C * 10 + 1, -3, sizeof(struct pair), (char)65};
+int global_padded[4] = {7};
+char global_buf[8] = "abc";
+char global_str[] = "xyz";
+char global_exact[3] = "abc";
+char global_after_exact = 7;
+long global_long_init = (long)2000000000 + 100000000;
+long global_neg_long = (long)-5 * 3;
+char* global_buf_p = global_buf + 2;
+int* global_g_p = &global_g[2];
+int* global_d_p = &global_d;
+struct pair global_pair;
+int* global_pair_y = &global_pair.y;
+char* global_str_p = "hello" + 1;
+
 int id(int x) {
   return x;
 }
@@ -69,6 +85,86 @@ int fib(int n) {
   }
 }
 
+// caseが多くて値が密に並んでいるのでジャンプテーブルになる
+int dense_switch(int n) {
+  switch (n) {
+  case -2: return 20;
+  case -1: return 10;
+  case 0: return 0;
+  case 1: return 11;
+  case 2: return 12;
+  case 4: return 14;
+  case 5:
+  case 6: return 16;
+  case 7: return 17;
+  default: return 99;
+  }
+}
+
+// 値が疎らなので二分探索になり、その中の密な部分はジャンプテーブルになる
+int sparse_switch(int n) {
+  int r = 0;
+  switch (n) {
+  case 1000: r = 1; break;
+  case 3: r = 2; break;
+  case 100000: r = 3; break;
+  case -7000: r = 4; break;
+  case 50: r = 5; break;
+  case 51: r = 6; break;
+  case 52: r = 7; break;
+  case 53: r = 8; break;
+  case 54: r = 9; break;
+  case 9999: r = 10; break;
+  }
+  return r;
+}
+
+int char_switch(char c) {
+  switch (c) {
+  case 'a': return 1;
+  case 'b': return 2;
+  case 'c':
+    switch (c + 1) {
+    case 'a': return 0;
+    case 'b': return 0;
+    case 'c': return 0;
+    case 'd': return 3;
+    case 'e': return 0;
+    }
+    return 0;
+  case 'd': return 4;
+  case 'z': return 26;
+  case -1: return -1;
+  }
+  return 0;
+}
+
+int add2(int a, int b) {
+  return a + b;
+}
+
+// 評価スタックのレジスタが一巡するほど深い式。退避した値の上で割り算や呼び出しをする
+int deep_expr(int x) {
+  return x + (x * (x - (x + (x * (x + (x - (x + (x + (x + (100 / (x + add2(x, 17 % (x + 1)) + (x > 1 && x < 9))))))))))));
+}
+
+// ループの中の変数はレジスタに置かれ、呼び出しをまたいでも値が残る。&をとる変数はフレームに置かれる
+int reg_locals(int n) {
+  int sum = 0;
+  int kept = 0;
+  char c = 2;
+  long big = 0;
+  int* p = &kept;
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      sum = add2(sum, i * j + c);
+      big = big + sum;
+      *p = *p + 1;
+    }
+  }
+  return sum + kept + big % 7;
+}
+
 static int static_global_a;
 
 static int static_func() {
@@ -370,6 +466,56 @@ int main() {
     break;
   }
   EXPECT(21, fib(7));
+  {
+    // 畳み込みで定数やx*1、x+0が消えても値は変わらない
+    char s[4];
+    s[0] = 5;
+    s[1] = 6;
+    s[2] = 7;
+    char* p = s + 2;
+    int a[3];
+    a[0] = 10;
+    a[1] = 11;
+    a[2] = 12;
+    int* q = a + 2;
+    int x = 9;
+    EXPECT(6, p[-1]);
+    EXPECT(5, *(p - 2));
+    EXPECT(11, q[-1]);
+    EXPECT(10, *(q + -2));
+    EXPECT(-9, -x * 1 + 0);
+    EXPECT(9, (x & -1) | 0 ^ 0);
+    EXPECT(-21, -7 * 3);
+    EXPECT(3, 7 / 2 - 0);
+    EXPECT(-1, ~0);
+    EXPECT(2, !0 + (0 && x) + (1 || x));
+    EXPECT(4, sizeof(x) * 1);
+  }
+  EXPECT(20, dense_switch(-2));
+  EXPECT(0, dense_switch(0));
+  EXPECT(99, dense_switch(3));
+  EXPECT(16, dense_switch(5));
+  EXPECT(16, dense_switch(6));
+  EXPECT(17, dense_switch(7));
+  EXPECT(99, dense_switch(8));
+  EXPECT(99, dense_switch(-3));
+  EXPECT(99, dense_switch(-2147483647 - 1));
+  EXPECT(4, sparse_switch(-7000));
+  EXPECT(2, sparse_switch(3));
+  EXPECT(0, sparse_switch(4));
+  EXPECT(5, sparse_switch(50));
+  EXPECT(9, sparse_switch(54));
+  EXPECT(0, sparse_switch(55));
+  EXPECT(10, sparse_switch(9999));
+  EXPECT(1, sparse_switch(1000));
+  EXPECT(3, sparse_switch(100000));
+  EXPECT(0, sparse_switch(100001));
+  EXPECT(2, char_switch('b'));
+  EXPECT(3, char_switch('c'));
+  EXPECT(4, char_switch('d'));
+  EXPECT(0, char_switch('e'));
+  EXPECT(26, char_switch('z'));
+  EXPECT(-1, char_switch(-1));
   EXPECT(2, (1, 2));
   {
     int a = 0;
@@ -414,6 +560,29 @@ int main() {
   }
   EXPECT(1, global_g[0]);
   EXPECT('h', global_h[0][0]);
+  EXPECT(16, global_table[0]);
+  EXPECT(21, global_table[1]);
+  EXPECT(-3, global_table[2]);
+  EXPECT(8, global_table[3]);
+  EXPECT(65, global_table[4]);
+  EXPECT(20, sizeof(global_table));
+  EXPECT(7, global_padded[0]);
+  EXPECT(0, global_padded[3]);
+  EXPECT('c', global_buf[2]);
+  EXPECT(0, global_buf[7]);
+  EXPECT(4, sizeof(global_str));
+  EXPECT('z', global_str[2]);
+  EXPECT(3, sizeof(global_exact));
+  EXPECT('c', global_exact[2]);
+  EXPECT(7, global_after_exact);
+  EXPECT(1, global_long_init == 2100000000);
+  EXPECT(-15, global_neg_long);
+  EXPECT('c', *global_buf_p);
+  EXPECT(3, *global_g_p);
+  EXPECT(42, *global_d_p);
+  global_pair.y = 5;
+  EXPECT(5, *global_pair_y);
+  EXPECT('e', global_str_p[0]);
   {
     int a = 'a';
     char* a_ptr = (char*)(&a);
@@ -425,6 +594,26 @@ int main() {
     EXPECT(42, a[0].x);
   }
   EXPECT(6, sum(3, 1, 2, 3));
+  EXPECT(138, deep_expr(3));
+  EXPECT(280, deep_expr(5));
+  EXPECT(85, reg_locals(4));
+  {
+    char c = 50;
+    EXPECT(1, (c + 0) < 300);
+    EXPECT(1, (c * 1) < 300);
+  }
+  EXPECT(1, (char)300 == 44);
+  {
+    long thousand = 1000;
+    long sum = (long)2000000000 + (long)2000000000;
+    EXPECT(1, sum / thousand == 4000000);
+    long product = (long)100000 * (long)100000;
+    EXPECT(1, product / thousand == 10000000);
+    int x = 0;
+    int* p = &x;
+    EXPECT(1, ((long)(p + 1000000000) - (long)p) / thousand == 4000000);
+  }
+  EXPECT(-1, (char)255);
   return 0;
 }
 